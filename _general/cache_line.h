@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+
+// What data written by different threads is aligned and padded to, so that
+// two hot variables never share a line and bounce it between cores.
+constexpr std::size_t kCacheLineSize{ 64 };
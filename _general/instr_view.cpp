@@ -0,0 +1,183 @@
+// Live view of another program's instruments (see instruments.h). Every
+// interval it prints how fast each counter and timer grew, the gauges, and
+// the percentiles of the timings recorded during that interval.
+//
+//   instr_view [PID] [--interval=MS] [--count=N]
+//
+// Without a PID it picks the only instrumented program running, or lists
+// them when there are several.
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <cerrno>
+#include <signal.h>
+#endif
+
+#include "instruments.h"
+
+namespace {
+  bool ProcessIsAlive(const uint64_t pid) {
+#ifdef _WIN32
+    HANDLE process{ OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(pid)) };
+    if (process == NULL) {
+      return false;
+    }
+    DWORD exit_code{};
+    const bool alive{ GetExitCodeProcess(process, &exit_code) and exit_code == STILL_ACTIVE };
+    CloseHandle(process);
+    return alive;
+#else
+    return kill(static_cast<pid_t>(pid), 0) == 0 or errno == EPERM;
+#endif
+  }
+
+  // Regions of programs that were killed stay behind in /dev/shm; those
+  // are listed as stale.
+  std::vector<uint64_t> FindInstrumentedPids() {
+    std::vector<uint64_t> pids{};
+#ifndef _WIN32
+    DIR* directory{ opendir("/dev/shm") };
+    if (not directory) {
+      return pids;
+    }
+    const std::string prefix{ "instr." };
+    while (const dirent* entry{ readdir(directory) }) {
+      const std::string name{ entry->d_name };
+      if (name.rfind(prefix, 0) == 0 and name.size() > prefix.size()) {
+        try {
+          pids.push_back(std::stoull(name.substr(prefix.size())));
+        }
+        catch (const std::exception&) {
+        }
+      }
+    }
+    closedir(directory);
+#endif
+    return pids;
+  }
+
+  // Upper bound of the bucket the quantile falls into, in microseconds.
+  double Percentile(const uint64_t (&buckets)[instr::kBuckets], const uint64_t total, const double quantile) {
+    if (total == 0) {
+      return 0.;
+    }
+    const uint64_t rank{ static_cast<uint64_t>(quantile * static_cast<double>(total - 1)) + 1 };
+    uint64_t seen{};
+    for (std::size_t i{}; i < instr::kBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return static_cast<double>(uint64_t{ 1 } << i) / 1e3;
+      }
+    }
+    return static_cast<double>(uint64_t{ 1 } << (instr::kBuckets - 1)) / 1e3;
+  }
+
+  void Print(const std::vector<instr::MetricSnapshot>& previous,
+             const std::vector<instr::MetricSnapshot>& current,
+             const double seconds) {
+    std::cout << std::left << std::setw(32) << "metric" << std::setw(9) << "kind" << std::right
+      << std::setw(14) << "total" << std::setw(13) << "per second" << std::setw(11) << "mean us"
+      << std::setw(11) << "p50 us" << std::setw(11) << "p90 us" << std::setw(11) << "p99 us" << "\n";
+    std::cout << std::fixed << std::setprecision(2);
+    for (std::size_t i{}; i < current.size(); ++i) {
+      const auto& metric{ current[i] };
+      std::cout << std::left << std::setw(32) << metric.name << std::setw(9) << instr::KindName(metric.kind)
+        << std::right;
+      if (metric.kind == instr::Kind::kGauge) {
+        std::cout << std::setw(14) << metric.gauge << "\n";
+        continue;
+      }
+      instr::MetricSnapshot delta{ metric };
+      if (i < previous.size()) {
+        delta.count -= previous[i].count;
+        delta.sum_ns -= previous[i].sum_ns;
+        for (std::size_t b{}; b < instr::kBuckets; ++b) {
+          delta.buckets[b] -= previous[i].buckets[b];
+        }
+      }
+      std::cout << std::setw(14) << metric.count
+        << std::setw(13) << (seconds > 0. ? static_cast<double>(delta.count) / seconds : 0.);
+      if (metric.kind == instr::Kind::kTimer) {
+        std::cout << std::setw(11)
+          << (delta.count == 0 ? 0. : static_cast<double>(delta.sum_ns) / static_cast<double>(delta.count) / 1e3)
+          << std::setw(11) << Percentile(delta.buckets, delta.count, 0.5)
+          << std::setw(11) << Percentile(delta.buckets, delta.count, 0.9)
+          << std::setw(11) << Percentile(delta.buckets, delta.count, 0.99);
+      }
+      std::cout << "\n";
+    }
+    std::cout << std::endl;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t pid{};
+  int interval_ms{ 1000 };
+  int count{};
+  for (int i{ 1 }; i < argc; ++i) {
+    const std::string argument{ argv[i] };
+    if (argument.rfind("--interval=", 0) == 0) {
+      interval_ms = (std::max)(10, std::stoi(argument.substr(11)));
+    }
+    else if (argument.rfind("--count=", 0) == 0) {
+      count = std::stoi(argument.substr(8));
+    }
+    else if (not argument.empty() and argument[0] != '-') {
+      pid = std::stoull(argument);
+    }
+    else {
+      std::cerr << "usage: " << argv[0] << " [PID] [--interval=MS] [--count=N]" << std::endl;
+      return 1;
+    }
+  }
+
+  if (pid == 0) {
+    std::vector<uint64_t> alive{};
+    for (const auto found : FindInstrumentedPids()) {
+      if (ProcessIsAlive(found)) {
+        alive.push_back(found);
+      }
+      else {
+        std::cerr << "stale region of pid " << found << std::endl;
+      }
+    }
+    if (alive.size() != 1) {
+      std::cerr << (alive.empty() ? "no instrumented program is running" : "several programs, pick one:")
+        << std::endl;
+      for (const auto found : alive) {
+        std::cerr << "  " << found << std::endl;
+      }
+      return 1;
+    }
+    pid = alive.front();
+  }
+
+  instr::Reader reader{};
+  if (not reader.Open(pid)) {
+    std::cerr << "no instruments found for pid " << pid << std::endl;
+    return 1;
+  }
+  using Clock = std::chrono::steady_clock;
+  auto previous{ reader.Read() };
+  auto previous_time{ Clock::now() };
+  for (int n{}; count == 0 or n < count; ++n) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{ interval_ms });
+    if (not ProcessIsAlive(pid)) {
+      std::cout << "pid " << pid << " has exited" << std::endl;
+      break;
+    }
+    auto current{ reader.Read() };
+    const auto now{ Clock::now() };
+    std::cout << "pid " << pid << "\n";
+    Print(previous, current, std::chrono::duration<double>(now - previous_time).count());
+    previous = std::move(current);
+    previous_time = now;
+  }
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Counters, gauges and scoped timers that another process can watch while
+// the program runs. Everything lives in one shared memory region per
+// process, "instr.<pid>", much like SharedMemory hands the picture from p1
+// to p2: a header with the metric names, one row of gauges and a slot per
+// thread with a cell per metric. A thread only ever writes its own slot,
+// so recording is a plain load and store on a line nobody else writes.
+// Readers (instr_view) sum the slots and never stop the program.
+//
+//   instr::Counter frames{ "p1.frames" };
+//   instr::Timer paint{ "p1.paint" };
+//   { instr::ScopedTimer timing{ paint }; ... }
+//   frames.Add();
+
+namespace instr {
+  constexpr uint32_t kMagic{ 0x52545349 };
+  constexpr uint32_t kVersion{ 1 };
+  constexpr std::size_t kMaxMetrics{ 64 };
+  // The last slot is shared by the threads that did not get one of their
+  // own and is only ever updated with atomic additions.
+  constexpr std::size_t kMaxThreads{ 64 };
+  constexpr std::size_t kNameSize{ 48 };
+  // Bucket i counts durations <= 2^i ns, the last one everything above.
+  constexpr std::size_t kBuckets{ 32 };
+  constexpr std::size_t kNoMetric{ kMaxMetrics };
+
+  enum class Kind : uint32_t {
+    kNone,
+    kCounter,
+    kGauge,
+    kTimer,
+  };
+
+  inline const char* KindName(const Kind kind) {
+    switch (kind) {
+    case Kind::kCounter:
+      return "counter";
+    case Kind::kGauge:
+      return "gauge";
+    case Kind::kTimer:
+      return "timer";
+    default:
+      return "none";
+    }
+  }
+
+  struct Descriptor {
+    char name[kNameSize];
+    std::atomic<uint32_t> kind;
+  };
+
+  // Counters use |count| only, timers all of it.
+  struct alignas(64) Cell {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_ns;
+    std::atomic<uint64_t> buckets[kBuckets];
+  };
+
+  struct alignas(64) ThreadSlot {
+    std::atomic<uint32_t> in_use;
+    Cell cells[kMaxMetrics];
+  };
+
+  // Zero-filled memory is a valid empty region, which is what a fresh
+  // mapping gives us. A metric is published by writing its name, then its
+  // kind, then bumping |metric_count|.
+  struct Region {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t pid;
+    std::atomic<uint32_t> metric_count;
+    Descriptor descriptors[kMaxMetrics];
+    std::atomic<int64_t> gauges[kMaxMetrics];
+    ThreadSlot threads[kMaxThreads];
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free, "the region is shared between processes");
+
+  inline std::string RegionName(const uint64_t pid) {
+    return "instr." + std::to_string(pid);
+  }
+
+  inline uint64_t CurrentPid() {
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return static_cast<uint64_t>(getpid());
+#endif
+  }
+
+  inline std::size_t Bucket(const uint64_t ns) {
+    if (ns <= 1) {
+      return 0;
+    }
+    std::size_t index{};
+    for (uint64_t rest{ ns - 1 }; rest != 0; rest >>= 1) {
+      ++index;
+    }
+    return (std::min)(index, kBuckets - 1);
+  }
+
+  // Maps a region of kRegionSize bytes, either creating it or opening an
+  // existing one read-only.
+  class Mapping {
+  public:
+    static constexpr std::size_t kRegionSize{ sizeof(Region) };
+
+    Mapping() = default;
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+    ~Mapping() {
+      Close();
+    }
+
+    bool Create(const std::string& name) {
+      Close();
+#ifdef _WIN32
+      handle_ = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+        static_cast<DWORD>(kRegionSize), ("Local\\" + name).c_str());
+      if (handle_ == NULL) {
+        return false;
+      }
+      address_ = MapViewOfFile(handle_, FILE_MAP_ALL_ACCESS, 0, 0, kRegionSize);
+#else
+      const std::string path{ "/" + name };
+      const int fd{ shm_open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600) };
+      if (fd < 0) {
+        return false;
+      }
+      if (ftruncate(fd, static_cast<off_t>(kRegionSize)) == 0) {
+        address_ = mmap(nullptr, kRegionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      }
+      close(fd);
+      if (address_ == MAP_FAILED) {
+        address_ = nullptr;
+      }
+      if (not address_) {
+        shm_unlink(path.c_str());
+      }
+#endif
+      return address_ != nullptr;
+    }
+
+    bool Open(const std::string& name) {
+      Close();
+#ifdef _WIN32
+      handle_ = OpenFileMappingA(FILE_MAP_READ, FALSE, ("Local\\" + name).c_str());
+      if (handle_ == NULL) {
+        return false;
+      }
+      address_ = MapViewOfFile(handle_, FILE_MAP_READ, 0, 0, kRegionSize);
+#else
+      const int fd{ shm_open(("/" + name).c_str(), O_RDONLY, 0) };
+      if (fd < 0) {
+        return false;
+      }
+      struct stat status {};
+      if (fstat(fd, &status) == 0 and static_cast<std::size_t>(status.st_size) >= kRegionSize) {
+        address_ = mmap(nullptr, kRegionSize, PROT_READ, MAP_SHARED, fd, 0);
+      }
+      close(fd);
+      if (address_ == MAP_FAILED) {
+        address_ = nullptr;
+      }
+#endif
+      return address_ != nullptr;
+    }
+
+    void Close() {
+#ifdef _WIN32
+      if (address_) {
+        UnmapViewOfFile(address_);
+      }
+      if (handle_) {
+        CloseHandle(handle_);
+        handle_ = NULL;
+      }
+#else
+      if (address_) {
+        munmap(address_, kRegionSize);
+      }
+#endif
+      address_ = nullptr;
+    }
+
+    Region* region() const {
+      return static_cast<Region*>(address_);
+    }
+
+  private:
+    void* address_{ nullptr };
+#ifdef _WIN32
+    HANDLE handle_{ NULL };
+#endif
+  };
+
+  // The writing side, one per process. It is never destroyed, so threads
+  // still running during exit() keep writing into valid memory; the region
+  // name is unlinked at exit so readers see the program is gone.
+  class Registry {
+  public:
+    static Registry& Instance() {
+      static Registry* registry{ new Registry{} };
+      return *registry;
+    }
+
+    std::size_t Register(const char* name, const Kind kind) {
+      std::lock_guard<std::mutex> lock{ access_ };
+      const uint32_t count{ region_->metric_count.load(std::memory_order_relaxed) };
+      for (uint32_t i{}; i < count; ++i) {
+        if (std::strncmp(region_->descriptors[i].name, name, kNameSize - 1) == 0) {
+          return i;
+        }
+      }
+      if (count >= kMaxMetrics) {
+        return kNoMetric;
+      }
+      auto& descriptor{ region_->descriptors[count] };
+      std::strncpy(descriptor.name, name, kNameSize - 1);
+      descriptor.kind.store(static_cast<uint32_t>(kind), std::memory_order_release);
+      region_->metric_count.store(count + 1, std::memory_order_release);
+      return count;
+    }
+
+    std::atomic<int64_t>& Gauge(const std::size_t index) {
+      return region_->gauges[index];
+    }
+
+    // Adds to a cell of the calling thread's slot.
+    void Add(const std::size_t index, const uint64_t count, const uint64_t ns, const bool timed) {
+      auto& slot{ LocalSlot() };
+      Cell& cell{ slot.slot->cells[index] };
+      Increase(cell.count, count, slot.shared);
+      if (timed) {
+        Increase(cell.sum_ns, ns, slot.shared);
+        Increase(cell.buckets[Bucket(ns)], 1, slot.shared);
+      }
+    }
+
+    const std::string& name() const {
+      return name_;
+    }
+
+    bool is_shared() const {
+      return shared_;
+    }
+
+  private:
+    struct LocalSlotHolder {
+      ThreadSlot* slot{ nullptr };
+      bool shared{ false };
+
+      ~LocalSlotHolder() {
+        if (slot and not shared) {
+          slot->in_use.store(0, std::memory_order_release);
+        }
+      }
+    };
+
+    Registry() : name_{ RegionName(CurrentPid()) } {
+      shared_ = mapping_.Create(name_);
+      if (shared_) {
+        region_ = mapping_.region();
+#ifndef _WIN32
+        std::atexit([] {
+          shm_unlink(("/" + Instance().name()).c_str());
+        });
+#endif
+      }
+      else {
+        // Nobody can watch, but the program still runs unchanged.
+        private_region_.reset(new Region{});
+        region_ = private_region_.get();
+      }
+      region_->magic = kMagic;
+      region_->version = kVersion;
+      region_->pid = CurrentPid();
+    }
+
+    // A slot given back by a finished thread is handed out again without
+    // being cleared, so the sums the readers see never go down.
+    LocalSlotHolder& LocalSlot() {
+      thread_local LocalSlotHolder holder{};
+      if (not holder.slot) {
+        for (std::size_t i{}; i + 1 < kMaxThreads; ++i) {
+          uint32_t expected{ 0 };
+          if (region_->threads[i].in_use.compare_exchange_strong(expected, 1, std::memory_order_acq_rel)) {
+            holder.slot = &region_->threads[i];
+            return holder;
+          }
+        }
+        holder.slot = &region_->threads[kMaxThreads - 1];
+        holder.shared = true;
+      }
+      return holder;
+    }
+
+    static void Increase(std::atomic<uint64_t>& value, const uint64_t amount, const bool shared) {
+      if (shared) {
+        value.fetch_add(amount, std::memory_order_relaxed);
+      }
+      else {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+      }
+    }
+
+    std::mutex access_;
+    std::string name_;
+    bool shared_{ false };
+    Mapping mapping_;
+    std::unique_ptr<Region> private_region_;
+    Region* region_{ nullptr };
+  };
+
+  class Counter {
+  public:
+    explicit Counter(const char* name) : index_{ Registry::Instance().Register(name, Kind::kCounter) } {}
+
+    void Add(const uint64_t value = 1) {
+      if (index_ != kNoMetric) {
+        Registry::Instance().Add(index_, value, 0, false);
+      }
+    }
+
+  private:
+    std::size_t index_;
+  };
+
+  // A single process-wide value, so unlike counters it is one atomic that
+  // every thread writes.
+  class Gauge {
+  public:
+    explicit Gauge(const char* name) : index_{ Registry::Instance().Register(name, Kind::kGauge) } {}
+
+    void Set(const int64_t value) {
+      if (index_ != kNoMetric) {
+        Registry::Instance().Gauge(index_).store(value, std::memory_order_relaxed);
+      }
+    }
+
+    void Add(const int64_t delta) {
+      if (index_ != kNoMetric) {
+        Registry::Instance().Gauge(index_).fetch_add(delta, std::memory_order_relaxed);
+      }
+    }
+
+  private:
+    std::size_t index_;
+  };
+
+  class Timer {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit Timer(const char* name) : index_{ Registry::Instance().Register(name, Kind::kTimer) } {}
+
+    void Record(const Clock::duration duration) {
+      if (index_ != kNoMetric) {
+        const auto ns{ std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() };
+        Registry::Instance().Add(index_, 1, static_cast<uint64_t>((std::max)(ns, decltype(ns){})), true);
+      }
+    }
+
+  private:
+    std::size_t index_;
+  };
+
+  class ScopedTimer {
+  public:
+    explicit ScopedTimer(Timer& timer) : timer_{ timer }, started_{ Timer::Clock::now() } {}
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+    ~ScopedTimer() {
+      timer_.Record(Timer::Clock::now() - started_);
+    }
+
+  private:
+    Timer& timer_;
+    Timer::Clock::time_point started_;
+  };
+
+  // The reading side: sums all thread slots into one value per metric.
+  struct MetricSnapshot {
+    std::string name;
+    Kind kind{ Kind::kNone };
+    uint64_t count{}, sum_ns{};
+    int64_t gauge{};
+    uint64_t buckets[kBuckets]{};
+  };
+
+  class Reader {
+  public:
+    bool Open(const uint64_t pid) {
+      if (not mapping_.Open(RegionName(pid))) {
+        return false;
+      }
+      const Region* region{ mapping_.region() };
+      if (region->magic != kMagic or region->version != kVersion) {
+        mapping_.Close();
+        return false;
+      }
+      return true;
+    }
+
+    std::vector<MetricSnapshot> Read() const {
+      const Region* region{ mapping_.region() };
+      std::vector<MetricSnapshot> metrics{};
+      if (not region) {
+        return metrics;
+      }
+      const uint32_t count{ (std::min)(region->metric_count.load(std::memory_order_acquire),
+                                       static_cast<uint32_t>(kMaxMetrics)) };
+      metrics.resize(count);
+      for (uint32_t i{}; i < count; ++i) {
+        auto& metric{ metrics[i] };
+        metric.kind = static_cast<Kind>(region->descriptors[i].kind.load(std::memory_order_acquire));
+        metric.name.assign(region->descriptors[i].name,
+          strnlen(region->descriptors[i].name, kNameSize));
+        metric.gauge = region->gauges[i].load(std::memory_order_relaxed);
+        for (const auto& slot : region->threads) {
+          const Cell& cell{ slot.cells[i] };
+          metric.count += cell.count.load(std::memory_order_relaxed);
+          metric.sum_ns += cell.sum_ns.load(std::memory_order_relaxed);
+          for (std::size_t b{}; b < kBuckets; ++b) {
+            metric.buckets[b] += cell.buckets[b].load(std::memory_order_relaxed);
+          }
+        }
+      }
+      return metrics;
+    }
+
+  private:
+    Mapping mapping_;
+  };
+}
@@ -33,9 +33,26 @@ THE SOFTWARE.
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <iterator>
 #include <sstream>
-#include <stack>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define JZON_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define JZON_TARGET(isa)
+#else
+#include <immintrin.h>
+#define JZON_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
 
 namespace jzon {
   namespace {
@@ -69,6 +86,91 @@ namespace jzon {
       }
       return nullUnescaped;
     }
+
+    bool equalsIgnoringCase(std::string_view token, const char *word) {
+      size_t i = 0;
+      for (; i < token.size() && word[i] != '\0'; ++i) {
+        if (std::tolower(static_cast<unsigned char>(token[i])) != word[i]) {
+          return false;
+        }
+      }
+      return i == token.size() && word[i] == '\0';
+    }
+
+    // Same rules the parser has always used: an optional minus, digits with
+    // at most one dot, then optionally E, a sign and at least one digit.
+    bool isNumber(std::string_view token) {
+      size_t i = 0;
+      if (i < token.size() && token[i] == '-') ++i;
+      bool digits = false, fraction = false;
+      for (; i < token.size(); ++i) {
+        if (token[i] >= '0' && token[i] <= '9') {
+          digits = true;
+        }
+        else if (token[i] == '.' && !fraction) {
+          fraction = true;
+        }
+        else {
+          break;
+        }
+      }
+      if (!digits) {
+        return false;
+      }
+      if (i < token.size() && (token[i] == 'e' || token[i] == 'E')) {
+        ++i;
+        if (i < token.size() && (token[i] == '+' || token[i] == '-')) ++i;
+        bool exponent = false;
+        for (; i < token.size() && token[i] >= '0' && token[i] <= '9'; ++i) {
+          exponent = true;
+        }
+        if (!exponent) {
+          return false;
+        }
+      }
+      return i == token.size();
+    }
+
+    size_t hashName(std::string_view name) {
+      return std::hash<std::string_view>()(name);
+    }
+
+    bool readHex4(const char *&cursor, const char *end, unsigned long &code) {
+      if (end - cursor < 4) {
+        return false;
+      }
+      code = 0;
+      for (int i = 0; i < 4; ++i) {
+        const char c = *cursor++;
+        code <<= 4;
+        if (c >= '0' && c <= '9') code |= static_cast<unsigned long>(c - '0');
+        else if (c >= 'a' && c <= 'f') code |= static_cast<unsigned long>(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') code |= static_cast<unsigned long>(c - 'A' + 10);
+        else return false;
+      }
+      return true;
+    }
+
+    void appendUtf8(std::string &out, unsigned long code) {
+      if (code < 0x80) {
+        out += static_cast<char>(code);
+      }
+      else if (code < 0x800) {
+        out += static_cast<char>(0xC0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+      }
+      else if (code < 0x10000) {
+        out += static_cast<char>(0xE0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+      }
+      else {
+        out += static_cast<char>(0xF0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+      }
+    }
   }  // namespace
 
   Node::Node() : data(NULL) {}
@@ -116,6 +218,10 @@ namespace jzon {
       if (isNull()) {
         return std::string("null");
       }
+      else if (isNumber()) {
+        char buffer[kNumberBufferSize];
+        return std::string(buffer, formatNumber(buffer));
+      }
       else {
         return data->valueStr;
       }
@@ -124,20 +230,46 @@ namespace jzon {
       return def;
     }
   }
-#define GET_NUMBER(T)                       \
-  if (isNumber()) {                         \
-    std::stringstream sstr(data->valueStr); \
-    T val;                                  \
-    sstr >> val;                            \
-    return val;                             \
-  } else {                                  \
-    return def;                             \
-  }
-  int Node::toInt(int def) const { GET_NUMBER(int) }
-  int Node::toLong(int def) const { GET_NUMBER(long) }
-  float Node::toFloat(float def) const { GET_NUMBER(float) }
-  double Node::toDouble(double def) const { GET_NUMBER(double) }
-#undef GET_NUMBER
+  // Integral reads drop the fraction and clamp to the range of the result,
+  // as the stream extraction they replaced did.
+  int Node::toInt(int def) const {
+    if (isNumber()) {
+      const long long value = toLong();
+      return (value < INT_MIN ? INT_MIN : (value > INT_MAX ? INT_MAX : static_cast<int>(value)));
+    }
+    else {
+      return def;
+    }
+  }
+  long long Node::toLong(long long def) const {
+    if (!isNumber()) {
+      return def;
+    }
+    switch (data->numberType) {
+    case N_INT:
+      return data->number.i;
+    case N_UINT:
+      return (data->number.u > LLONG_MAX ? LLONG_MAX : static_cast<long long>(data->number.u));
+    default:
+      const double value = data->number.d;
+      if (value != value) {
+        return 0;
+      }
+      else if (value >= 9223372036854775808.0) {
+        return LLONG_MAX;
+      }
+      else if (value < -9223372036854775808.0) {
+        return LLONG_MIN;
+      }
+      return static_cast<long long>(value);
+    }
+  }
+  float Node::toFloat(float def) const {
+    return (isNumber() ? static_cast<float>(numberAsDouble()) : def);
+  }
+  double Node::toDouble(double def) const {
+    return (isNumber() ? numberAsDouble() : def);
+  }
   bool Node::toBool(bool def) const {
     if (isBool()) {
       return (data->valueStr == "true");
@@ -154,14 +286,19 @@ namespace jzon {
       data->valueStr.clear();
     }
   }
+  // Text that is not a number leaves a T_NUMBER request without effect.
   void Node::set(Type type, const std::string &value) {
-    if (isValue() && (type == T_NULL || type == T_STRING || type == T_NUMBER ||
-      type == T_BOOL)) {
+    if (isValue() && (type == T_NULL || type == T_STRING ||
+      (type == T_NUMBER && jzon::isNumber(value)) || type == T_BOOL)) {
       detach();
       data->type = type;
       if (type == T_STRING) {
         data->valueStr = unescapeString(value);
       }
+      else if (type == T_NUMBER) {
+        data->valueStr.clear();
+        setNumber(value);
+      }
       else {
         data->valueStr = value;
       }
@@ -181,21 +318,96 @@ namespace jzon {
       data->valueStr = unescapeString(std::string(value));
     }
   }
-#define SET_NUMBER               \
+#define SET_NUMBER(TYPE, FIELD)  \
   if (isValue()) {               \
     detach();                    \
     data->type = T_NUMBER;       \
-    std::stringstream sstr;      \
-    sstr << value;               \
-    data->valueStr = sstr.str(); \
-  }
-  void Node::set(int value) { SET_NUMBER }
-  void Node::set(unsigned int value) { SET_NUMBER }
-  void Node::set(long long value) { SET_NUMBER }
-  void Node::set(unsigned long long value) { SET_NUMBER }
-  void Node::set(float value) { SET_NUMBER }
-  void Node::set(double value) { SET_NUMBER }
+    data->valueStr.clear();      \
+    data->numberType = TYPE;     \
+    data->number.FIELD = value;  \
+  }
+  void Node::set(int value) { SET_NUMBER(N_INT, i) }
+  void Node::set(unsigned int value) { SET_NUMBER(N_INT, i) }
+  void Node::set(long long value) { SET_NUMBER(N_INT, i) }
+  void Node::set(unsigned long long value) { SET_NUMBER(N_UINT, u) }
+  void Node::set(float value) { SET_NUMBER(N_FLOAT, d) }
+  void Node::set(double value) { SET_NUMBER(N_DOUBLE, d) }
 #undef SET_NUMBER
+
+  // Integers are kept exactly while they fit 64 bits; anything else is read
+  // as the nearest double. |text| has already passed isNumber().
+  void Node::setNumber(std::string_view text) {
+    const char *first = text.data();
+    const char *last = text.data() + text.size();
+    if (text.find_first_of(".eE") == std::string_view::npos) {
+      const std::from_chars_result asSigned = std::from_chars(first, last, data->number.i);
+      // "-0" is left to the double, the only type that keeps its sign.
+      if (asSigned.ec == std::errc() && asSigned.ptr == last && (data->number.i != 0 || text[0] != '-')) {
+        data->numberType = N_INT;
+        return;
+      }
+      const std::from_chars_result asUnsigned = std::from_chars(first, last, data->number.u);
+      if (asUnsigned.ec == std::errc() && asUnsigned.ptr == last) {
+        data->numberType = N_UINT;
+        return;
+      }
+    }
+    data->numberType = N_DOUBLE;
+    const std::from_chars_result result = std::from_chars(first, last, data->number.d);
+    if (result.ec == std::errc::result_out_of_range) {
+      // Too small becomes zero and too large infinity, keeping the sign.
+      const size_t exponent = text.find_first_of("eE");
+      const size_t digits = (text[0] == '-' ? 1 : 0);
+      const bool tiny = (exponent != std::string_view::npos ? text[exponent + 1] == '-' :
+        text.find_first_not_of('0', digits) == text.find('.'));
+      data->number.d = (tiny ? 0.0 : HUGE_VAL);
+      if (text[0] == '-') data->number.d = -data->number.d;
+    }
+    else if (result.ec != std::errc()) {
+      data->number.d = 0.0;
+    }
+  }
+  // Writes the shortest text that reads back as the same value; floats are
+  // written as floats so 0.1f stays "0.1". JSON has no infinity or NaN, so
+  // those come out as an overflowing literal and null.
+  size_t Node::formatNumber(char *buffer) const {
+    char *last = buffer + kNumberBufferSize;
+    if (data->numberType == N_FLOAT || data->numberType == N_DOUBLE) {
+      const double value = data->number.d;
+      const char *special = (value != value ? "null" : (value == HUGE_VAL ? "1e999" : (value == -HUGE_VAL ? "-1e999" : nullptr)));
+      if (special != nullptr) {
+        const size_t length = std::strlen(special);
+        std::memcpy(buffer, special, length);
+        return length;
+      }
+    }
+    std::to_chars_result result;
+    switch (data->numberType) {
+    case N_INT:
+      result = std::to_chars(buffer, last, data->number.i);
+      break;
+    case N_UINT:
+      result = std::to_chars(buffer, last, data->number.u);
+      break;
+    case N_FLOAT:
+      result = std::to_chars(buffer, last, static_cast<float>(data->number.d));
+      break;
+    default:
+      result = std::to_chars(buffer, last, data->number.d);
+      break;
+    }
+    return static_cast<size_t>(result.ptr - buffer);
+  }
+  double Node::numberAsDouble() const {
+    switch (data->numberType) {
+    case N_INT:
+      return static_cast<double>(data->number.i);
+    case N_UINT:
+      return static_cast<double>(data->number.u);
+    default:
+      return data->number.d;
+    }
+  }
   void Node::set(bool value) {
     if (isValue()) {
       detach();
@@ -263,6 +475,12 @@ namespace jzon {
     if (isObject()) {
       detach();
       data->children.push_back(std::make_pair(name, node));
+      if (!data->memberIndex.empty() && data->children.size() * 2 <= data->memberIndex.size()) {
+        data->indexMember(data->children.size() - 1);
+      }
+      else {
+        data->updateMemberIndex();
+      }
     }
   }
   void Node::append(const Node &node) {
@@ -270,6 +488,7 @@ namespace jzon {
       detach();
       data->children.insert(data->children.end(), node.data->children.begin(),
         node.data->children.end());
+      data->updateMemberIndex();
     }
   }
   void Node::remove(size_t index) {
@@ -277,6 +496,7 @@ namespace jzon {
       detach();
       NamedNodeList::iterator it = data->children.begin() + index;
       data->children.erase(it);
+      data->updateMemberIndex();
     }
   }
   void Node::remove(const std::string &name) {
@@ -287,6 +507,7 @@ namespace jzon {
         ++it) {
         if ((*it).first == name) {
           children.erase(it);
+          data->updateMemberIndex();
           break;
         }
       }
@@ -296,35 +517,47 @@ namespace jzon {
     if (data != NULL && !data->children.empty()) {
       detach();
       data->children.clear();
+      data->updateMemberIndex();
     }
   }
 
-  bool Node::has(const std::string &name) const {
-    if (isObject()) {
-      NamedNodeList &children = data->children;
-      for (NamedNodeList::const_iterator it = children.begin();
-        it != children.end(); ++it) {
-        if ((*it).first == name) {
-          return true;
-        }
-      }
-    }
-    return false;
+  bool Node::has(std::string_view name) const {
+    return (findMember(name) != nullptr);
   }
   size_t Node::getCount() const {
     return data != NULL ? data->children.size() : 0;
   }
-  Node Node::get(const std::string &name) const {
-    if (isObject()) {
-      NamedNodeList &children = data->children;
+  Node Node::get(std::string_view name) const {
+    const NamedNode *member = findMember(name);
+    return (member != nullptr ? member->second : Node(T_INVALID));
+  }
+  // Objects without an index, narrow ones or those handed out through a
+  // mutable iterator, are scanned in order. Lookups never build the index,
+  // so they stay reads of the shared Data. Either way the first of several
+  // members with the same name is found.
+  const NamedNode *Node::findMember(std::string_view name) const {
+    if (!isObject()) {
+      return nullptr;
+    }
+    const NamedNodeList &children = data->children;
+    if (data->memberIndex.empty()) {
       for (NamedNodeList::const_iterator it = children.begin();
         it != children.end(); ++it) {
         if ((*it).first == name) {
-          return (*it).second;
+          return &*it;
         }
       }
+      return nullptr;
     }
-    return Node(T_INVALID);
+    const std::vector<uint32_t> &index = data->memberIndex;
+    const size_t mask = index.size() - 1;
+    for (size_t slot = hashName(name) & mask; index[slot] != 0; slot = (slot + 1) & mask) {
+      const NamedNode &member = children[index[slot] - 1];
+      if (member.first == name) {
+        return &member;
+      }
+    }
+    return nullptr;
   }
   Node Node::get(size_t index) const {
     if (isContainer() && index < data->children.size()) {
@@ -358,22 +591,76 @@ namespace jzon {
       return Node::const_iterator(NULL);
   }
 
+  // Numbers compare by value, so 1, 1u and 1.0 are all equal.
   bool Node::operator==(const Node &other) const {
-    return ((data == other.data) ||
-      (isValue() && (data->type == other.data->type) &&
-      (data->valueStr == other.data->valueStr)));
+    if (data == other.data) {
+      return true;
+    }
+    else if (!isValue() || getType() != other.getType()) {
+      return false;
+    }
+    else if (!isNumber()) {
+      return (data->valueStr == other.data->valueStr);
+    }
+    const NumberType type = data->numberType, otherType = other.data->numberType;
+    if (type == N_INT && otherType == N_INT) {
+      return (data->number.i == other.data->number.i);
+    }
+    else if (type == N_UINT && otherType == N_UINT) {
+      return (data->number.u == other.data->number.u);
+    }
+    else if (type == N_INT && otherType == N_UINT) {
+      return (data->number.i >= 0 && static_cast<unsigned long long>(data->number.i) == other.data->number.u);
+    }
+    else if (type == N_UINT && otherType == N_INT) {
+      return (other.data->number.i >= 0 && static_cast<unsigned long long>(other.data->number.i) == data->number.u);
+    }
+    return (numberAsDouble() == other.numberAsDouble());
   }
   bool Node::operator!=(const Node &other) const { return !(*this == other); }
 
-  Node::Data::Data(Type type) : refCount(1), type(type) {}
+  Node::Data::Data(Type type) : refCount(1), type(type), numberType(N_INT), number() {}
   Node::Data::Data(const Data &other)
     : refCount(1),
     type(other.type),
+    numberType(other.numberType),
+    number(other.number),
     valueStr(other.valueStr),
-    children(other.children) {}
+    children(other.children),
+    memberIndex(other.memberIndex) {}
   Node::Data::~Data() { assert(refCount == 0); }
   void Node::Data::addRef() { ++refCount; }
   bool Node::Data::release() { return (--refCount == 0); }
+  // Called after every change to an object's members: wide objects get a
+  // fresh index, narrow ones none.
+  void Node::Data::updateMemberIndex() {
+    if (type == T_OBJECT && children.size() > kLinearLookupLimit) {
+      rebuildMemberIndex();
+    }
+    else {
+      memberIndex.clear();
+    }
+  }
+  // Keeps the table at most half full.
+  void Node::Data::rebuildMemberIndex() {
+    size_t capacity = 16;
+    while (capacity < children.size() * 2) capacity *= 2;
+    memberIndex.assign(capacity, 0);
+    for (size_t i = 0; i < children.size(); ++i) {
+      indexMember(i);
+    }
+  }
+  void Node::Data::indexMember(size_t position) {
+    const std::string &name = children[position].first;
+    const size_t mask = memberIndex.size() - 1;
+    size_t slot = hashName(name) & mask;
+    for (; memberIndex[slot] != 0; slot = (slot + 1) & mask) {
+      if (children[memberIndex[slot] - 1].first == name) {
+        return;
+      }
+    }
+    memberIndex[slot] = static_cast<uint32_t>(position + 1);
+  }
 
   std::string escapeString(const std::string &value) {
     std::string escaped;
@@ -498,6 +785,10 @@ namespace jzon {
     if (node.isString()) {
       stream << "\"" << escapeString(node.toString()) << "\"";
     }
+    else if (node.isNumber()) {
+      char buffer[Node::kNumberBufferSize];
+      stream.write(buffer, static_cast<std::streamsize>(node.formatNumber(buffer)));
+    }
     else {
       stream << node.toString();
     }
@@ -512,366 +803,596 @@ namespace jzon {
     }
   }
 
-  Parser::Parser() {}
-  Parser::~Parser() {}
-
-  Node Parser::parseStream(std::istream &stream) {
-    TokenQueue tokens;
-    DataQueue data;
-
-    tokenize(stream, tokens, data);
-    Node node = assemble(tokens, data);
-
-    return node;
-  }
-  Node Parser::parseString(const std::string &json) {
-    std::istringstream stream(json);
-    return parseStream(stream);
-  }
-  Node Parser::parseFile(const std::string &filename) {
-    std::ifstream stream(filename.c_str(), std::ios::in);
-    return parseStream(stream);
-  }
-
-  const std::string &Parser::getError() const { return error; }
-
-  void Parser::tokenize(std::istream &stream, TokenQueue &tokens,
-    DataQueue &data) {
-    Token token = T_UNKNOWN;
-    std::string valueBuffer;
-    bool saveBuffer;
-
-    char c = '\0';
-    while (stream.peek() != std::char_traits<char>::eof()) {
-      stream.get(c);
-
-      if (isWhitespace(c)) continue;
-
-      saveBuffer = true;
-
-      switch (c) {
-      case '{': {
-        token = T_OBJ_BEGIN;
-        break;
-      }
-      case '}': {
-        token = T_OBJ_END;
-        break;
-      }
-      case '[': {
-        token = T_ARRAY_BEGIN;
-        break;
-      }
-      case ']': {
-        token = T_ARRAY_END;
-        break;
-      }
-      case ',': {
-        token = T_SEPARATOR_NODE;
-        break;
-      }
-      case ':': {
-        token = T_SEPARATOR_NAME;
-        break;
-      }
-      case '"': {
-        token = T_VALUE;
-        readString(stream, data);
-        break;
-      }
-      case '/': {
-        char p = static_cast<char>(stream.peek());
-        if (p == '*') {
-          jumpToCommentEnd(stream);
-          saveBuffer = false;
-          break;
+  // Stage 1: classify the input 64 bytes at a time into bit masks, work out
+  // which bytes are inside strings with a handful of shifts, and write down
+  // where every token starts. The kernels only differ in how they produce
+  // the masks of one block.
+  namespace {
+    struct BlockMasks {
+      uint64_t quote;
+      uint64_t backslash;
+      uint64_t structural;
+      uint64_t whitespace;
+      uint64_t slash;
+    };
+
+    const size_t kBlockSize = 64;
+    // Blocks classified per kernel call, so the call itself does not show.
+    const size_t kBlocksPerBatch = 256;
+
+    enum CharClass {
+      C_QUOTE = 1,
+      C_BACKSLASH = 2,
+      C_STRUCTURAL = 4,
+      C_WHITESPACE = 8,
+      C_SLASH = 16
+    };
+
+    struct CharClassTable {
+      unsigned char classes[256];
+      CharClassTable() : classes() {
+        classes[static_cast<unsigned char>('"')] = C_QUOTE;
+        classes[static_cast<unsigned char>('\\')] = C_BACKSLASH;
+        for (const char c : { '{', '}', '[', ']', ':', ',' }) {
+          classes[static_cast<unsigned char>(c)] = C_STRUCTURAL;
         }
-        else if (p == '/') {
-          jumpToNext('\n', stream);
-          saveBuffer = false;
-          break;
+        for (const char c : { ' ', '\t', '\n', '\r', '\f' }) {
+          classes[static_cast<unsigned char>(c)] = C_WHITESPACE;
         }
-        // Intentional fallthrough
-      }
-      default: {
-        valueBuffer += c;
-        saveBuffer = false;
-        break;
+        classes[static_cast<unsigned char>('/')] = C_SLASH;
       }
+    };
+
+    void classifyScalar(const char *data, size_t blocks, BlockMasks *masks) {
+      static const CharClassTable table;
+      for (size_t block = 0; block < blocks; ++block, data += kBlockSize) {
+        BlockMasks m = { 0, 0, 0, 0, 0 };
+        for (size_t i = 0; i < kBlockSize; ++i) {
+          const uint64_t c = table.classes[static_cast<unsigned char>(data[i])];
+          m.quote |= (c & 1) << i;
+          m.backslash |= ((c >> 1) & 1) << i;
+          m.structural |= ((c >> 2) & 1) << i;
+          m.whitespace |= ((c >> 3) & 1) << i;
+          m.slash |= ((c >> 4) & 1) << i;
+        }
+        masks[block] = m;
       }
+    }
 
-      if ((saveBuffer || stream.peek() == std::char_traits<char>::eof()) &&
-        (!valueBuffer.empty()))  // Always save buffer on the last character
-      {
-        if (interpretValue(valueBuffer, data)) {
-          tokens.push(T_VALUE);
+#ifdef JZON_X86
+    // pcmpestrm matches each byte against a small set in one instruction;
+    // explicit lengths keep NUL bytes in the input from ending the match.
+    JZON_TARGET("sse4.2")
+    void classifySse42(const char *data, size_t blocks, BlockMasks *masks) {
+      const __m128i structurals = _mm_setr_epi8('{', '}', '[', ']', ':', ',', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+      const __m128i whitespaces = _mm_setr_epi8(' ', '\t', '\n', '\r', '\f', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+      const __m128i quote = _mm_set1_epi8('"');
+      const __m128i backslash = _mm_set1_epi8('\\');
+      const __m128i slash = _mm_set1_epi8('/');
+      const int mode = _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+      for (size_t block = 0; block < blocks; ++block, data += kBlockSize) {
+        BlockMasks m = { 0, 0, 0, 0, 0 };
+        for (int part = 0; part < 4; ++part) {
+          const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * part));
+          const int shift = 16 * part;
+          m.structural |= static_cast<uint64_t>(
+            static_cast<uint16_t>(_mm_cvtsi128_si32(_mm_cmpestrm(structurals, 6, in, 16, mode)))) << shift;
+          m.whitespace |= static_cast<uint64_t>(
+            static_cast<uint16_t>(_mm_cvtsi128_si32(_mm_cmpestrm(whitespaces, 5, in, 16, mode)))) << shift;
+          m.quote |= static_cast<uint64_t>(
+            static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(in, quote)))) << shift;
+          m.backslash |= static_cast<uint64_t>(
+            static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(in, backslash)))) << shift;
+          m.slash |= static_cast<uint64_t>(
+            static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(in, slash)))) << shift;
         }
-        else {
-          // Store the unknown token, so we can show it to the user
-          data.push(std::make_pair(Node::T_STRING, valueBuffer));
-          tokens.push(T_UNKNOWN);
-        }
-
-        valueBuffer.clear();
+        masks[block] = m;
       }
+    }
 
-      // Push the token last so that any data
-      // will get pushed first from above.
-      // If saveBuffer is false, it means that
-      // we are in the middle of a value, so we
-      // don't want to push any tokens now.
-      if (saveBuffer) {
-        tokens.push(token);
+    // '[' and '{' as well as ']' and '}' differ only in bit 0x20, so two
+    // compares after OR-ing it in find all four brackets.
+    JZON_TARGET("avx2")
+    void classifyAvx2(const char *data, size_t blocks, BlockMasks *masks) {
+      const __m256i case_bit = _mm256_set1_epi8(0x20);
+      const __m256i open = _mm256_set1_epi8('{');
+      const __m256i close = _mm256_set1_epi8('}');
+      const __m256i colon = _mm256_set1_epi8(':');
+      const __m256i comma = _mm256_set1_epi8(',');
+      const __m256i space = _mm256_set1_epi8(' ');
+      const __m256i tab = _mm256_set1_epi8('\t');
+      const __m256i newline = _mm256_set1_epi8('\n');
+      const __m256i carriage_return = _mm256_set1_epi8('\r');
+      const __m256i form_feed = _mm256_set1_epi8('\f');
+      const __m256i quote = _mm256_set1_epi8('"');
+      const __m256i backslash = _mm256_set1_epi8('\\');
+      const __m256i slash = _mm256_set1_epi8('/');
+      for (size_t block = 0; block < blocks; ++block, data += kBlockSize) {
+        BlockMasks m = { 0, 0, 0, 0, 0 };
+        for (int part = 0; part < 2; ++part) {
+          const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32 * part));
+          const __m256i folded = _mm256_or_si256(in, case_bit);
+          const __m256i structural = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(folded, open), _mm256_cmpeq_epi8(folded, close)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(in, colon), _mm256_cmpeq_epi8(in, comma)));
+          const __m256i whitespace = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(in, space), _mm256_cmpeq_epi8(in, tab)),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(in, newline), _mm256_cmpeq_epi8(in, carriage_return)),
+              _mm256_cmpeq_epi8(in, form_feed)));
+          const int shift = 32 * part;
+          m.structural |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(structural))) << shift;
+          m.whitespace |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(whitespace))) << shift;
+          m.quote |= static_cast<uint64_t>(
+            static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(in, quote)))) << shift;
+          m.backslash |= static_cast<uint64_t>(
+            static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(in, backslash)))) << shift;
+          m.slash |= static_cast<uint64_t>(
+            static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(in, slash)))) << shift;
+        }
+        masks[block] = m;
       }
     }
-  }
-  Node Parser::assemble(TokenQueue &tokens, DataQueue &data) {
-    std::stack<NamedNode> nodeStack;
-    Node root(Node::T_INVALID);
+#endif
 
-    std::string nextName = "";
+    inline unsigned int lowestBit(uint64_t bits) {
+#ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward64(&index, bits);
+      return static_cast<unsigned int>(index);
+#else
+      return static_cast<unsigned int>(__builtin_ctzll(bits));
+#endif
+    }
 
-    Token token;
-    while (!tokens.empty()) {
-      token = tokens.front();
-      tokens.pop();
+    // Bit i of the result is set when an odd number of bits at or below i
+    // are set, i.e. when byte i lies between an opening and closing quote.
+    inline uint64_t prefixXor(uint64_t bits) {
+      bits ^= bits << 1;
+      bits ^= bits << 2;
+      bits ^= bits << 4;
+      bits ^= bits << 8;
+      bits ^= bits << 16;
+      bits ^= bits << 32;
+      return bits;
+    }
 
-      switch (token) {
-      case T_UNKNOWN: {
-        const std::string &unknownToken = data.front().second;
-        error = "Unknown token: " + unknownToken;
-        data.pop();
-        return Node(Node::T_INVALID);
-      }
-      case T_OBJ_BEGIN: {
-        nodeStack.push(std::make_pair(nextName, object()));
-        nextName.clear();
-        break;
-      }
-      case T_ARRAY_BEGIN: {
-        nodeStack.push(std::make_pair(nextName, array()));
-        nextName.clear();
-        break;
-      }
-      case T_OBJ_END:
-      case T_ARRAY_END: {
-        if (nodeStack.empty()) {
-          error = "Found end of object or array without beginning";
-          return Node(Node::T_INVALID);
-        }
-        if (token == T_OBJ_END && !nodeStack.top().second.isObject()) {
-          error = "Mismatched end and beginning of object";
-          return Node(Node::T_INVALID);
-        }
-        if (token == T_ARRAY_END && !nodeStack.top().second.isArray()) {
-          error = "Mismatched end and beginning of array";
-          return Node(Node::T_INVALID);
+    // The bytes escaped by a backslash, walking only the backslashes, which
+    // are rare. |carry| says the first byte of the block is escaped.
+    inline uint64_t escapedBytes(uint64_t backslash, uint64_t &carry) {
+      uint64_t escaped = carry;
+      backslash &= ~carry;
+      carry = 0;
+      while (backslash != 0) {
+        const unsigned int i = lowestBit(backslash);
+        if (i == 63) {
+          carry = 1;
+          break;
         }
+        const uint64_t next = uint64_t(1) << (i + 1);
+        escaped |= next;
+        backslash &= ~next;
+        backslash &= backslash - 1;
+      }
+      return escaped;
+    }
 
-        std::string nodeName = nodeStack.top().first;
-        Node node = nodeStack.top().second;
-        nodeStack.pop();
+    typedef void (*ClassifyKernel)(const char *, size_t, BlockMasks *);
 
-        if (!nodeStack.empty()) {
-          Node &stackTop = nodeStack.top().second;
-          if (stackTop.isObject()) {
-            stackTop.add(nodeName, node);
-          }
-          else if (stackTop.isArray()) {
-            stackTop.add(node);
-          }
-          else {
-            error = "Can only add elements to objects and arrays";
-            return Node(Node::T_INVALID);
-          }
-        }
-        else {
-          root = node;
-        }
-        break;
-      }
-      case T_VALUE: {
-        if (data.empty()) {
-          error = "Missing data for value";
-          return Node(Node::T_INVALID);
-        }
+    ClassifyKernel kernelFunction(IndexKernel kernel) {
+#ifdef JZON_X86
+      if (kernel == K_AVX2) return classifyAvx2;
+      if (kernel == K_SSE42) return classifySse42;
+#else
+      (void)kernel;
+#endif
+      return classifyScalar;
+    }
+  }  // namespace
 
-        const std::pair<Node::Type, std::string> &dataPair = data.front();
-        if (!tokens.empty() && tokens.front() == T_SEPARATOR_NAME) {
-          tokens.pop();
-          if (dataPair.first != Node::T_STRING) {
-            error = "A name has to be a string";
-            return Node(Node::T_INVALID);
-          }
-          else {
-            nextName = dataPair.second;
-            data.pop();
-          }
-        }
-        else {
-          Node node(dataPair.first, dataPair.second);
-          data.pop();
+  IndexKernel bestIndexKernel() {
+#ifdef JZON_X86
+    static const IndexKernel best = [] {
+#ifdef _MSC_VER
+      int info[4];
+      __cpuid(info, 1);
+      const bool sse42 = (info[2] & (1 << 20)) != 0;
+      const bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 &&
+        (_xgetbv(0) & 6) == 6;
+      __cpuidex(info, 7, 0);
+      const bool avx2 = os_saves_ymm && (info[1] & (1 << 5)) != 0;
+#else
+      __builtin_cpu_init();
+      const bool sse42 = __builtin_cpu_supports("sse4.2");
+      const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+      return avx2 ? K_AVX2 : (sse42 ? K_SSE42 : K_SCALAR);
+    }();
+    return best;
+#else
+    return K_SCALAR;
+#endif
+  }
 
-          if (!nodeStack.empty()) {
-            Node &stackTop = nodeStack.top().second;
-            if (stackTop.isObject())
-              stackTop.add(nextName, node);
-            else if (stackTop.isArray())
-              stackTop.add(node);
+  const char *indexKernelName(IndexKernel kernel) {
+    switch (kernel) {
+    case K_AVX2:
+      return "avx2";
+    case K_SSE42:
+      return "sse4.2";
+    default:
+      return "scalar";
+    }
+  }
 
-            nextName.clear();
-          }
-          else {
-            error = "Outermost node must be an object or array";
-            return Node(Node::T_INVALID);
-          }
-        }
-        break;
+  // Every opening and closing quote, structural character and first byte
+  // of a number or literal outside strings goes into |index|, followed by
+  // the input size as a sentinel. Returns false, leaving the parser to
+  // walk the bytes itself, for input with comments (any '/' outside a
+  // string), an unterminated string or more than 4 GB.
+  bool buildStructuralIndex(std::string_view json, std::vector<uint32_t> &index, IndexKernel kernel) {
+    index.clear();
+    if (json.size() >= UINT32_MAX) {
+      return false;
+    }
+    if (kernel > bestIndexKernel()) {
+      kernel = bestIndexKernel();
+    }
+    const ClassifyKernel classify = kernelFunction(kernel);
+
+    BlockMasks masks[kBlocksPerBatch];
+    size_t count = 0;
+    index.resize(json.size() / 8 + kBlockSize);
+    uint64_t escape_carry = 0, in_string_carry = 0, scalar_carry = 0;
+    const size_t full_blocks = json.size() / kBlockSize;
+    for (size_t first = 0; first * kBlockSize < json.size(); first += kBlocksPerBatch) {
+      size_t blocks = full_blocks - first < kBlocksPerBatch ? full_blocks - first : kBlocksPerBatch;
+      classify(json.data() + first * kBlockSize, blocks, masks);
+      if (blocks < kBlocksPerBatch && (first + blocks) * kBlockSize < json.size()) {
+        // The tail, padded with spaces so the kernels can read whole blocks.
+        char tail[kBlockSize];
+        const size_t offset = (first + blocks) * kBlockSize;
+        std::memset(tail, ' ', sizeof(tail));
+        std::memcpy(tail, json.data() + offset, json.size() - offset);
+        classify(tail, 1, masks + blocks);
+        ++blocks;
       }
-      case T_SEPARATOR_NAME:
-        break;
-      case T_SEPARATOR_NODE: {
-        if (!tokens.empty() && tokens.front() == T_ARRAY_END) {
-          error = "Extra comma in array";
-          return Node(Node::T_INVALID);
+      for (size_t block = 0; block < blocks; ++block) {
+        const BlockMasks &m = masks[block];
+        const uint64_t quote = m.quote & ~escapedBytes(m.backslash, escape_carry);
+        const uint64_t in_string = prefixXor(quote) ^ in_string_carry;
+        in_string_carry = static_cast<uint64_t>(static_cast<int64_t>(in_string) >> 63);
+        if ((m.slash & ~in_string) != 0) {
+          return false;
         }
-        break;
-      }
+        const uint64_t scalar = ~(m.structural | m.whitespace | quote | in_string);
+        const uint64_t scalar_starts = scalar & ~((scalar << 1) | scalar_carry);
+        scalar_carry = scalar >> 63;
+        uint64_t bits = (m.structural & ~in_string) | quote | scalar_starts;
+
+        if (index.size() < count + kBlockSize) {
+          index.resize(index.size() * 2 + kBlockSize);
+        }
+        uint32_t *out = index.data() + count;
+        const uint32_t base = static_cast<uint32_t>((first + block) * kBlockSize);
+        while (bits != 0) {
+          *out++ = base + lowestBit(bits);
+          bits &= bits - 1;
+        }
+        count = static_cast<size_t>(out - index.data());
       }
     }
-
-    return root;
+    if (in_string_carry != 0) {
+      return false;
+    }
+    // Padding spaces never produce entries, so nothing past the end is in.
+    index.resize(count + 1);
+    index[count] = static_cast<uint32_t>(json.size());
+    return true;
   }
 
-  void Parser::jumpToNext(char c, std::istream &stream) {
-    while (!stream.eof() && static_cast<char>(stream.get()) != c)
-      ;
-    stream.unget();
-  }
-  void Parser::jumpToCommentEnd(std::istream &stream) {
-    stream.ignore(1);
-    char c1 = '\0', c2 = '\0';
-    while (stream.peek() != std::char_traits<char>::eof()) {
-      stream.get(c2);
+  Parser::Parser() : begin(nullptr), cursor(nullptr), end(nullptr), structurals(nullptr), useStructuralIndex(false) {}
+  Parser::~Parser() {}
 
-      if (c1 == '*' && c2 == '/') break;
+  Node Parser::parseStream(std::istream &stream) {
+    const std::string json((std::istreambuf_iterator<char>(stream)),
+      std::istreambuf_iterator<char>());
+    return parseString(json);
+  }
+  Node Parser::parseString(std::string_view json) {
+    error.clear();
+    begin = cursor = json.data();
+    end = json.data() + json.size();
+    structurals = nullptr;
+    if (useStructuralIndex && json.size() >= kIndexThreshold && buildStructuralIndex(json, index)) {
+      structurals = index.data();
+    }
 
-      c1 = c2;
+    Node root;
+    if (!skipWhitespace()) {
+      return Node(Node::T_INVALID);
+    }
+    if (cursor == end || (*cursor != '{' && *cursor != '[')) {
+      fail("Outermost node must be an object or array");
+      return Node(Node::T_INVALID);
+    }
+    if (!parseValue(root, 0) || !skipWhitespace()) {
+      return Node(Node::T_INVALID);
     }
+    if (cursor != end) {
+      fail("Unexpected data after the outermost node");
+      return Node(Node::T_INVALID);
+    }
+    return root;
+  }
+  Node Parser::parseFile(const std::string &filename) {
+    std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+    return parseStream(stream);
   }
 
-  void Parser::readString(std::istream &stream, DataQueue &data) {
-    std::string str;
+  const std::string &Parser::getError() const { return error; }
 
-    bool backslash_occured = false;
-    char c1 = '\0', c2 = '\0';
-    while (stream.peek() != std::char_traits<char>::eof()) {
-      stream.get(c2);
-      if ((backslash_occured || c1 != '\\') && c2 == '"') {
-        break;
-      }
+  void Parser::setStructuralIndex(bool enabled) { useStructuralIndex = enabled; }
 
-      str += c2;
+  bool Parser::fail(const std::string &message) {
+    if (error.empty()) {
+      error = message;
+    }
+    return false;
+  }
 
-      if (c1 == '\\' && c2 == '\\') {
-        if (backslash_occured) {
-          backslash_occured = false;
-        }
-        else {
-          backslash_occured = true;
+  // Skips whitespace as well as // and /* */ comments. With a structural
+  // index the next token is simply the next entry at or after the cursor.
+  bool Parser::skipWhitespace() {
+    if (structurals != nullptr) {
+      const size_t offset = static_cast<size_t>(cursor - begin);
+      while (*structurals < offset) ++structurals;
+      cursor = begin + *structurals;
+      return true;
+    }
+    while (cursor != end) {
+      if (isWhitespace(*cursor)) {
+        ++cursor;
+      }
+      else if (*cursor == '/' && cursor + 1 != end && cursor[1] == '/') {
+        while (cursor != end && *cursor != '\n') ++cursor;
+      }
+      else if (*cursor == '/' && cursor + 1 != end && cursor[1] == '*') {
+        cursor += 2;
+        while (cursor != end && !(*cursor == '*' && cursor + 1 != end && cursor[1] == '/')) ++cursor;
+        if (cursor == end) {
+          return fail("Unterminated comment");
         }
+        cursor += 2;
       }
       else {
-        backslash_occured = false;
+        break;
       }
-      c1 = c2;
     }
+    return true;
+  }
 
-    data.push(std::make_pair(Node::T_STRING, str));
+  // |node| is always a fresh, invalid node here, so its data is created in
+  // place instead of being assigned from a temporary.
+  bool Parser::parseValue(Node &node, unsigned int depth) {
+    if (!skipWhitespace()) {
+      return false;
+    }
+    if (cursor == end) {
+      return fail("Unexpected end of input");
+    }
+    switch (*cursor) {
+    case '{':
+      return parseObject(node, depth + 1);
+    case '[':
+      return parseArray(node, depth + 1);
+    case '"':
+      node.data = new Node::Data(Node::T_STRING);
+      return readString(node.data->valueStr, true);
+    default:
+      return parseScalar(node);
+    }
   }
-  bool Parser::interpretValue(const std::string &value, DataQueue &data) {
-    std::string upperValue(value.size(), '\0');
 
-    std::transform(value.begin(), value.end(), upperValue.begin(), toupper);
+  bool Parser::parseObject(Node &node, unsigned int depth) {
+    if (depth > kMaxDepth) {
+      return fail("Nesting is too deep");
+    }
+    ++cursor;
+    node.data = new Node::Data(Node::T_OBJECT);
+    Node::NamedNodeList &children = node.data->children;
+    if (!skipWhitespace()) {
+      return false;
+    }
+    if (cursor != end && *cursor == '}') {
+      ++cursor;
+      return true;
+    }
+    while (true) {
+      if (!skipWhitespace()) {
+        return false;
+      }
+      if (cursor == end || *cursor != '"') {
+        return fail("A name has to be a string");
+      }
+      // Names are kept as written, which is also how Writer puts them out.
+      std::string name;
+      if (!readString(name, false) || !skipWhitespace()) {
+        return false;
+      }
+      if (cursor == end || *cursor != ':') {
+        return fail("Expected ':' after the name \"" + name + "\"");
+      }
+      ++cursor;
+      children.emplace_back(std::move(name), Node());
+      if (!parseValue(children.back().second, depth) || !skipWhitespace()) {
+        return false;
+      }
+      if (cursor == end) {
+        return fail("Unexpected end of input");
+      }
+      const char c = *cursor++;
+      if (c == '}') {
+        node.data->updateMemberIndex();
+        return true;
+      }
+      if (c != ',') {
+        return fail("Expected ',' or '}' after a member");
+      }
+      if (!skipWhitespace()) {
+        return false;
+      }
+      if (cursor != end && *cursor == '}') {
+        return fail("Extra comma in object");
+      }
+    }
+  }
+
+  bool Parser::parseArray(Node &node, unsigned int depth) {
+    if (depth > kMaxDepth) {
+      return fail("Nesting is too deep");
+    }
+    ++cursor;
+    node.data = new Node::Data(Node::T_ARRAY);
+    Node::NamedNodeList &children = node.data->children;
+    if (!skipWhitespace()) {
+      return false;
+    }
+    if (cursor != end && *cursor == ']') {
+      ++cursor;
+      return true;
+    }
+    while (true) {
+      children.emplace_back(std::string(), Node());
+      if (!parseValue(children.back().second, depth) || !skipWhitespace()) {
+        return false;
+      }
+      if (cursor == end) {
+        return fail("Unexpected end of input");
+      }
+      const char c = *cursor++;
+      if (c == ']') {
+        return true;
+      }
+      if (c != ',') {
+        return fail("Expected ',' or ']' after an element");
+      }
+      if (!skipWhitespace()) {
+        return false;
+      }
+      if (cursor != end && *cursor == ']') {
+        return fail("Extra comma in array");
+      }
+    }
+  }
 
-    if (upperValue == "NULL") {
-      data.push(std::make_pair(Node::T_NULL, std::string()));
+  // Numbers are converted as they are read; null, true and false are matched
+  // regardless of case, as they always have been.
+  bool Parser::parseScalar(Node &node) {
+    const char *begin = cursor;
+    while (cursor != end && !isWhitespace(*cursor) && *cursor != ',' &&
+      *cursor != ']' && *cursor != '}' && *cursor != '/') {
+      ++cursor;
     }
-    else if (upperValue == "TRUE") {
-      data.push(std::make_pair(Node::T_BOOL, std::string("true")));
+    const std::string_view token(begin, static_cast<size_t>(cursor - begin));
+    if (equalsIgnoringCase(token, "null")) {
+      node.data = new Node::Data(Node::T_NULL);
     }
-    else if (upperValue == "FALSE") {
-      data.push(std::make_pair(Node::T_BOOL, std::string("false")));
+    else if (equalsIgnoringCase(token, "true")) {
+      node.data = new Node::Data(Node::T_BOOL);
+      node.data->valueStr = "true";
+    }
+    else if (equalsIgnoringCase(token, "false")) {
+      node.data = new Node::Data(Node::T_BOOL);
+      node.data->valueStr = "false";
+    }
+    else if (isNumber(token)) {
+      node.data = new Node::Data(Node::T_NUMBER);
+      node.setNumber(token);
     }
     else {
-      bool number = true;
-      bool negative = false;
-      bool fraction = false;
-      bool scientific = false;
-      bool scientificSign = false;
-      bool scientificNumber = false;
-      for (std::string::const_iterator it = upperValue.begin();
-        number && it != upperValue.end(); ++it) {
-        char c = (*it);
-        switch (c) {
-        case '-': {
-          if (scientific) {
-            if (scientificSign)  // Only one - allowed after E
-              number = false;
-            else
-              scientificSign = true;
-          }
-          else {
-            if (negative)  // Only one - allowed before E
-              number = false;
-            else
-              negative = true;
-          }
-          break;
-        }
-        case '+': {
-          if (!scientific || scientificSign)
-            number = false;
-          else
-            scientificSign = true;
-          break;
-        }
-        case '.': {
-          if (fraction)  // Only one . allowed
-            number = false;
-          else
-            fraction = true;
-          break;
-        }
-        case 'E': {
-          if (scientific)
-            number = false;
-          else
-            scientific = true;
-          break;
+      return fail("Unknown token: " + std::string(token.empty() ? std::string_view(begin, 1) : token));
+    }
+    return true;
+  }
+
+  // The common case, a string without escapes, is found with one scan and
+  // copied once; only from the first backslash on is it built char by char.
+  bool Parser::readString(std::string &value, bool unescape) {
+    if (structurals != nullptr && begin + *structurals == cursor) {
+      // The index has the closing quote right after the opening one.
+      const char *first = cursor + 1;
+      const char *closing = begin + structurals[1];
+      if (std::memchr(first, '\\', static_cast<size_t>(closing - first)) == nullptr) {
+        value.assign(first, closing);
+        cursor = closing + 1;
+        structurals += 2;
+        return true;
+      }
+    }
+    const char *first = ++cursor;
+    while (cursor != end && *cursor != '"' && *cursor != '\\') ++cursor;
+    value.assign(first, cursor);
+    while (cursor != end && *cursor != '"') {
+      const char c = *cursor++;
+      if (c != '\\' || cursor == end) {
+        value += c;
+        continue;
+      }
+      const char e = *cursor++;
+      if (!unescape) {
+        value += c;
+        value += e;
+        continue;
+      }
+      switch (e) {
+      case '"':
+      case '\\':
+      case '/':
+        value += e;
+        break;
+      case 'b':
+        value += '\b';
+        break;
+      case 'f':
+        value += '\f';
+        break;
+      case 'n':
+        value += '\n';
+        break;
+      case 'r':
+        value += '\r';
+        break;
+      case 't':
+        value += '\t';
+        break;
+      case 'u': {
+        unsigned long code = 0;
+        if (!readHex4(cursor, end, code)) {
+          return fail("Bad \\u escape in a string");
         }
-        default: {
-          if (c >= '0' && c <= '9') {
-            if (scientific) scientificNumber = true;
-          }
-          else {
-            number = false;
+        if (code >= 0xD800 && code < 0xDC00 && end - cursor >= 6 &&
+          cursor[0] == '\\' && cursor[1] == 'u') {
+          const char *low = cursor + 2;
+          unsigned long second = 0;
+          if (readHex4(low, end, second) && second >= 0xDC00 && second < 0xE000) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (second - 0xDC00);
+            cursor = low;
           }
-          break;
-        }
         }
+        appendUtf8(value, code);
+        break;
       }
-
-      if (scientific && !scientificNumber) number = false;
-
-      if (number) {
-        data.push(std::make_pair(Node::T_NUMBER, value));
-      }
-      else {
-        return false;
+      default:
+        // Unknown escapes are kept as they were, like unescapeString does.
+        value += c;
+        value += e;
+        break;
       }
     }
-
+    if (cursor == end) {
+      return fail("Unterminated string");
+    }
+    ++cursor;
     return true;
   }
 }  // namespace jzon
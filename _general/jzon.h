@@ -25,11 +25,12 @@ THE SOFTWARE.
 #ifndef Jzon_h_
 #define Jzon_h_
 
+#include <cstdint>
 #include <istream>
 #include <iterator>
 #include <ostream>
-#include <queue>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #ifndef JZON_API
@@ -161,7 +162,7 @@ namespace jzon {
 
     std::string toString(const std::string &def = std::string()) const;
     int toInt(int def = 0) const;
-    int toLong(int def = 0) const;
+    long long toLong(long long def = 0) const;
     float toFloat(float def = 0.f) const;
     double toDouble(double def = 0.0) const;
     bool toBool(bool def = false) const;
@@ -196,9 +197,15 @@ namespace jzon {
     void remove(const std::string &name);
     void clear();
 
-    bool has(const std::string &name) const;
+    // Objects wider than kLinearLookupLimit keep a hash index of their
+    // names, built as they are parsed or modified, so a lookup is one probe
+    // and never writes to the node: const access from several threads is
+    // as safe as it was before. Values may be changed through a mutable
+    // iterator, but renaming a member that way is not supported: the index
+    // would keep finding it under its old name.
+    bool has(std::string_view name) const;
     size_t getCount() const;
-    Node get(const std::string &name) const;
+    Node get(std::string_view name) const;
     Node get(size_t index) const;
 
     iterator begin();
@@ -211,6 +218,28 @@ namespace jzon {
     inline operator bool() const { return isValid(); }
 
   private:
+    friend class Parser;
+    friend class Writer;
+
+    // Numbers are held as what they were set from or parsed as and only
+    // turned into text by toString() and the Writer.
+    enum NumberType {
+      N_INT,
+      N_UINT,
+      N_FLOAT,
+      N_DOUBLE
+    };
+    // Fits the shortest round-trip form of any double, sign included.
+    static constexpr size_t kNumberBufferSize = 32;
+
+    // Objects wider than this get a hash index of their member names.
+    static constexpr size_t kLinearLookupLimit = 8;
+
+    const NamedNode *findMember(std::string_view name) const;
+    void setNumber(std::string_view text);
+    size_t formatNumber(char *buffer) const;
+    double numberAsDouble() const;
+
     typedef std::vector<NamedNode> NamedNodeList;
     struct Data {
       explicit Data(Type type);
@@ -218,11 +247,23 @@ namespace jzon {
       ~Data();
       void addRef();
       bool release();
+      void updateMemberIndex();
+      void rebuildMemberIndex();
+      void indexMember(size_t position);
       int refCount;
 
       Type type;
+      NumberType numberType;
+      union {
+        long long i;
+        unsigned long long u;
+        double d;
+      } number;
       std::string valueStr;
       NamedNodeList children;
+      // Open-addressing table of child positions plus one, zero for an empty
+      // slot. Empty for objects narrow enough to scan.
+      std::vector<uint32_t> memberIndex;
     } *data;
   };
 
@@ -271,40 +312,59 @@ namespace jzon {
     const char *spacing;
   };
 
+  // Stage 1 of Parser::parseString: a list of where every token starts.
+  // The kernel is picked once at run time from what the CPU supports;
+  // asking for a better one than that falls back to the best available.
+  enum IndexKernel {
+    K_SCALAR,
+    K_SSE42,
+    K_AVX2
+  };
+  JZON_API IndexKernel bestIndexKernel();
+  JZON_API const char *indexKernelName(IndexKernel kernel);
+  JZON_API bool buildStructuralIndex(std::string_view json,
+    std::vector<uint32_t> &index,
+    IndexKernel kernel = bestIndexKernel());
+
   class JZON_API Parser {
   public:
     Parser();
     ~Parser();
 
+    // Parses in a single pass over a contiguous buffer, building the nodes
+    // as it goes. Streams and files are read into memory first.
     Node parseStream(std::istream &stream);
-    Node parseString(const std::string &json);
+    Node parseString(std::string_view json);
     Node parseFile(const std::string &filename);
 
     const std::string &getError() const;
 
-  private:
-    enum Token {
-      T_UNKNOWN,
-      T_OBJ_BEGIN,
-      T_OBJ_END,
-      T_ARRAY_BEGIN,
-      T_ARRAY_END,
-      T_SEPARATOR_NODE,
-      T_SEPARATOR_NAME,
-      T_VALUE
-    };
-    typedef std::queue<Token> TokenQueue;
-    typedef std::queue<std::pair<Node::Type, std::string> > DataQueue;
-
-    void tokenize(std::istream &stream, TokenQueue &tokens, DataQueue &data);
-    Node assemble(TokenQueue &tokens, DataQueue &data);
-
-    void jumpToNext(char c, std::istream &stream);
-    void jumpToCommentEnd(std::istream &stream);
-
-    void readString(std::istream &stream, DataQueue &data);
-    bool interpretValue(const std::string &value, DataQueue &data);
+    // Runs the structural index stage before parsing documents of at least
+    // kIndexThreshold bytes. Off by default: values are still scanned byte
+    // by byte, so a full parse is currently slower with the index than
+    // without it (see rtk/jzon_bench.cpp).
+    void setStructuralIndex(bool enabled);
 
+  private:
+    static constexpr unsigned int kMaxDepth = 512;
+    // Small documents, like JSON-RPC requests, are quicker to walk directly.
+    static constexpr size_t kIndexThreshold = 512;
+
+    bool skipWhitespace();
+    bool parseValue(Node &node, unsigned int depth);
+    bool parseObject(Node &node, unsigned int depth);
+    bool parseArray(Node &node, unsigned int depth);
+    bool parseScalar(Node &node);
+    bool readString(std::string &value, bool unescape);
+    bool fail(const std::string &message);
+
+    const char *begin;
+    const char *cursor;
+    const char *end;
+    // Next unread entry of |index|, or null when walking the bytes.
+    const uint32_t *structurals;
+    std::vector<uint32_t> index;
+    bool useStructuralIndex;
     std::string error;
   };
 }  // namespace jzon
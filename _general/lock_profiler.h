@@ -0,0 +1,290 @@
+#pragma once
+
+#include <string>
+
+// Drop-in wrapper that tells which lock hurts. ProfiledLock<Lock> records
+// for every named instance how long threads waited to get it, how long they
+// held it and how often they found it taken. Counters live in per-thread
+// tables, so profiling adds no shared writes of its own; Report() sums
+// the tables on demand, worst total wait first.
+// Without LOCK_PROFILING defined ProfiledLock<Lock> is Lock itself with a
+// constructor that ignores the name.
+
+#ifdef LOCK_PROFILING
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+class LockProfiler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Instances past this many are still locked, just not profiled.
+  static constexpr std::size_t kMaxLockSites{ 64 };
+  static constexpr std::size_t kNoSite{ kMaxLockSites };
+  // Power-of-two buckets in nanoseconds: bucket i counts values <= 2^i ns,
+  // the last one everything above.
+  static constexpr std::size_t kBuckets{ 36 };
+
+  std::size_t Register(const char* name) {
+    std::lock_guard<std::mutex> lock{ access_ };
+    if (names_.size() >= kMaxLockSites) {
+      return kNoSite;
+    }
+    names_.emplace_back(name);
+    return names_.size() - 1;
+  }
+
+  void RecordAcquire(const std::size_t site, const Clock::duration wait, const bool contended) {
+    auto& counters{ LocalTable()[site] };
+    const uint64_t ns{ Nanoseconds(wait) };
+    counters.acquisitions.Add();
+    if (contended) {
+      counters.contended.Add();
+    }
+    counters.wait_ns.Add(ns);
+    counters.max_wait_ns.Max(ns);
+    counters.wait_buckets[Bucket(ns)].Add();
+  }
+
+  void RecordRelease(const std::size_t site, const Clock::duration hold) {
+    auto& counters{ LocalTable()[site] };
+    const uint64_t ns{ Nanoseconds(hold) };
+    counters.hold_ns.Add(ns);
+    counters.max_hold_ns.Max(ns);
+    counters.hold_buckets[Bucket(ns)].Add();
+  }
+
+  std::string Report() {
+    std::vector<Summary> summaries{};
+    {
+      std::lock_guard<std::mutex> lock{ access_ };
+      for (std::size_t site{}; site < names_.size(); ++site) {
+        Summary summary{};
+        summary.name = names_[site];
+        for (const auto& table : tables_) {
+          summary.Add((*table)[site]);
+        }
+        summaries.push_back(summary);
+      }
+    }
+    std::sort(summaries.begin(), summaries.end(), [](const Summary& a, const Summary& b) {
+      return a.wait_ns > b.wait_ns;
+    });
+
+    std::ostringstream out{};
+    out << std::left << std::setw(32) << "lock" << std::right
+      << std::setw(12) << "acquired" << std::setw(11) << "contended"
+      << std::setw(13) << "wait ms" << std::setw(11) << "p50 us" << std::setw(11) << "p99 us"
+      << std::setw(11) << "max us" << std::setw(13) << "hold ms" << std::setw(11) << "p99 us"
+      << std::setw(11) << "max us" << "\n";
+    out << std::fixed << std::setprecision(2);
+    for (const auto& summary : summaries) {
+      const double contended_percent{ summary.acquisitions == 0 ? 0. :
+        100. * static_cast<double>(summary.contended) / static_cast<double>(summary.acquisitions) };
+      out << std::left << std::setw(32) << summary.name << std::right
+        << std::setw(12) << summary.acquisitions << std::setw(10) << contended_percent << "%"
+        << std::setw(13) << static_cast<double>(summary.wait_ns) / 1e6
+        << std::setw(11) << Percentile(summary.wait_buckets, 0.5)
+        << std::setw(11) << Percentile(summary.wait_buckets, 0.99)
+        << std::setw(11) << static_cast<double>(summary.max_wait_ns) / 1e3
+        << std::setw(13) << static_cast<double>(summary.hold_ns) / 1e6
+        << std::setw(11) << Percentile(summary.hold_buckets, 0.99)
+        << std::setw(11) << static_cast<double>(summary.max_hold_ns) / 1e3 << "\n";
+    }
+    return out.str();
+  }
+
+private:
+  // Only ever written by the thread owning the table, so an increment is a
+  // plain load and store; the atomics just keep Report()'s reads defined.
+  class Counter {
+  public:
+    void Add(const uint64_t value = 1) {
+      value_.store(value_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    void Max(const uint64_t value) {
+      if (value > value_.load(std::memory_order_relaxed)) {
+        value_.store(value, std::memory_order_relaxed);
+      }
+    }
+    uint64_t Get() const {
+      return value_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> value_{};
+  };
+
+  struct SiteCounters {
+    Counter acquisitions, contended, wait_ns, hold_ns, max_wait_ns, max_hold_ns;
+    std::array<Counter, kBuckets> wait_buckets, hold_buckets;
+  };
+
+  using ThreadTable = std::array<SiteCounters, kMaxLockSites>;
+
+  struct Summary {
+    std::string name;
+    uint64_t acquisitions{}, contended{}, wait_ns{}, hold_ns{}, max_wait_ns{}, max_hold_ns{};
+    std::array<uint64_t, kBuckets> wait_buckets{}, hold_buckets{};
+
+    void Add(const SiteCounters& counters) {
+      acquisitions += counters.acquisitions.Get();
+      contended += counters.contended.Get();
+      wait_ns += counters.wait_ns.Get();
+      hold_ns += counters.hold_ns.Get();
+      max_wait_ns = (std::max)(max_wait_ns, counters.max_wait_ns.Get());
+      max_hold_ns = (std::max)(max_hold_ns, counters.max_hold_ns.Get());
+      for (std::size_t i{}; i < kBuckets; ++i) {
+        wait_buckets[i] += counters.wait_buckets[i].Get();
+        hold_buckets[i] += counters.hold_buckets[i].Get();
+      }
+    }
+  };
+
+  // Tables belong to the profiler rather than the thread, so the numbers
+  // of threads that have finished still show up in the report.
+  ThreadTable& LocalTable() {
+    thread_local ThreadTable* table{ nullptr };
+    if (not table) {
+      std::lock_guard<std::mutex> lock{ access_ };
+      tables_.emplace_back(std::make_unique<ThreadTable>());
+      table = tables_.back().get();
+    }
+    return *table;
+  }
+
+  static uint64_t Nanoseconds(const Clock::duration duration) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+  }
+
+  static std::size_t Bucket(const uint64_t ns) {
+    if (ns <= 1) {
+      return 0;
+    }
+#ifdef _MSC_VER
+    unsigned long highest_bit{};
+    _BitScanReverse64(&highest_bit, ns - 1);
+    const std::size_t index{ highest_bit + 1 };
+#else
+    const std::size_t index{ static_cast<std::size_t>(64 - __builtin_clzll(ns - 1)) };
+#endif
+    return (std::min)(index, kBuckets - 1);
+  }
+
+  // Upper bound of the bucket the quantile falls into, in microseconds.
+  static double Percentile(const std::array<uint64_t, kBuckets>& buckets, const double quantile) {
+    uint64_t total{};
+    for (const auto count : buckets) {
+      total += count;
+    }
+    if (total == 0) {
+      return 0.;
+    }
+    const uint64_t rank{ static_cast<uint64_t>(quantile * static_cast<double>(total - 1)) + 1 };
+    uint64_t seen{};
+    for (std::size_t i{}; i < kBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return static_cast<double>(uint64_t{ 1 } << i) / 1e3;
+      }
+    }
+    return static_cast<double>(uint64_t{ 1 } << (kBuckets - 1)) / 1e3;
+  }
+
+  std::mutex access_;
+  std::vector<std::string> names_;
+  std::vector<std::unique_ptr<ThreadTable>> tables_;
+};
+
+// Never destroyed: threads still running at exit() keep recording.
+inline LockProfiler& LockProfiling() {
+  static LockProfiler* profiler{ new LockProfiler{} };
+  return *profiler;
+}
+
+template <class Lock>
+class ProfiledLock {
+public:
+  using Clock = LockProfiler::Clock;
+
+  explicit ProfiledLock(const char* name = "unnamed") : site_{ LockProfiling().Register(name) } {}
+  ProfiledLock(const ProfiledLock&) = delete;
+  ProfiledLock& operator=(const ProfiledLock&) = delete;
+
+  // The uncontended case costs one clock read; only a failed try_lock()
+  // starts the wait clock.
+  void lock() {
+    if (lock_.try_lock()) {
+      Acquired(Clock::now(), Clock::duration::zero(), false);
+      return;
+    }
+    const auto start{ Clock::now() };
+    lock_.lock();
+    const auto now{ Clock::now() };
+    Acquired(now, now - start, true);
+  }
+
+  bool try_lock() {
+    if (not lock_.try_lock()) {
+      return false;
+    }
+    Acquired(Clock::now(), Clock::duration::zero(), false);
+    return true;
+  }
+
+  void unlock() {
+    const auto held{ Clock::now() - acquired_at_ };
+    lock_.unlock();
+    if (site_ != LockProfiler::kNoSite) {
+      LockProfiling().RecordRelease(site_, held);
+    }
+  }
+
+private:
+  void Acquired(const Clock::time_point now, const Clock::duration wait, const bool contended) {
+    acquired_at_ = now;
+    if (site_ != LockProfiler::kNoSite) {
+      LockProfiling().RecordAcquire(site_, wait, contended);
+    }
+  }
+
+  Lock lock_;
+  std::size_t site_;
+  // Written and read only by whoever holds the lock.
+  Clock::time_point acquired_at_{};
+};
+
+inline std::string LockProfileReport() {
+  return LockProfiling().Report();
+}
+
+#else
+
+template <class Lock>
+class ProfiledLock : public Lock {
+public:
+  ProfiledLock() = default;
+  explicit ProfiledLock(const char* name) {
+    (void)name;
+  }
+};
+
+inline std::string LockProfileReport() {
+  return "lock profiling is off, build with LOCK_PROFILING defined\n";
+}
+
+#endif
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "spsc_queue.h"
+#include "thread_pool.h"
+
+namespace mytp {
+  constexpr std::size_t kDefaultMailboxCapacity{ 1024 };
+  constexpr std::size_t kDefaultMailboxBatch{ 64 };
+
+  // Bounded ring for many producers and one consumer. Producers claim a
+  // cell with a CAS on the tail; every cell carries a sequence number that
+  // tells the consumer when its value has been written.
+  template <class T>
+  class MpscQueue {
+  public:
+    explicit MpscQueue(const std::size_t capacity = kDefaultMailboxCapacity)
+      : mask_{ RoundUpToPowerOfTwo(std::max<std::size_t>(capacity, 2)) - 1 },
+        cells_(new Cell[mask_ + 1]) {
+      for (std::size_t i{}; i <= mask_; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    template <class U>
+    bool TryPush(U&& value) {
+      std::size_t tail{ tail_.load(std::memory_order_relaxed) };
+      Cell* cell{};
+      while (true) {
+        cell = &cells_[tail & mask_];
+        const std::size_t sequence{ cell->sequence.load(std::memory_order_acquire) };
+        const auto lag{ static_cast<std::ptrdiff_t>(sequence - tail) };
+        if (lag == 0) {
+          if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        }
+        else if (lag < 0) {
+          return false;
+        }
+        else {
+          tail = tail_.load(std::memory_order_relaxed);
+        }
+      }
+      cell->value = std::forward<U>(value);
+      cell->sequence.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    template <class Consume>
+    std::size_t ConsumeBatch(Consume&& consume, const std::size_t max_batch) {
+      std::size_t count{};
+      for (; count < max_batch; ++count) {
+        Cell& cell{ cells_[head_ & mask_] };
+        if (cell.sequence.load(std::memory_order_acquire) != head_ + 1) {
+          break;
+        }
+        consume(cell.value);
+        cell.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+        ++head_;
+      }
+      return count;
+    }
+
+    bool IsEmpty() const {
+      return cells_[head_ & mask_].sequence.load(std::memory_order_acquire) != head_ + 1;
+    }
+
+  private:
+    struct Cell {
+      std::atomic<std::size_t> sequence{};
+      T value{};
+    };
+
+    alignas(kCacheLineSize) std::atomic<std::size_t> tail_{};
+    alignas(kCacheLineSize) std::size_t head_{};
+    const std::size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+  };
+
+
+  // The same ring with consumers claiming cells by CAS on the head too, for
+  // queues that several threads drain.
+  template <class T>
+  class MpmcQueue {
+  public:
+    explicit MpmcQueue(const std::size_t capacity = kDefaultMailboxCapacity)
+      : mask_{ RoundUpToPowerOfTwo(std::max<std::size_t>(capacity, 2)) - 1 },
+        cells_(new Cell[mask_ + 1]) {
+      for (std::size_t i{}; i <= mask_; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+    // |value| is left alone when the queue is full.
+    template <class U>
+    bool TryPush(U&& value) {
+      std::size_t tail{ tail_.load(std::memory_order_relaxed) };
+      Cell* cell{ Claim(tail_, tail, 0) };
+      if (cell == nullptr) {
+        return false;
+      }
+      cell->value = std::forward<U>(value);
+      cell->sequence.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    template <class Consume>
+    std::size_t ConsumeBatch(Consume&& consume, const std::size_t max_batch) {
+      std::size_t count{};
+      for (; count < max_batch; ++count) {
+        std::size_t head{ head_.load(std::memory_order_relaxed) };
+        Cell* cell{ Claim(head_, head, 1) };
+        if (cell == nullptr) {
+          break;
+        }
+        consume(cell->value);
+        cell->sequence.store(head + mask_ + 1, std::memory_order_release);
+      }
+      return count;
+    }
+
+    // Both are snapshots that may be stale by the time they return.
+    std::size_t Size() const {
+      const std::size_t head{ head_.load(std::memory_order_acquire) };
+      const std::size_t tail{ tail_.load(std::memory_order_acquire) };
+      return tail > head ? tail - head : 0;
+    }
+
+    std::size_t Capacity() const {
+      return mask_ + 1;
+    }
+
+  private:
+    struct Cell {
+      std::atomic<std::size_t> sequence{};
+      T value{};
+    };
+
+    // A cell at |position| is ready for producers when its sequence equals
+    // the position and for consumers when it is one past it.
+    Cell* Claim(std::atomic<std::size_t>& index, std::size_t& position,
+                const std::size_t ready) {
+      while (true) {
+        Cell* cell{ &cells_[position & mask_] };
+        const std::size_t sequence{ cell->sequence.load(std::memory_order_acquire) };
+        const auto lag{ static_cast<std::ptrdiff_t>(sequence - (position + ready)) };
+        if (lag == 0) {
+          if (index.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            return cell;
+          }
+        }
+        else if (lag < 0) {
+          return nullptr;
+        }
+        else {
+          position = index.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    alignas(kCacheLineSize) std::atomic<std::size_t> tail_{};
+    alignas(kCacheLineSize) std::atomic<std::size_t> head_{};
+    const std::size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+  };
+
+
+  // Written by the owning thread only; anyone may read.
+  struct MailboxStats {
+    std::atomic<uint64_t> received{};
+    std::atomic<uint64_t> batches{};
+    std::atomic<uint64_t> latency_ns_total{};
+    std::atomic<uint64_t> latency_ns_max{};
+
+    double AverageLatencyUs() const {
+      const uint64_t count{ received.load(std::memory_order_relaxed) };
+      return count == 0 ? 0.
+        : static_cast<double>(latency_ns_total.load(std::memory_order_relaxed)) / count / 1000.;
+    }
+  };
+
+
+  // Mailboxes for a fixed set of pool threads. Every mailbox has one SPSC
+  // lane per pool thread, so thread to thread sends never contend, and one
+  // MPSC lane for everybody else. A sender only pays for a wake-up when
+  // the receiver has actually gone to sleep.
+  template <class Message>
+  class PostOffice {
+  public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::size_t kOutside{ ~std::size_t{ 0 } };
+
+    struct Envelope {
+      std::size_t from{ kOutside };
+      Clock::time_point sent{};
+    };
+
+    PostOffice(const std::size_t mailboxes,
+               const std::size_t capacity = kDefaultMailboxCapacity) {
+      mailboxes_.reserve(mailboxes);
+      for (std::size_t i{}; i < mailboxes; ++i) {
+        mailboxes_.emplace_back(std::make_unique<Mailbox>(mailboxes, capacity));
+      }
+    }
+
+    std::size_t size() const {
+      return mailboxes_.size();
+    }
+
+    // |owner| is woken when mail arrives while it sleeps.
+    void Attach(const std::size_t me, ThreadDataBase* owner) {
+      mailboxes_.at(me)->owner.store(owner, std::memory_order_release);
+    }
+
+    // From pool thread |from| to pool thread |to|; false when the lane is
+    // full.
+    template <class U>
+    bool Send(const std::size_t from, const std::size_t to, U&& message) {
+      Mailbox& mailbox{ *mailboxes_[to] };
+      if (not mailbox.lanes[from]->TryPush(Letter{ Envelope{ from, Clock::now() },
+                                                    std::forward<U>(message) })) {
+        return false;
+      }
+      WakeUp(mailbox);
+      return true;
+    }
+
+    // From any thread, pool or not.
+    template <class U>
+    bool Post(const std::size_t to, U&& message) {
+      Mailbox& mailbox{ *mailboxes_[to] };
+      if (not mailbox.shared_lane.TryPush(Letter{ Envelope{ kOutside, Clock::now() },
+                                                   std::forward<U>(message) })) {
+        return false;
+      }
+      WakeUp(mailbox);
+      return true;
+    }
+
+    // To every pool thread but |from|, which may be kOutside. Returns how
+    // many mailboxes took it.
+    std::size_t Broadcast(const std::size_t from, const Message& message) {
+      std::size_t delivered{};
+      for (std::size_t to{}; to < mailboxes_.size(); ++to) {
+        if (to != from) {
+          const bool accepted{ from == kOutside ? Post(to, message)
+                                                : Send(from, to, message) };
+          delivered += accepted ? 1 : 0;
+        }
+      }
+      return delivered;
+    }
+
+    // Drains up to |max_batch| letters per lane into |handle|, called as
+    // handle(message, envelope). Returns the number handled.
+    template <class Handle>
+    std::size_t Receive(const std::size_t me, Handle&& handle,
+                        const std::size_t max_batch = kDefaultMailboxBatch) {
+      Mailbox& mailbox{ *mailboxes_[me] };
+      const auto now{ Clock::now() };
+      uint64_t latency_total{}, latency_max{ mailbox.stats.latency_ns_max.load(std::memory_order_relaxed) };
+      auto deliver = [&](Letter& letter) {
+        const auto latency{ static_cast<uint64_t>(std::max<int64_t>(0,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - letter.envelope.sent).count())) };
+        latency_total += latency;
+        latency_max = std::max(latency_max, latency);
+        handle(letter.message, letter.envelope);
+      };
+      std::size_t received{ mailbox.shared_lane.ConsumeBatch(deliver, max_batch) };
+      for (auto& lane : mailbox.lanes) {
+        received += lane->ConsumeBatch(deliver, max_batch);
+      }
+      if (received > 0) {
+        auto& stats{ mailbox.stats };
+        stats.received.store(stats.received.load(std::memory_order_relaxed) + received, std::memory_order_relaxed);
+        stats.batches.store(stats.batches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        stats.latency_ns_total.store(stats.latency_ns_total.load(std::memory_order_relaxed) + latency_total, std::memory_order_relaxed);
+        stats.latency_ns_max.store(latency_max, std::memory_order_relaxed);
+      }
+      return received;
+    }
+
+    bool IsEmpty(const std::size_t me) const {
+      const Mailbox& mailbox{ *mailboxes_[me] };
+      if (not mailbox.shared_lane.IsEmpty()) {
+        return false;
+      }
+      return std::all_of(mailbox.lanes.begin(), mailbox.lanes.end(),
+        [](const auto& lane) { return lane->IsEmpty(); });
+    }
+
+    // The receiving half of the sleep handshake: announce the nap, then
+    // look once more, so a sender either sees the flag or its letter is
+    // seen here.
+    bool PrepareToSleep(const std::size_t me) {
+      Mailbox& mailbox{ *mailboxes_[me] };
+      mailbox.is_sleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (not IsEmpty(me)) {
+        mailbox.is_sleeping.store(false, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+
+    void WokeUp(const std::size_t me) {
+      mailboxes_[me]->is_sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    const MailboxStats& Stats(const std::size_t me) const {
+      return mailboxes_[me]->stats;
+    }
+
+  private:
+    struct Letter {
+      Envelope envelope{};
+      Message message{};
+    };
+
+    struct Mailbox {
+      Mailbox(const std::size_t senders, const std::size_t capacity)
+        : shared_lane{ capacity } {
+        lanes.reserve(senders);
+        for (std::size_t i{}; i < senders; ++i) {
+          lanes.emplace_back(std::make_unique<SpscQueue<Letter>>(capacity));
+        }
+      }
+
+      std::vector<std::unique_ptr<SpscQueue<Letter>>> lanes;
+      MpscQueue<Letter> shared_lane;
+      alignas(kCacheLineSize) std::atomic<bool> is_sleeping{ false };
+      std::atomic<ThreadDataBase*> owner{};
+      MailboxStats stats{};
+    };
+
+    void WakeUp(Mailbox& mailbox) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (mailbox.is_sleeping.load(std::memory_order_relaxed) and
+          mailbox.is_sleeping.exchange(false, std::memory_order_relaxed)) {
+        if (auto owner{ mailbox.owner.load(std::memory_order_acquire) }) {
+          owner->Notify();
+        }
+      }
+    }
+
+    std::vector<std::unique_ptr<Mailbox>> mailboxes_;
+  };
+
+
+  // Thread body that lives off its mailbox: OnMessage() for every letter,
+  // asleep on the thread's event when there is none. The mailbox index is
+  // the thread's number in the pool.
+  template <class Message>
+  class MailboxThreadData : public ThreadDataBase {
+  public:
+    using Envelope = typename PostOffice<Message>::Envelope;
+
+    MailboxThreadData(ThreadCallback * pool_callback, PostOffice<Message> * post_office)
+      : ThreadDataBase{ pool_callback }, post_office_{ post_office } {}
+
+    void ThreadFunction() override {
+      post_office_->Attach(thread_number_, this);
+      while (is_running) {
+        const auto handle = [this](Message& message, const Envelope& envelope) {
+          OnMessage(message, envelope);
+        };
+        if (post_office_->Receive(thread_number_, handle) > 0) {
+          continue;
+        }
+        if (post_office_->PrepareToSleep(thread_number_)) {
+          WaitForWakeup();
+          post_office_->WokeUp(thread_number_);
+        }
+      }
+      post_office_->Attach(thread_number_, nullptr);
+    }
+
+  protected:
+    virtual void OnMessage(Message& message, const Envelope& envelope) = 0;
+
+    bool Send(const std::size_t to, const Message& message) {
+      return post_office_->Send(thread_number_, to, message);
+    }
+
+    std::size_t Broadcast(const Message& message) {
+      return post_office_->Broadcast(thread_number_, message);
+    }
+
+    PostOffice<Message> * post_office_{};
+  };
+
+}
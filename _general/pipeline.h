@@ -0,0 +1,409 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "mailbox.h"
+#include "thread_pool.h"
+
+// Stage graphs on top of ThreadPool: parse -> transform -> serialize and
+// the like. Stages are joined by bounded Channels; a full channel puts its
+// producers to sleep, which stops them draining their own input, so back
+// pressure travels up to the source by itself.
+
+namespace mytp {
+  constexpr std::size_t kDefaultChannelCapacity{ 4096 };
+  constexpr std::size_t kDefaultStageBatch{ 64 };
+
+  struct ChannelStats {
+    std::atomic<uint64_t> pushed{};
+    std::atomic<uint64_t> blocked_pushes{};
+    std::atomic<uint64_t> occupancy_samples{};
+    std::atomic<uint64_t> occupancy_total{};
+    std::atomic<uint64_t> occupancy_max{};
+  };
+
+  class ChannelBase {
+  public:
+    virtual ~ChannelBase() = default;
+    virtual void Stop() = 0;
+  };
+
+  // Bounded MPMC queue with sleeping on both ends. Producers and consumers
+  // register the events they sleep on before the pipeline starts; whoever
+  // changes the fill level wakes the other side only when it is asleep.
+  template <class T>
+  class Channel : public ChannelBase {
+  public:
+    explicit Channel(const std::size_t capacity = kDefaultChannelCapacity)
+      : queue_{ capacity } {
+      producers_.push_back(&outside_producer_);
+    }
+
+    void AddProducer(Event* event) {
+      producers_.push_back(event);
+      open_producers_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void AddConsumer(Event* event) {
+      consumers_.push_back(event);
+    }
+
+    // Blocks while the channel is full; false if |is_running| went false
+    // first. Producers that are not pool threads pass their own event.
+    template <class U>
+    bool Push(U&& value, Event& sleep_on, const std::atomic<bool>& is_running) {
+      bool counted_block{ false };
+      while (not queue_.TryPush(std::forward<U>(value))) {
+        if (not is_running) {
+          return false;
+        }
+        if (not counted_block) {
+          stats_.blocked_pushes.fetch_add(1, std::memory_order_relaxed);
+          counted_block = true;
+        }
+        SleepUnless(sleeping_producers_, sleep_on, is_running,
+          [this] { return queue_.Size() < queue_.Capacity(); });
+      }
+      stats_.pushed.fetch_add(1, std::memory_order_relaxed);
+      WakeUp(sleeping_consumers_, consumers_);
+      return true;
+    }
+
+    // From outside the pool; only one such producer at a time. False once
+    // the channel has been stopped.
+    template <class U>
+    bool Push(U&& value) {
+      if (not outside_running_) {
+        return false;
+      }
+      return Push(std::forward<U>(value), outside_producer_, outside_running_);
+    }
+
+    // Wakes an outside producer blocked on a full channel and turns away
+    // its further pushes; pool threads are stopped through their pool.
+    void Stop() override {
+      outside_running_.store(false);
+      outside_producer_.Signal();
+    }
+
+    // Moves up to |max_batch| values into |batch|, sleeping while there is
+    // nothing. False once the channel is closed and drained, or stopped.
+    bool PopBatch(std::vector<T>& batch, const std::size_t max_batch,
+                  Event& sleep_on, const std::atomic<bool>& is_running) {
+      batch.clear();
+      const auto take = [&batch](T& value) { batch.push_back(std::move(value)); };
+      while (true) {
+        const std::size_t occupancy{ queue_.Size() };
+        if (queue_.ConsumeBatch(take, max_batch) > 0) {
+          RecordOccupancy(occupancy);
+          WakeUp(sleeping_producers_, producers_);
+          return true;
+        }
+        if (closed_.load(std::memory_order_acquire)) {
+          return queue_.ConsumeBatch(take, max_batch) > 0;
+        }
+        if (not is_running) {
+          return false;
+        }
+        SleepUnless(sleeping_consumers_, sleep_on, is_running, [this] {
+          return queue_.Size() > 0 or closed_.load(std::memory_order_acquire);
+        });
+      }
+    }
+
+    // Called by each registered producer as it finishes; the last one
+    // closes the channel.
+    void ProducerDone() {
+      if (open_producers_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        Close();
+      }
+    }
+
+    void Close() {
+      closed_.store(true, std::memory_order_release);
+      for (auto consumer : consumers_) {
+        consumer->Signal();
+      }
+    }
+
+    const ChannelStats& Stats() const {
+      return stats_;
+    }
+
+    std::size_t Capacity() const {
+      return queue_.Capacity();
+    }
+
+  private:
+    template <class Ready>
+    void SleepUnless(std::atomic<int>& sleepers, Event& sleep_on,
+                     const std::atomic<bool>& is_running, Ready&& ready) {
+      sleepers.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (not ready() and is_running) {
+        sleep_on.Wait();
+      }
+      sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void WakeUp(const std::atomic<int>& sleepers, const std::vector<Event*>& events) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleepers.load(std::memory_order_relaxed) > 0) {
+        for (auto event : events) {
+          event->Signal();
+        }
+      }
+    }
+
+    void RecordOccupancy(const std::size_t occupancy) {
+      stats_.occupancy_samples.fetch_add(1, std::memory_order_relaxed);
+      stats_.occupancy_total.fetch_add(occupancy, std::memory_order_relaxed);
+      uint64_t max{ stats_.occupancy_max.load(std::memory_order_relaxed) };
+      while (occupancy > max and
+             not stats_.occupancy_max.compare_exchange_weak(max, occupancy, std::memory_order_relaxed)) {}
+    }
+
+    MpmcQueue<T> queue_;
+    std::vector<Event*> producers_, consumers_;
+    Event outside_producer_{};
+    std::atomic<bool> outside_running_{ true };
+    std::atomic<int> open_producers_{};
+    std::atomic<int> sleeping_producers_{}, sleeping_consumers_{};
+    std::atomic<bool> closed_{ false };
+    ChannelStats stats_{};
+  };
+
+
+  class StageWorker;
+
+  class StageBase {
+  public:
+    StageBase(std::string name, const std::size_t workers)
+      : name_{ std::move(name) }, workers_{ workers } {}
+    virtual ~StageBase() = default;
+
+    virtual void Work(StageWorker& worker) = 0;
+    virtual const ChannelStats& InputStats() const = 0;
+    virtual std::size_t InputCapacity() const = 0;
+
+    const std::string& name() const {
+      return name_;
+    }
+
+    std::size_t workers() const {
+      return workers_;
+    }
+
+    uint64_t processed() const {
+      return processed_.load(std::memory_order_relaxed);
+    }
+
+  protected:
+    std::string name_;
+    std::size_t workers_{};
+    std::atomic<uint64_t> processed_{};
+  };
+
+  // One pool thread of a stage.
+  class StageWorker : public ThreadDataBase {
+  public:
+    StageWorker(ThreadCallback * pool_callback, StageBase * stage)
+      : ThreadDataBase{ pool_callback }, stage_{ stage } {}
+
+    void ThreadFunction() override {
+      stage_->Work(*this);
+    }
+
+    Event& event() {
+      return wakeup_;
+    }
+
+    const std::atomic<bool>& running() const {
+      return is_running;
+    }
+
+  private:
+    StageBase * stage_{};
+  };
+
+  // What a stage function calls for every value it produces.
+  template <class Out>
+  class Emitter {
+  public:
+    Emitter(Channel<Out>& output, StageWorker& worker)
+      : output_{ output }, worker_{ worker } {}
+
+    bool operator()(Out value) {
+      return output_.Push(std::move(value), worker_.event(), worker_.running());
+    }
+
+  private:
+    Channel<Out>& output_;
+    StageWorker& worker_;
+  };
+
+  // |function| is called as function(In&, Emitter<Out>&) and may emit any
+  // number of values; with Out = void it is a sink, function(In&).
+  template <class In, class Out, class Function>
+  class Stage : public StageBase {
+  public:
+    Stage(std::string name, const std::size_t workers, Channel<In>& input,
+          Channel<Out>* output, Function function, const std::size_t batch)
+      : StageBase{ std::move(name), workers }, input_{ input }, output_{ output },
+        function_{ std::move(function) }, batch_{ batch } {}
+
+    void Work(StageWorker& worker) override {
+      std::vector<In> batch{};
+      batch.reserve(batch_);
+      while (input_.PopBatch(batch, batch_, worker.event(), worker.running())) {
+        Process(batch, worker);
+        processed_.fetch_add(batch.size(), std::memory_order_relaxed);
+      }
+      if constexpr (not std::is_void_v<Out>) {
+        output_->ProducerDone();
+      }
+    }
+
+    const ChannelStats& InputStats() const override {
+      return input_.Stats();
+    }
+
+    std::size_t InputCapacity() const override {
+      return input_.Capacity();
+    }
+
+  private:
+    void Process(std::vector<In>& batch, StageWorker& worker) {
+      if constexpr (std::is_void_v<Out>) {
+        (void)worker;
+        for (auto& value : batch) {
+          function_(value);
+        }
+      }
+      else {
+        Emitter<Out> emit{ *output_, worker };
+        for (auto& value : batch) {
+          function_(value, emit);
+        }
+      }
+    }
+
+    Channel<In>& input_;
+    Channel<Out>* output_{};
+    Function function_;
+    std::size_t batch_{};
+  };
+
+
+  // Owns the channels, the stages and the pool they run on. Build the
+  // graph, Start(), feed the sources with Push() and Close() them, then
+  // Wait() for everything to drain.
+  class Pipeline {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    template <class T>
+    Channel<T>& AddSource(const std::size_t capacity = kDefaultChannelCapacity) {
+      return AddChannel<T>(capacity);
+    }
+
+    template <class In, class Out, class Function>
+    Channel<Out>& AddStage(std::string name, Channel<In>& input,
+                           const std::size_t workers, Function function,
+                           const std::size_t capacity = kDefaultChannelCapacity,
+                           const std::size_t batch = kDefaultStageBatch) {
+      Channel<Out>& output{ AddChannel<Out>(capacity) };
+      auto stage{ std::make_unique<Stage<In, Out, Function>>(std::move(name), workers, input,
+                                                             &output, std::move(function), batch) };
+      for (std::size_t i{}; i < workers; ++i) {
+        StageWorker* worker{ pool_.AddNewThread(stage.get()) };
+        input.AddConsumer(&worker->event());
+        output.AddProducer(&worker->event());
+      }
+      stages_.emplace_back(std::move(stage));
+      return output;
+    }
+
+    template <class In, class Function>
+    void AddSink(std::string name, Channel<In>& input, const std::size_t workers,
+                 Function function, const std::size_t batch = kDefaultStageBatch) {
+      auto stage{ std::make_unique<Stage<In, void, Function>>(std::move(name), workers, input,
+                                                              nullptr, std::move(function), batch) };
+      for (std::size_t i{}; i < workers; ++i) {
+        StageWorker* worker{ pool_.AddNewThread(stage.get()) };
+        input.AddConsumer(&worker->event());
+      }
+      stages_.emplace_back(std::move(stage));
+    }
+
+    void Start() {
+      started_at_ = Clock::now();
+      pool_.Start();
+    }
+
+    // Returns when every source has been closed and all stages drained.
+    void Wait() {
+      pool_.WaitForThreads();
+      finished_at_ = Clock::now();
+      pool_.JoinAllThreads();
+    }
+
+    // Abandons whatever is still queued, including pushes that sources
+    // are blocked in.
+    void Stop() {
+      for (const auto& channel : channels_) {
+        channel->Stop();
+      }
+      pool_.Stop();
+    }
+
+    // Throughput of every stage and how full its input ran on average, at
+    // worst, and how often a producer had to wait for room.
+    void Report(std::ostream& out) const {
+      const auto end{ finished_at_ > started_at_ ? finished_at_ : Clock::now() };
+      const double seconds{ std::max(1e-9, std::chrono::duration<double>(end - started_at_).count()) };
+      out << std::left << std::setw(16) << "stage" << std::right << std::setw(8) << "threads"
+        << std::setw(14) << "items/s" << std::setw(12) << "avg queue" << std::setw(12) << "max queue"
+        << std::setw(10) << "blocked" << std::endl;
+      for (const auto& stage : stages_) {
+        const ChannelStats& input{ stage->InputStats() };
+        const uint64_t samples{ input.occupancy_samples.load(std::memory_order_relaxed) };
+        const double average{ samples == 0 ? 0.
+          : static_cast<double>(input.occupancy_total.load(std::memory_order_relaxed)) / samples };
+        const double capacity{ static_cast<double>(stage->InputCapacity()) };
+        out << std::left << std::setw(16) << stage->name() << std::right << std::setw(8) << stage->workers()
+          << std::fixed << std::setprecision(0) << std::setw(14) << stage->processed() / seconds
+          << std::setprecision(1) << std::setw(11) << 100. * average / capacity << "%"
+          << std::setw(11) << 100. * input.occupancy_max.load(std::memory_order_relaxed) / capacity << "%"
+          << std::setw(10) << input.blocked_pushes.load(std::memory_order_relaxed) << std::endl;
+      }
+    }
+
+  private:
+    template <class T>
+    Channel<T>& AddChannel(const std::size_t capacity) {
+      auto channel{ std::make_shared<Channel<T>>(capacity) };
+      Channel<T>& reference{ *channel };
+      channels_.emplace_back(std::move(channel));
+      return reference;
+    }
+
+    // The pool is destroyed first, so no thread outlives what it points to.
+    std::vector<std::shared_ptr<ChannelBase>> channels_;
+    std::vector<std::unique_ptr<StageBase>> stages_;
+    ThreadPool<StageWorker> pool_;
+    Clock::time_point started_at_{}, finished_at_{};
+  };
+
+}
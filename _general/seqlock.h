@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "spinlock.h"
+
+// Sequence lock for small trivially copyable values (a POINT, a RECT, a
+// handful of counters). Readers never write shared memory: they copy the
+// value and retry if the sequence number was odd or moved meanwhile, so
+// they neither block each other nor hold up the writer. Writers exclude
+// each other through the sequence number itself.
+// The value is kept as relaxed atomic words, so a torn read that is
+// thrown away anyway is not a data race either.
+template <typename T>
+class SeqLock {
+  static_assert(std::is_trivially_copyable<T>::value, "SeqLock copies the value byte by byte");
+  static_assert(std::is_default_constructible<T>::value, "Load() needs somewhere to copy to");
+
+public:
+  SeqLock() : SeqLock(T{}) {}
+
+  explicit SeqLock(const T& value) {
+    Write(value);
+  }
+
+  SeqLock(const SeqLock&) = delete;
+  SeqLock& operator=(const SeqLock&) = delete;
+
+  T Load() const {
+    Word buffer[kWords];
+    Backoff backoff{};
+    for (;;) {
+      const uint32_t before{ sequence_.load(std::memory_order_acquire) };
+      if ((before & 1) == 0) {
+        for (std::size_t i{}; i < kWords; ++i) {
+          buffer[i] = words_[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence_.load(std::memory_order_relaxed) == before) {
+          break;
+        }
+      }
+      backoff.Pause();
+    }
+    T result{};
+    std::memcpy(&result, buffer, sizeof(T));
+    return result;
+  }
+
+  void Store(const T& value) {
+    uint32_t sequence{ sequence_.load(std::memory_order_relaxed) };
+    Backoff backoff{};
+    while ((sequence & 1) != 0 or
+           not sequence_.compare_exchange_weak(sequence, sequence + 1, std::memory_order_relaxed)) {
+      backoff.Pause();
+      sequence = sequence_.load(std::memory_order_relaxed);
+    }
+    // Keeps the stores below from becoming visible before the odd number.
+    std::atomic_thread_fence(std::memory_order_release);
+    Write(value);
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+private:
+  using Word = std::uintptr_t;
+  static constexpr std::size_t kWords{ (sizeof(T) + sizeof(Word) - 1) / sizeof(Word) };
+
+  void Write(const T& value) {
+    Word buffer[kWords]{};
+    std::memcpy(buffer, &value, sizeof(T));
+    for (std::size_t i{}; i < kWords; ++i) {
+      words_[i].store(buffer[i], std::memory_order_relaxed);
+    }
+  }
+
+  std::atomic<uint32_t> sequence_{};
+  std::atomic<Word> words_[kWords];
+};
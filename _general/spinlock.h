@@ -1,21 +1,369 @@
-
 #pragma once
 
 #include <thread>
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <system_error>
+
+#include "cache_line.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "Synchronization.lib")
+#endif
+#else
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// All locks here are Lockable, so std::lock_guard and std::scoped_lock
+// take them, and each sits on a cache line of its own so that neighbours
+// are not dragged along when it bounces between cores.
+
+constexpr std::size_t kSpinLockAlignment{ kCacheLineSize };
 
-class SpinLock {
+// Tells the core we are spinning: cheaper on the sibling hyper-thread and
+// no memory-order machine clear when the line finally changes.
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// Pause rounds double on every failed attempt; past the cap the thread
+// gives up its time slice instead.
+class Backoff {
 public:
-  void lock() {
-    while (flag_.test_and_set(std::memory_order_acquire)) {
+  static constexpr uint32_t kMaxPauses{ 1024 };
+
+  void Pause() {
+    if (pauses_ <= kMaxPauses) {
+      for (uint32_t i{}; i < pauses_; ++i) {
+        CpuRelax();
+      }
+      pauses_ *= 2;
+    }
+    else {
       std::this_thread::yield();
-    };
+    }
+  }
+
+private:
+  uint32_t pauses_{ 1 };
+};
+
+// Test-and-test-and-set: waiters spin on a plain load, which stays in
+// their own cache, and only try the exchange once the lock looks free.
+class alignas(kSpinLockAlignment) TtasSpinLock {
+public:
+  void lock() {
+    Backoff backoff{};
+    while (flag_.exchange(true, std::memory_order_acquire)) {
+      do {
+        backoff.Pause();
+      } while (flag_.load(std::memory_order_relaxed));
+    }
+  }
+
+  bool try_lock() {
+    return not flag_.load(std::memory_order_relaxed) and
+           not flag_.exchange(true, std::memory_order_acquire);
+  }
+
+  void unlock() {
+    flag_.store(false, std::memory_order_release);
+  }
+
+private:
+  std::atomic<bool> flag_{ false };
+};
+
+// Spins for a short while like TtasSpinLock, then sleeps in the kernel
+// (futex, or WaitOnAddress on Windows) so a long critical section does not
+// burn the waiters' cores. The state is 0 free, 1 locked, 2 locked with
+// sleepers, and unlock() only makes a syscall in the last case.
+class alignas(kSpinLockAlignment) AdaptiveSpinLock {
+public:
+  static constexpr int kSpinAttempts{ 100 };
+
+  void lock() {
+    int expected{ kFree };
+    if (state_.compare_exchange_strong(expected, kLocked, std::memory_order_acquire)) {
+      return;
+    }
+    for (int i{}; i < kSpinAttempts; ++i) {
+      if (state_.load(std::memory_order_relaxed) == kFree) {
+        expected = kFree;
+        if (state_.compare_exchange_weak(expected, kLocked, std::memory_order_acquire)) {
+          return;
+        }
+      }
+      CpuRelax();
+    }
+    // From here on the lock is taken as "contended", so whoever unlocks it
+    // next wakes somebody up.
+    while (state_.exchange(kContended, std::memory_order_acquire) != kFree) {
+      WaitWhile(kContended);
+    }
+  }
+
+  bool try_lock() {
+    int expected{ kFree };
+    return state_.compare_exchange_strong(expected, kLocked, std::memory_order_acquire);
+  }
+
+  void unlock() {
+    if (state_.exchange(kFree, std::memory_order_release) == kContended) {
+      WakeOne();
+    }
+  }
+
+private:
+  static constexpr int kFree{ 0 };
+  static constexpr int kLocked{ 1 };
+  static constexpr int kContended{ 2 };
+
+  void WaitWhile(const int while_value) {
+#ifdef _WIN32
+    int value{ while_value };
+    WaitOnAddress(&state_, &value, sizeof(value), INFINITE);
+#else
+    syscall(SYS_futex, reinterpret_cast<int*>(&state_), FUTEX_WAIT_PRIVATE, while_value, nullptr, nullptr, 0);
+#endif
+  }
+
+  void WakeOne() {
+#ifdef _WIN32
+    WakeByAddressSingle(&state_);
+#else
+    syscall(SYS_futex, reinterpret_cast<int*>(&state_), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+  }
+
+  std::atomic<int> state_{ kFree };
+  static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex needs a plain int");
+};
+
+// Hands the lock out in arrival order: fair, but every waiter still reads
+// the same "now serving" word. Waiters pause in proportion to how far back
+// in the queue they are, and fall back to yielding when oversubscribed.
+class alignas(kSpinLockAlignment) TicketSpinLock {
+public:
+  static constexpr uint32_t kPausesPerWaiter{ 32 };
+  static constexpr uint32_t kRoundsBeforeYield{ 64 };
+
+  void lock() {
+    const uint32_t ticket{ next_ticket_.fetch_add(1, std::memory_order_relaxed) };
+    uint32_t rounds{};
+    for (;;) {
+      const uint32_t serving{ now_serving_.load(std::memory_order_acquire) };
+      if (serving == ticket) {
+        return;
+      }
+      if (++rounds > kRoundsBeforeYield) {
+        std::this_thread::yield();
+        continue;
+      }
+      for (uint32_t i{}; i < (ticket - serving) * kPausesPerWaiter; ++i) {
+        CpuRelax();
+      }
+    }
+  }
+
+  bool try_lock() {
+    uint32_t serving{ now_serving_.load(std::memory_order_acquire) };
+    return next_ticket_.compare_exchange_strong(serving, serving + 1, std::memory_order_acquire);
   }
 
   void unlock() {
-    flag_.clear(std::memory_order_release);
+    now_serving_.store(now_serving_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
   }
 
 private:
-  std::atomic_flag flag_{ ATOMIC_FLAG_INIT };
+  // Apart, so that taking a ticket does not invalidate the line the
+  // waiters are spinning on.
+  alignas(kSpinLockAlignment) std::atomic<uint32_t> next_ticket_{};
+  alignas(kSpinLockAlignment) std::atomic<uint32_t> now_serving_{};
 };
+
+// Mellor-Crummey & Scott queue lock: waiters form a linked list and each
+// one spins on a flag in its own node, so a release touches exactly one
+// other core. Nodes come from a small per-thread pool instead of the
+// caller's stack, which keeps the lock usable with std::lock_guard; a
+// thread can hold up to kMaxHeldPerThread MCS locks at a time.
+class alignas(kSpinLockAlignment) McsLock {
+public:
+  static constexpr int kMaxHeldPerThread{ 8 };
+
+  void lock() {
+    Node* const node{ AcquireNode() };
+    node->locked.store(true, std::memory_order_relaxed);
+    Node* const predecessor{ tail_.exchange(node, std::memory_order_acq_rel) };
+    if (predecessor) {
+      predecessor->next.store(node, std::memory_order_release);
+      Backoff backoff{};
+      while (node->locked.load(std::memory_order_acquire)) {
+        backoff.Pause();
+      }
+    }
+    holder_ = node;
+  }
+
+  bool try_lock() {
+    Node* const node{ AcquireNode() };
+    Node* expected{ nullptr };
+    if (tail_.compare_exchange_strong(expected, node, std::memory_order_acquire)) {
+      holder_ = node;
+      return true;
+    }
+    ReleaseNode(node);
+    return false;
+  }
+
+  void unlock() {
+    Node* const node{ holder_ };
+    Node* successor{ node->next.load(std::memory_order_acquire) };
+    if (not successor) {
+      Node* expected{ node };
+      if (tail_.compare_exchange_strong(expected, nullptr, std::memory_order_release, std::memory_order_relaxed)) {
+        ReleaseNode(node);
+        return;
+      }
+      // Somebody swapped themselves in but has not linked up yet.
+      while (not (successor = node->next.load(std::memory_order_acquire))) {
+        CpuRelax();
+      }
+    }
+    successor->locked.store(false, std::memory_order_release);
+    ReleaseNode(node);
+  }
+
+private:
+  struct alignas(kSpinLockAlignment) Node {
+    std::atomic<Node*> next{ nullptr };
+    std::atomic<bool> locked{ false };
+    bool in_use{ false };
+  };
+
+  static Node* AcquireNode() {
+    static thread_local Node nodes[kMaxHeldPerThread];
+    for (auto& node : nodes) {
+      if (not node.in_use) {
+        node.in_use = true;
+        node.next.store(nullptr, std::memory_order_relaxed);
+        return &node;
+      }
+    }
+    throw std::system_error(std::make_error_code(std::errc::resource_deadlock_would_occur));
+  }
+
+  static void ReleaseNode(Node* const node) {
+    node->in_use = false;
+  }
+
+  std::atomic<Node*> tail_{ nullptr };
+  // Only ever touched by the thread that holds the lock.
+  Node* holder_{ nullptr };
+};
+
+// Reader-writer spin lock for read-mostly data, usable with
+// std::shared_lock. Readers do not share a counter: each thread is given
+// one of kReaderSlots slots, on a cache line of its own, so readers on
+// different cores never write to the same line. A writer first raises its
+// flag, which turns away new readers, and then waits for every slot to
+// drain, so a steady stream of readers cannot starve it.
+class RwSpinLock {
+public:
+  static constexpr std::size_t kReaderSlots{ 16 };
+
+  void lock_shared() {
+    auto& readers{ slots_[ThisThreadSlot()].readers };
+    Backoff backoff{};
+    for (;;) {
+      while (writer_.load(std::memory_order_relaxed)) {
+        backoff.Pause();
+      }
+      // Pairs with the exchange and the slot loads in lock(): with both
+      // sides sequentially consistent at least one sees the other.
+      readers.fetch_add(1, std::memory_order_seq_cst);
+      if (not writer_.load(std::memory_order_seq_cst)) {
+        return;
+      }
+      readers.fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+  bool try_lock_shared() {
+    auto& readers{ slots_[ThisThreadSlot()].readers };
+    readers.fetch_add(1, std::memory_order_seq_cst);
+    if (not writer_.load(std::memory_order_seq_cst)) {
+      return true;
+    }
+    readers.fetch_sub(1, std::memory_order_release);
+    return false;
+  }
+
+  void unlock_shared() {
+    slots_[ThisThreadSlot()].readers.fetch_sub(1, std::memory_order_release);
+  }
+
+  void lock() {
+    Backoff backoff{};
+    while (writer_.exchange(true, std::memory_order_seq_cst)) {
+      do {
+        backoff.Pause();
+      } while (writer_.load(std::memory_order_relaxed));
+    }
+    for (auto& slot : slots_) {
+      Backoff drain{};
+      while (slot.readers.load(std::memory_order_seq_cst) != 0) {
+        drain.Pause();
+      }
+    }
+  }
+
+  bool try_lock() {
+    if (writer_.load(std::memory_order_relaxed) or
+        writer_.exchange(true, std::memory_order_seq_cst)) {
+      return false;
+    }
+    for (auto& slot : slots_) {
+      if (slot.readers.load(std::memory_order_seq_cst) != 0) {
+        writer_.store(false, std::memory_order_release);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void unlock() {
+    writer_.store(false, std::memory_order_release);
+  }
+
+private:
+  struct alignas(kSpinLockAlignment) Slot {
+    std::atomic<uint32_t> readers{};
+  };
+
+  // Handed out round-robin, so up to kReaderSlots threads get a line each.
+  static std::size_t ThisThreadSlot() {
+    static std::atomic<std::size_t> next_slot{};
+    static thread_local const std::size_t slot{
+      next_slot.fetch_add(1, std::memory_order_relaxed) % kReaderSlots };
+    return slot;
+  }
+
+  alignas(kSpinLockAlignment) std::atomic<bool> writer_{ false };
+  Slot slots_[kReaderSlots];
+};
+
+using SpinLock = TtasSpinLock;
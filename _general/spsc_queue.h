@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "cache_line.h"
+
+inline std::size_t RoundUpToPowerOfTwo(const std::size_t value) {
+  std::size_t power{ 1 };
+  while (power < value) {
+    power <<= 1;
+  }
+  return power;
+}
+
+// Bounded ring for exactly one producer and one consumer. Head and tail
+// live on their own cache lines and each side keeps a stale copy of the
+// other's index, so the shared one is only reread when the copy says the
+// ring is full or does not hold what was asked for.
+template <class T>
+class SpscQueue {
+public:
+  // |capacity| is rounded up to a power of two.
+  explicit SpscQueue(const std::size_t capacity)
+    : mask_{ RoundUpToPowerOfTwo(std::max<std::size_t>(capacity, 2)) - 1 },
+      cells_(mask_ + 1) {}
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  template <class U>
+  bool TryPush(U&& value) {
+    const std::size_t tail{ tail_.load(std::memory_order_relaxed) };
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return false;
+      }
+    }
+    cells_[tail & mask_] = std::forward<U>(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Hands up to |max_batch| values to |consume|, which may move from them,
+  // and frees their cells with a single store. Everything pushed before the
+  // call is seen unless |max_batch| runs out first.
+  template <class Consume>
+  std::size_t ConsumeBatch(Consume&& consume, const std::size_t max_batch) {
+    const std::size_t head{ head_.load(std::memory_order_relaxed) };
+    if (cached_tail_ - head < max_batch) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    }
+    const std::size_t count{ std::min(cached_tail_ - head, max_batch) };
+    for (std::size_t i{}; i < count; ++i) {
+      consume(cells_[(head + i) & mask_]);
+    }
+    if (count > 0) {
+      head_.store(head + count, std::memory_order_release);
+    }
+    return count;
+  }
+
+  bool IsEmpty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+  std::size_t Capacity() const {
+    return mask_ + 1;
+  }
+
+private:
+  alignas(kCacheLineSize) std::atomic<std::size_t> head_{};
+  std::size_t cached_tail_{};
+  alignas(kCacheLineSize) std::atomic<std::size_t> tail_{};
+  std::size_t cached_head_{};
+  alignas(kCacheLineSize) const std::size_t mask_;
+  std::vector<T> cells_;
+};
@@ -1,12 +1,109 @@
-
 #pragma once
 
-#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#ifndef _WIN32
+#include <cerrno>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include "lock_profiler.h"
 #include "spinlock.h"
 
 namespace mytp {
+  // Auto-reset wake-up a thread body blocks on instead of spinning. A
+  // Signal() that comes while nobody waits is kept for the next wait, so a
+  // Stop() issued before the thread got to waiting is not lost.
+  class Event {
+  public:
+    Event() {
+#ifdef _WIN32
+      handle_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+      if (handle_ == NULL) {
+        throw std::runtime_error{ "CreateEvent() failed" };
+      }
+#else
+      fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (fd_ < 0) {
+        throw std::runtime_error{ "eventfd() failed" };
+      }
+#endif
+    }
+
+    Event(const Event&) = delete;
+    Event& operator=(const Event&) = delete;
+
+    ~Event() {
+#ifdef _WIN32
+      CloseHandle(handle_);
+#else
+      close(fd_);
+#endif
+    }
+
+    void Signal() {
+#ifdef _WIN32
+      SetEvent(handle_);
+#else
+      const uint64_t one{ 1 };
+      ssize_t written{ write(fd_, &one, sizeof(one)) };
+      (void)written;
+#endif
+    }
+
+    void Wait() {
+      WaitFor(std::chrono::milliseconds{ -1 });
+    }
+
+    // Returns false on timeout; a negative timeout waits forever.
+    bool WaitFor(const std::chrono::milliseconds timeout) {
+#ifdef _WIN32
+      const DWORD ms{ timeout.count() < 0 ? INFINITE
+                                          : static_cast<DWORD>(timeout.count()) };
+      return WaitForSingleObject(handle_, ms) == WAIT_OBJECT_0;
+#else
+      pollfd event{ fd_, POLLIN, 0 };
+      int ready{};
+      do {
+        ready = poll(&event, 1, static_cast<int>(timeout.count()));
+      } while (ready < 0 and errno == EINTR);
+      if (ready <= 0) {
+        return false;
+      }
+      uint64_t count{};
+      ssize_t received{ read(fd_, &count, sizeof(count)) };
+      return received == sizeof(count);
+#endif
+    }
+
+#ifndef _WIN32
+    // For thread bodies that poll() their own descriptors next to it.
+    int fd() const {
+      return fd_;
+    }
+#endif
+
+  private:
+#ifdef _WIN32
+    HANDLE handle_{};
+#else
+    int fd_{ -1 };
+#endif
+  };
+
+
   struct ThreadPoolInterface {
     virtual void NotifyAboutStartUp(std::size_t thread_index) = 0;
     virtual void NotifyAboutTermination(std::size_t thread_index) = 0;
@@ -15,7 +112,7 @@ namespace mytp {
   struct ThreadCallback {
     ThreadCallback() = delete;
     ThreadCallback(ThreadPoolInterface * thread_pool_interface, const std::size_t thread_number) :
-      thread_pool_interface_{ thread_pool_interface }, thread_number_{ thread_number } {}
+      thread_number_{ thread_number }, thread_pool_interface_{ thread_pool_interface } {}
     ~ThreadCallback() { thread_pool_interface_ = nullptr; }
 
     virtual void NotifyAboutStartUp() {
@@ -40,11 +137,18 @@ namespace mytp {
   };
 
 
+  // Base for thread bodies. ThreadFunction() sleeps on the thread's own
+  // event between rounds of work, so an idle thread costs no CPU, and
+  // Stop() wakes it at once.
   class ThreadDataBase {
   public:
     struct errors {
-      struct General : public std::runtime_error {};
-      struct DefaultThreadFunctionIsCalled : public General {};
+      struct General : public std::runtime_error {
+        using std::runtime_error::runtime_error;
+      };
+      struct DefaultThreadFunctionIsCalled : public General {
+        using General::General;
+      };
     };
 
     ThreadDataBase() = delete;
@@ -52,16 +156,22 @@ namespace mytp {
       : pool_callback_(pool_callback) {}
 
     ThreadDataBase(ThreadDataBase&) = delete;
-    ThreadDataBase(ThreadDataBase&&) = default;
+    ThreadDataBase(ThreadDataBase&&) = delete;
 
-    ~ThreadDataBase() = default;
+    virtual ~ThreadDataBase() = default;
 
     void Stop() {
       is_running = false;
+      wakeup_.Signal();
+    }
+
+    // Hands the thread a reason to look for work.
+    void Notify() {
+      wakeup_.Signal();
     }
 
     virtual void ThreadFunction() {
-      while (is_running) { std::this_thread::yield(); }
+      while (WaitForWakeup()) {}
     }
 
     void operator()() {
@@ -71,7 +181,6 @@ namespace mytp {
       if (pool_callback_) {
         pool_callback_->NotifyAboutStartUp();
       }
-      is_running = true;
       ThreadFunction();
       if (pool_callback_) {
         pool_callback_->NotifyAboutTermination();
@@ -79,13 +188,226 @@ namespace mytp {
     }
 
   protected:
+    // Blocks until Notify() or Stop(); false once the thread should exit.
+    bool WaitForWakeup() {
+      if (is_running) {
+        wakeup_.Wait();
+      }
+      return is_running;
+    }
+
+    // The same with a deadline, for bodies that also do periodic work.
+    bool WaitForWakeup(const std::chrono::milliseconds timeout) {
+      if (is_running) {
+        wakeup_.WaitFor(timeout);
+      }
+      return is_running;
+    }
+
     ThreadCallback * pool_callback_{};
-    bool is_running{ false };
+    // Starts out true so that a Stop() before the thread runs still counts.
+    std::atomic<bool> is_running{ true };
     std::size_t thread_number_{};
+    Event wakeup_{};
+  };
+
+
+  // Counts down to zero once; the thread that gets there signals the one
+  // waiter, so the threads counting down never take a lock.
+  class Latch {
+  public:
+    explicit Latch(const std::ptrdiff_t count = 0) : count_{ count } {}
+
+    Latch(const Latch&) = delete;
+    Latch& operator=(const Latch&) = delete;
+
+    // Only while nobody counts down or waits.
+    void Reset(const std::ptrdiff_t count) {
+      count_.store(count, std::memory_order_release);
+    }
+
+    void CountDown() {
+      if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        done_.Signal();
+      }
+    }
+
+    bool IsReady() const {
+      return count_.load(std::memory_order_acquire) <= 0;
+    }
+
+    void Wait() {
+      while (not IsReady()) {
+        done_.Wait();
+      }
+    }
+
+  private:
+    std::atomic<std::ptrdiff_t> count_;
+    Event done_{};
+  };
+
+
+  // Owns one thread per Data. Data is built from the thread's callback
+  // followed by the arguments of AddNewThread(), and has to provide
+  // operator()() and Stop(), which ThreadDataBase descendants do.
+  //
+  // Start-up and termination are counted on latches: Start() returns once
+  // every thread has reported in, WaitForThreads() once all have left, and
+  // the threads themselves only touch atomics on the way.
+  template <class Data>
+  class ThreadPool : public ThreadPoolInterface {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    ThreadPool() = default;
+    ThreadPool(const ThreadPool&) = delete;
+
+    virtual ~ThreadPool() {
+      Stop();
+      JoinAllThreads();
+    }
+
+    // Threads can only be added before Start().
+    template <class... Args>
+    Data* AddNewThread(Args&&... args) {
+      std::lock_guard<Mutex> lock{ access_mutex_ };
+      if (is_running_) {
+        return nullptr;
+      }
+      auto control{ std::make_unique<ThreadControl>() };
+      control->callback = std::make_unique<ThreadCallback>(this, threads_controls_.size());
+      control->data = std::make_unique<Data>(control->callback.get(), std::forward<Args>(args)...);
+      threads_controls_.emplace_back(std::move(control));
+      return threads_controls_.back()->data.get();
+    }
+
+    // Launches every added thread and returns once all of them run.
+    // The wait happens outside the lock since starting threads may well
+    // call GetThreadData().
+    void Start() {
+      {
+        std::lock_guard<Mutex> lock{ access_mutex_ };
+        if (is_running_ or is_started_) {
+          return;
+        }
+        is_running_ = true;
+        is_started_ = true;
+        started_.Reset(static_cast<std::ptrdiff_t>(threads_controls_.size()));
+        finished_.Reset(static_cast<std::ptrdiff_t>(threads_controls_.size()));
+        launched_at_ = Clock::now();
+        threads_.reserve(threads_controls_.size());
+        for (auto& tc : threads_controls_) {
+          threads_.emplace_back(std::ref(*tc->data));
+        }
+      }
+      started_.Wait();
+      startup_time_ = Clock::now() - launched_at_;
+    }
+
+    // Sleeps until every thread has finished; Stop() gets them there.
+    void WaitForThreads() {
+      if (is_started_) {
+        finished_.Wait();
+      }
+    }
+
+    virtual void StartThreads() {
+      Start();
+      WaitForThreads();
+    }
+
+    void Stop() {
+      {
+        std::lock_guard<Mutex> lock{ access_mutex_ };
+        is_running_ = false;
+      }
+      TerminateAllThreads();
+    }
+
+    Data* GetThreadData(const size_t thread_index) {
+      std::lock_guard<Mutex> lock{ access_mutex_ };
+      if (thread_index < threads_controls_.size() and threads_controls_.at(thread_index)) {
+        return threads_controls_.at(thread_index)->data.get();
+      }
+      else {
+        return nullptr;
+      }
+    }
+
+    void JoinAllThreads() {
+      for (auto& thread : threads_) {
+        if (thread.joinable()) {
+          thread.join();
+        }
+      }
+    }
+
+    void TerminateAllThreads() {
+      for (auto& tc : threads_controls_) {
+        if (tc and tc->data) {
+          tc->data->Stop();
+        }
+      }
+    }
+
+    bool ThreadsAreRunning() const {
+      return is_started_ and not finished_.IsReady();
+    }
+
+    // Wall time Start() took, and how long after the launch each thread
+    // reported in. Valid once Start() has returned.
+    Clock::duration StartupTime() const {
+      return startup_time_;
+    }
+
+    std::vector<Clock::duration> ThreadStartupTimes() const {
+      std::vector<Clock::duration> times{};
+      times.reserve(threads_controls_.size());
+      for (const auto& tc : threads_controls_) {
+        times.push_back(tc->startup_time);
+      }
+      return times;
+    }
+
+    virtual void NotifyAboutStartUp(std::size_t thread_number) override {
+      auto& control{ *threads_controls_[thread_number] };
+      control.startup_time = Clock::now() - launched_at_;
+      control.is_running_.store(true, std::memory_order_release);
+      started_.CountDown();
+    }
+
+    virtual void NotifyAboutTermination(std::size_t thread_number) override {
+      threads_controls_[thread_number]->is_running_.store(false, std::memory_order_release);
+      finished_.CountDown();
+    }
+
+  protected:
+    // The callback outlives the data that points to it.
+    struct ThreadControl {
+      std::unique_ptr<ThreadCallback> callback;
+      std::unique_ptr<Data> data;
+      std::atomic<bool> is_running_{ false };
+      Clock::duration startup_time{};
+    };
+
+    using Mutex = ProfiledLock<std::mutex>;
+
+    Mutex access_mutex_{ "ThreadPool::access_mutex_" };
+    std::vector<std::unique_ptr<ThreadControl>> threads_controls_;
+    std::vector<std::thread> threads_;
+    bool is_running_{ false };
+    bool is_started_{ false };
+
+    Latch started_{}, finished_{};
+    Clock::time_point launched_at_{};
+    Clock::duration startup_time_{};
   };
 
 
-  class MyThreadPool : public ThreadPoolInterface {
+#ifdef _WIN32
+  // Window threads of ame2, one GDI+ window per thread.
+  class MyThreadPool : public ThreadPool<ThreadData> {
   public:
     MyThreadPool() = default;
     MyThreadPool(const POINT& windows_size) : windows_size_(windows_size) {
@@ -96,17 +418,11 @@ namespace mytp {
     virtual void AddNewThread(WNDPROC wnd_proc, std::shared_ptr<SharedPicture> shared_picture,
       std::shared_ptr<SharedMemory> shared_memory,
       const Gdiplus::Color& pen_color) {
-      if (not is_running_) {
-        std::size_t new_thread_number{ threads_controls_.size() };
-        auto callback{ new ThreadCallback{this, new_thread_number} };
-        auto data{ new ThreadData{callback, wnd_proc, shared_picture, shared_memory,
-          shared_position_, pen_color, this->windows_size_} };
-        auto control{ std::make_unique<ThreadControl>(data, callback) };
-        threads_controls_.emplace_back(std::move(control));
-      }
+      ThreadPool<ThreadData>::AddNewThread(wnd_proc, shared_picture, shared_memory,
+        shared_position_, pen_color, this->windows_size_);
     }
 
-    virtual void StartThreads() {
+    virtual void StartThreads() override {
       if (not is_running_) {
         if (not threads_controls_.empty()) {
           auto [rect, windows_positions] {GenerateWindowPositions(this->windows_size_, threads_controls_.size(), 10)};
@@ -118,31 +434,16 @@ namespace mytp {
               }
             }
           }
-          for (auto& tc : threads_controls_) {
-            threads_.emplace_back(std::ref(*tc->data));
-          }
-        }
-        using namespace std::chrono_literals;
-        this->is_running_ = true;
-        while (this->is_running_ and ThreadsAreRunning()) {
-          std::this_thread::sleep_for(1ms);
         }
+        Start();
+        ReportStartup();
+        WaitForThreads();
         std::cout << "Main thread terminated" << std::endl;
       }
     }
 
-    ThreadData* GetThreadData(const size_t thread_index) {
-      std::lock_guard<std::mutex> lock{ access_mutex_ };
-      if (thread_index < threads_controls_.size() and threads_controls_.at(thread_index)) {
-        return threads_controls_.at(thread_index)->data;
-      }
-      else {
-        return nullptr;
-      }
-    }
-
     std::vector<HWND> GetAllThreadsHwnd() {
-      std::lock_guard<std::mutex> lock{ access_mutex_ };
+      std::lock_guard<Mutex> lock{ access_mutex_ };
       std::vector<HWND> all_threads_hwnd{};
       all_threads_hwnd.reserve(threads_controls_.size());
       for (auto& thread : threads_controls_) {
@@ -153,20 +454,6 @@ namespace mytp {
       return all_threads_hwnd;
     }
 
-    void JoinAllThreads() {
-      for (auto& thread : threads_) {
-        thread.join();
-      }
-    }
-
-    void TerminateAllThreads() {
-      for (auto& tc : threads_controls_) {
-        if (tc and tc->data) {
-          tc->data->Stop();
-        }
-      }
-    }
-
     void ShutDown() {
       Gdiplus::GdiplusShutdown(gdiplusToken);
     }
@@ -177,41 +464,29 @@ namespace mytp {
       JoinAllThreads();
     }
 
-    bool ThreadsAreRunning() {
-      return number_of_running_threads_ > 0 or (std::size_t)number_of_started_threads_ < threads_controls_.size();
-    }
-
-    virtual void NotifyAboutStartUp(std::size_t thread_number) override {
-      std::lock_guard<std::mutex> lock(access_mutex_);
-      this->threads_controls_.at(thread_number)->is_running_ = true;
-      ++number_of_started_threads_;
-      ++number_of_running_threads_;
-      std::cout << "Thread #" << thread_number << " started" << std::endl;
-    }
-
-    virtual void NotifyAboutTermination(std::size_t thread_number) override {
-      std::lock_guard<std::mutex> lock(access_mutex_);
-      this->threads_controls_.at(thread_number)->is_running_ = false;
-      --number_of_running_threads_;
-      std::cout << "Thread #" << thread_number << " terminated" << std::endl;
+    // Printed once after start-up rather than from every thread.
+    void ReportStartup() const {
+      using std::chrono::duration_cast;
+      using std::chrono::microseconds;
+      const auto times{ ThreadStartupTimes() };
+      for (std::size_t i{}; i < times.size(); ++i) {
+        std::cout << "Thread #" << i << " started after "
+          << duration_cast<microseconds>(times[i]).count() << " us" << std::endl;
+      }
+      std::cout << times.size() << " threads started in "
+        << duration_cast<microseconds>(StartupTime()).count() << " us" << std::endl;
     }
 
   protected:
-    std::mutex access_mutex_;
-    std::vector<std::unique_ptr<ThreadControl>> threads_controls_;
-    std::vector<std::thread> threads_;
-    bool is_running_{ false };
-
     Gdiplus::GdiplusStartupInput gdiplusStartupInput;
     ULONG_PTR gdiplusToken;
 
-    int number_of_running_threads_{};
-    int number_of_started_threads_{};
-
     POINT windows_size_;
     std::shared_ptr<SharedPosition> shared_position_;
   };
+#endif
 
 }
 
 
+
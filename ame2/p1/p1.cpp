@@ -15,6 +15,8 @@
 #include <sstream>
 
 #include "defs.h"
+#include "instruments.h"
+#include "seqlock.h"
 #include "shared_memory.h"
 #include "shared_picture.h"
 
@@ -25,21 +27,32 @@
 
 constexpr bool kDrawFromBitmap{ true };
 
+// Live numbers for instr_view, shared by all window threads.
+struct Instruments {
+  instr::Timer paint{ "p1.paint" };
+  instr::Timer rasterize{ "p1.rasterize" };
+  instr::Timer store_to_shared_memory{ "p1.store_to_shared_memory" };
+  instr::Counter points{ "p1.points" };
+  instr::Counter lines{ "p1.lines" };
+  instr::Gauge windows{ "p1.windows" };
+};
+
+Instruments g_instruments;
+
+// Read by every window on each move, written only by the one being
+// dragged, so readers just copy the POINT and never take a lock.
 class MultiThreadCompositionPosition {
 public:
-  POINT GetGlobalPosition() {
-    std::lock_guard<std::mutex> lock{access_};
-    return global_position_;
+  POINT GetGlobalPosition() const {
+    return global_position_.Load();
   }
 
   void SetGlobalPosition(const POINT& new_position) {
-    std::lock_guard<std::mutex> lock(access_);
-    global_position_ = new_position;
+    global_position_.Store(new_position);
   }
 
 private:
-  std::mutex access_;
-  POINT global_position_{};
+  SeqLock<POINT> global_position_{};
 };
 
 
@@ -116,6 +129,7 @@ public:
   }
 
   void DrawCurrentThreadWindow(HDC& hdc, PAINTSTRUCT& ps) {
+    instr::ScopedTimer timing{ g_instruments.paint };
     hdc = BeginPaint(this->hwnd, &ps);
     Gdiplus::Graphics graphics(hdc);
     shared_picture->DrawRasterPicture(graphics);
@@ -135,6 +149,7 @@ public:
     if (not shared_memory) {
       return;
     }
+    instr::ScopedTimer timing{ g_instruments.store_to_shared_memory };
     try {
       if (not shared_memory->IsOpened()) {
         shared_memory->Create();
@@ -157,6 +172,11 @@ public:
     }
   }
 
+  void Rasterize() {
+    instr::ScopedTimer timing{ g_instruments.rasterize };
+    shared_picture->Rasterize();
+  }
+
   LRESULT CALLBACK WndProc(const std::vector<HWND>& all_threads_hwnd, HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     HDC hdc;
     PAINTSTRUCT ps;
@@ -167,13 +187,14 @@ public:
 
     case WM_LBUTTONDOWN:
       shared_picture->AddLine(pen_color);
-      shared_picture->Rasterize();
+      g_instruments.lines.Add();
+      Rasterize();
       InvalidateRectOfAllThreads(all_threads_hwnd, nullptr, false);
       break;
 
     case WM_RBUTTONDOWN:
       shared_picture->Clear();
-      shared_picture->Rasterize();
+      Rasterize();
       InvalidateRectOfAllThreads(all_threads_hwnd, nullptr, false);
       break;
 
@@ -181,7 +202,8 @@ public:
       if (wParam & MK_LBUTTON) {
         int mouse_x = LOWORD(lParam), mouse_y = HIWORD(lParam);
         shared_picture->AddPoint(Gdiplus::Point{mouse_x, mouse_y});
-        shared_picture->Rasterize();
+        g_instruments.points.Add();
+        Rasterize();
         DrawCurrentThreadWindow(hdc, ps);
         InvalidateRectOfAllThreads(all_threads_hwnd, nullptr, false);
       }
@@ -251,6 +273,7 @@ public:
     if (pool_callback_) {
       pool_callback_->NotifyAboutStartUp();
     }
+    g_instruments.windows.Add(1);
     MSG msg{};
     while (is_running and GetMessage(&msg, NULL, 0, 0)) {
       //if (PeekMessage(&msg, NULL, 0, 0, true)) {
@@ -259,6 +282,7 @@ public:
       //}
       //std::this_thread::yield();
     }
+    g_instruments.windows.Add(-1);
     if (pool_callback_) {
       pool_callback_->NotifyAboutTermination();
     }
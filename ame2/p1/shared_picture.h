@@ -207,7 +207,8 @@ struct VectorPicture {
       }
       new_lines.at(i).start = line.get(0).toInt();
       new_lines.at(i).length = line.get(1).toInt();
-      new_lines.at(i).color.SetValue(0xFF000000/*line.get(2).toLong()*/);
+      new_lines.at(i).color.SetValue(
+        static_cast<Gdiplus::ARGB>(line.get(2).toLong()));
     }
 
     clear();
@@ -269,6 +270,11 @@ private:
 
 class SharedPicture {
 public:
+  // Rasterize() keeps both locks across GDI+ drawing, long enough that
+  // waiters are better off asleep than spinning. The vector picture has a
+  // single reader, Rasterize(), so a shared lock would buy nothing.
+  using Lock = AdaptiveSpinLock;
+
   SharedPicture() = default;
   SharedPicture(const POINT& bitmap_size) : raster_{ bitmap_size } { }
   SharedPicture(const std::size_t points_count, 
@@ -277,17 +283,17 @@ public:
     vector_{points_count, lines_count}, raster_{bitmap_size} { }
 
   void SetVectorPicture(const VectorPicture& vector_picture) {
-    std::lock_guard<SpinLock> lock{this->vector_lock_};
+    std::lock_guard<Lock> lock{this->vector_lock_};
     this->vector_ = vector_picture;
   }
 
   void AddPoint(const Gdiplus::Point& point) {
-    std::lock_guard<SpinLock> lock{ vector_lock_ };
+    std::lock_guard<Lock> lock{ vector_lock_ };
     vector_.AddPoint(point);
   }
 
   void AddLine(const Gdiplus::Color& color) {
-    std::lock_guard<SpinLock> lock{ vector_lock_ };
+    std::lock_guard<Lock> lock{ vector_lock_ };
     vector_.AddLine(color);
   }
 
@@ -314,7 +320,7 @@ public:
     //graphics.SetPixelOffsetMode(Gdiplus::PixelOffsetModeNone);
     //graphics.Flush(Gdiplus::FlushIntention::FlushIntentionSync);
 
-    std::lock_guard<SpinLock> lock{vector_lock_};
+    std::lock_guard<Lock> lock{vector_lock_};
     if (not vector_.lines.empty()) {
       auto max_line{(std::max)(vector_.end_line, vector_.lines.size() - 1)};
       for (std::size_t i{vector_.start_line}; i <= max_line; ++i) {
@@ -330,7 +336,7 @@ public:
   }
 
   void DrawRasterPicture(Gdiplus::Graphics& graphics) {
-    std::lock_guard<SpinLock> lock{raster_lock_};
+    std::lock_guard<Lock> lock{raster_lock_};
     auto * bitmap{raster_.GetBitmap()};
     if (bitmap) {
       Gdiplus::Rect size{0, 0, (INT)bitmap->GetWidth(), (INT)bitmap->GetHeight()};
@@ -342,7 +348,7 @@ public:
   }
 
   void Rasterize() {
-    std::lock_guard<SpinLock> lock{ raster_lock_ };
+    std::lock_guard<Lock> lock{ raster_lock_ };
     auto * bitmap{raster_.GetBitmap()};
     if (bitmap) {
       Gdiplus::Graphics graphics{bitmap};
@@ -351,12 +357,13 @@ public:
   }
 
   void Clear() {
-    std::lock_guard<SpinLock> lock{vector_lock_};
+    std::lock_guard<Lock> lock{vector_lock_};
     vector_.clear();
   }
 
 //private:
   VectorPicture vector_;
   RasterPicture raster_;
-  SpinLock vector_lock_, raster_lock_;
+  Lock vector_lock_;
+  Lock raster_lock_;
 };
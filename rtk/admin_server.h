@@ -0,0 +1,150 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "endpoint.h"
+#include "lock_profiler.h"
+#include "metrics.h"
+
+// Separate listener that answers "GET /metrics" with a Prometheus text
+// snapshot and "GET /locks" with the lock contention report. It runs on its
+// own thread so scrapes never queue behind clients.
+class AdminServer {
+ public:
+  AdminServer() = delete;
+  AdminServer(const int port_number, const int inherited_socket = -1)
+      : port_{port_number} {
+    wakeup_ = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_ < 0) {
+      throw std::runtime_error{"eventfd() failed"};
+    }
+    if (inherited_socket >= 0 and MakeNonBlocking(inherited_socket)) {
+      socket_ = inherited_socket;
+    } else {
+      PrepareSocket();
+    }
+    thread_ = std::thread{&AdminServer::AcceptLoop, this};
+  }
+  ~AdminServer() {
+    StopPolitely();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    if (socket_ >= 0) {
+      close(socket_);
+    }
+    close(wakeup_);
+  }
+
+  void StopPolitely() {
+    if (socket_ >= 0) {
+      shutdown(socket_, SHUT_RDWR);
+    }
+    StopAccepting();
+  }
+
+  void StopAccepting() {
+    is_accepting_ = false;
+    const uint64_t one{1};
+    ssize_t written{write(wakeup_, &one, sizeof(one))};
+    (void)written;
+  }
+
+  // Stops serving and closes the listener without shutting it down, so the
+  // upgraded process keeps answering scrapes on it.
+  void ReleaseHandedOffSocket() {
+    StopAccepting();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    close(socket_);
+    socket_ = -1;
+  }
+
+  int listening_socket() const { return socket_; }
+
+ private:
+  void AcceptLoop() {
+    while (is_accepting_) {
+      int client{AcceptOrWake(socket_, wakeup_, nullptr, nullptr)};
+      if (client < 0) {
+        break;
+      }
+      Serve(client);
+      shutdown(client, SHUT_RDWR);
+      close(client);
+    }
+  }
+
+  void Serve(const int client) {
+    struct timeval timeout {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::array<char, 1024> request{};
+    ssize_t received{recv(client, request.data(), request.size() - 1, 0)};
+    if (received <= 0) {
+      return;
+    }
+    const std::string request_line{request.data(),
+                                   static_cast<size_t>(received)};
+    std::string status{"200 OK"}, body{};
+    if (request_line.rfind("GET /metrics", 0) == 0) {
+      body = Metrics().Render();
+    } else if (request_line.rfind("GET /locks", 0) == 0) {
+      body = LockProfileReport();
+    } else {
+      status = "404 Not Found";
+    }
+    const std::string response{
+        "HTTP/1.0 " + status +
+        "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body};
+    size_t sent_total{};
+    while (sent_total < response.size()) {
+      ssize_t sent{send(client, response.data() + sent_total,
+                        response.size() - sent_total, MSG_NOSIGNAL)};
+      if (sent <= 0) {
+        break;
+      }
+      sent_total += static_cast<size_t>(sent);
+    }
+  }
+
+  void PrepareSocket() {
+    socket_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_ < 0) {
+      throw std::runtime_error{"socket() failed"};
+    }
+    int optval{1};
+    if (setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &optval,
+                   sizeof(optval))) {
+      throw std::runtime_error{"setsockopt() failed"};
+    }
+    struct sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port_);
+    if (bind(socket_, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address)) < 0) {
+      throw std::runtime_error{"bind() failed"};
+    }
+    if (listen(socket_, 16) < 0 or not MakeNonBlocking(socket_)) {
+      throw std::runtime_error{"listen() failed"};
+    }
+  }
+
+  int port_{};
+  int socket_{-1}, wakeup_{-1};
+  std::atomic<bool> is_accepting_{true};
+  std::thread thread_{};
+};
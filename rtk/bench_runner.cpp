@@ -0,0 +1,324 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#include "jzon.h"
+#pragma GCC diagnostic pop
+
+// Runs echo_server in each mode against test_client scenarios on loopback,
+// writes the numbers as JSON and compares them with a saved baseline. Exits
+// with 1 when throughput drops or p99 latency grows by more than the
+// tolerance, so it can gate a build.
+
+constexpr int kPort{7777};
+constexpr int kStartTimeoutMs{5000};
+constexpr int kStopTimeoutMs{3000};
+// How long a client may run past its --seconds before it is killed.
+constexpr int kClientGraceMs{10000};
+
+struct Scenario {
+  std::string name{};
+  std::vector<std::string> server_arguments{};
+  std::vector<std::string> client_arguments{};
+};
+
+struct Options {
+  std::string server{"./echo_server"};
+  std::string client{"./test_client"};
+  std::string baseline{"bench_baseline.json"};
+  std::string output{"bench_results.json"};
+  std::string filter{};
+  double tolerance{0.1};
+  int threads{4};
+  int seconds{5};
+  bool update_baseline{false};
+};
+
+// The thread pool server blocks a worker per connection, so idle
+// connections are only thrown at the epoll based one.
+std::vector<Scenario> Scenarios() {
+  const std::vector<std::string> pool{"tcp", "--no-admin"};
+  const std::vector<std::string> local{"tcp", "--unix", "--no-admin"};
+  const std::vector<std::string> sharded{"sharded", "--no-admin"};
+  return {
+      {"pool-churn", pool, {"tcp"}},
+      {"pool-pipelined", pool, {"tcp", "--keep-alive", "--pipeline=16"}},
+      {"pool-large", pool, {"tcp", "--keep-alive", "--message-size=65536"}},
+      {"unix-pipelined", local, {"unix", "--keep-alive", "--pipeline=16"}},
+      {"sharded-churn", sharded, {"tcp"}},
+      {"sharded-pipelined", sharded,
+       {"tcp", "--keep-alive", "--pipeline=16"}},
+      {"sharded-large", sharded,
+       {"tcp", "--keep-alive", "--message-size=65536"}},
+      {"sharded-idle", sharded, {"tcp", "--keep-alive", "--idle=1000"}},
+  };
+}
+
+pid_t Spawn(const std::string &path, const std::vector<std::string> &arguments,
+            const int output_fd) {
+  std::vector<char *> argv{const_cast<char *>(path.c_str())};
+  for (const auto &argument : arguments) {
+    argv.push_back(const_cast<char *>(argument.c_str()));
+  }
+  argv.push_back(nullptr);
+  const pid_t pid{fork()};
+  if (pid < 0) {
+    throw std::runtime_error{"fork() failed"};
+  }
+  if (pid == 0) {
+    const int null_fd{open("/dev/null", O_RDWR)};
+    dup2(null_fd, STDIN_FILENO);
+    dup2(output_fd >= 0 ? output_fd : null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    execv(path.c_str(), argv.data());
+    _exit(127);
+  }
+  return pid;
+}
+
+bool IsListening() {
+  const int sock{socket(AF_INET, SOCK_STREAM, 0)};
+  sockaddr_in address{AF_INET, htons(kPort)};
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  const bool connected{
+      connect(sock, reinterpret_cast<struct sockaddr *>(&address),
+              sizeof(address)) == 0};
+  close(sock);
+  return connected;
+}
+
+bool WaitForExit(const pid_t pid, const int timeout_ms, int &status) {
+  const auto deadline{std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds{timeout_ms}};
+  while (std::chrono::steady_clock::now() < deadline) {
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  }
+  return false;
+}
+
+// Asks politely first, like an operator would, and kills a server that
+// does not wind down in time so one bad run cannot wedge the suite.
+void StopServer(const pid_t pid) {
+  int status{};
+  kill(pid, SIGTERM);
+  if (not WaitForExit(pid, kStopTimeoutMs, status)) {
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+  }
+}
+
+std::string RunClient(const Options &options,
+                      const std::vector<std::string> &scenario_arguments) {
+  std::vector<std::string> arguments{scenario_arguments.front(),
+                                     std::to_string(options.threads),
+                                     std::to_string(options.seconds),
+                                     "--json"};
+  arguments.insert(arguments.end(), scenario_arguments.begin() + 1,
+                   scenario_arguments.end());
+  int pipe_fds[2]{};
+  if (pipe(pipe_fds) < 0) {
+    throw std::runtime_error{"pipe() failed"};
+  }
+  const pid_t pid{Spawn(options.client, arguments, pipe_fds[1])};
+  close(pipe_fds[1]);
+  // A server that stops answering would leave the client blocked forever,
+  // so the client gets a deadline too and is killed once it passes.
+  const auto deadline{std::chrono::steady_clock::now() +
+                      std::chrono::seconds{options.seconds} +
+                      std::chrono::milliseconds{kClientGraceMs}};
+  std::string output{};
+  char buffer[4096]{};
+  bool timed_out{false};
+  while (true) {
+    const auto left{std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now())};
+    struct pollfd descriptor {
+      pipe_fds[0], POLLIN, 0
+    };
+    const int ready{
+        left.count() > 0 ? poll(&descriptor, 1, static_cast<int>(left.count()))
+                         : 0};
+    if (ready < 0 and errno == EINTR) {
+      continue;
+    } else if (ready <= 0) {
+      timed_out = true;
+      break;
+    }
+    const ssize_t received{read(pipe_fds[0], buffer, sizeof(buffer))};
+    if (received <= 0) {
+      break;
+    }
+    output.append(buffer, static_cast<size_t>(received));
+  }
+  close(pipe_fds[0]);
+  if (timed_out) {
+    std::cerr << "bench: client did not finish in time, killed" << std::endl;
+    kill(pid, SIGKILL);
+  }
+  int status{};
+  waitpid(pid, &status, 0);
+  if (timed_out or not WIFEXITED(status) or WEXITSTATUS(status) != 0) {
+    return {};
+  }
+  return output;
+}
+
+// Returns null when the server did not come up or the client failed.
+jzon::Node RunScenario(const Options &options, const Scenario &scenario) {
+  const pid_t server{Spawn(options.server, scenario.server_arguments, -1)};
+  const auto deadline{std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds{kStartTimeoutMs}};
+  while (not IsListening() and std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{20});
+  }
+  std::string output{};
+  if (IsListening()) {
+    output = RunClient(options, scenario.client_arguments);
+  }
+  StopServer(server);
+  if (output.empty()) {
+    return jzon::null();
+  }
+  jzon::Parser parser{};
+  const jzon::Node report{parser.parseString(output)};
+  jzon::Node result{jzon::object()};
+  result.add("throughput", report.get("throughput").toDouble());
+  result.add("p50_us", report.get("p50_us").toDouble());
+  result.add("p99_us", report.get("p99_us").toDouble());
+  return result;
+}
+
+// A metric regresses when it is worse than the baseline by more than
+// |tolerance|, as a fraction of the baseline.
+bool Compare(const jzon::Node &results, const jzon::Node &baseline,
+             const double tolerance) {
+  bool passed{true};
+  std::cout << std::left << std::setw(20) << "scenario" << std::right
+            << std::setw(14) << "throughput" << std::setw(10) << "change"
+            << std::setw(12) << "p99 us" << std::setw(10) << "change"
+            << std::endl;
+  for (const auto &entry : results) {
+    const std::string &name{entry.first};
+    const jzon::Node &result{entry.second};
+    const jzon::Node expected{baseline.get(name)};
+    std::cout << std::left << std::setw(20) << name << std::right
+              << std::fixed << std::setprecision(0);
+    if (not result.isObject()) {
+      std::cout << std::setw(14) << "FAILED" << std::endl;
+      passed = false;
+      continue;
+    }
+    const double throughput{result.get("throughput").toDouble()};
+    const double p99{result.get("p99_us").toDouble()};
+    std::cout << std::setw(14) << throughput;
+    if (not expected.isObject()) {
+      std::cout << std::setw(10) << "new" << std::setw(12) << p99
+                << std::setw(10) << "new" << std::endl;
+      continue;
+    }
+    const double old_throughput{expected.get("throughput").toDouble()};
+    const double old_p99{expected.get("p99_us").toDouble()};
+    const double throughput_change{
+        old_throughput > 0. ? throughput / old_throughput - 1. : 0.};
+    const double p99_change{old_p99 > 0. ? p99 / old_p99 - 1. : 0.};
+    const bool throughput_ok{throughput_change >= -tolerance};
+    const bool p99_ok{p99_change <= tolerance};
+    std::cout << std::setprecision(1) << std::setw(9)
+              << throughput_change * 100. << (throughput_ok ? "%" : "!")
+              << std::setprecision(0) << std::setw(12) << p99
+              << std::setprecision(1) << std::setw(9) << p99_change * 100.
+              << (p99_ok ? "%" : "!") << std::endl;
+    passed = passed and throughput_ok and p99_ok;
+  }
+  return passed;
+}
+
+bool FileExists(const std::string &path) {
+  return access(path.c_str(), R_OK) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  Options options{};
+  for (int i{1}; i < argc; ++i) {
+    const std::string argument{argv[i]};
+    if (argument.rfind("--server=", 0) == 0) {
+      options.server = argument.substr(9);
+    } else if (argument.rfind("--client=", 0) == 0) {
+      options.client = argument.substr(9);
+    } else if (argument.rfind("--baseline=", 0) == 0) {
+      options.baseline = argument.substr(11);
+    } else if (argument.rfind("--output=", 0) == 0) {
+      options.output = argument.substr(9);
+    } else if (argument.rfind("--tolerance=", 0) == 0) {
+      options.tolerance = std::stod(argument.substr(12));
+    } else if (argument.rfind("--threads=", 0) == 0) {
+      options.threads = std::stoi(argument.substr(10));
+    } else if (argument.rfind("--seconds=", 0) == 0) {
+      options.seconds = std::max(1, std::stoi(argument.substr(10)));
+    } else if (argument.rfind("--only=", 0) == 0) {
+      options.filter = argument.substr(7);
+    } else if (argument == "--update-baseline") {
+      options.update_baseline = true;
+    } else {
+      std::cerr << "usage: " << argv[0]
+                << " [--server=PATH] [--client=PATH] [--baseline=FILE]"
+                   " [--output=FILE] [--tolerance=FRACTION] [--threads=N]"
+                   " [--seconds=N] [--only=SUBSTRING] [--update-baseline]"
+                << std::endl;
+      return 2;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  jzon::Node results{jzon::object()};
+  for (const auto &scenario : Scenarios()) {
+    if (scenario.name.find(options.filter) == std::string::npos) {
+      continue;
+    }
+    std::cerr << "bench: " << scenario.name << std::endl;
+    results.add(scenario.name, RunScenario(options, scenario));
+  }
+
+  jzon::Writer writer{jzon::StandardFormat};
+  writer.writeFile(results, options.output);
+  const bool has_baseline{FileExists(options.baseline)};
+  jzon::Node baseline{jzon::object()};
+  if (has_baseline and not options.update_baseline) {
+    jzon::Parser parser{};
+    baseline = parser.parseFile(options.baseline);
+  }
+  const bool passed{Compare(results, baseline, options.tolerance)};
+  if (not has_baseline or options.update_baseline) {
+    if (passed) {
+      writer.writeFile(results, options.baseline);
+      std::cout << "baseline saved to " << options.baseline << std::endl;
+    }
+    return passed ? 0 : 1;
+  }
+  if (not passed) {
+    std::cout << "regression beyond " << options.tolerance * 100.
+              << "% against " << options.baseline << std::endl;
+  }
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+#include "sharded_server.h"
+
+// Fan-out pub/sub on top of ShardedServer. A connection that sends "SUB\n"
+// becomes a subscriber; "PUB <payload>\n" from any connection delivers
+// "<payload>\n" to every subscriber. The payload is copied exactly once,
+// into a refcounted SharedMessage, and every subscriber queue only points
+// at it.
+
+constexpr size_t kSubscriberQueueDepth{64};
+constexpr size_t kMaxCommandSize{kShardBufferSize};
+
+// What to do when a subscriber's queue is full.
+enum class SlowConsumerPolicy {
+  kDrop,        // the new message is not queued for it
+  kDisconnect,  // the subscriber is closed
+  kCoalesce,    // queued messages that have not started are replaced
+};
+
+struct BroadcastOptions {
+  SlowConsumerPolicy policy{SlowConsumerPolicy::kDrop};
+};
+
+inline BroadcastOptions &BroadcastSettings() {
+  static BroadcastOptions options{};
+  return options;
+}
+
+// Immutable payload shared by all shards. Each shard holds one reference
+// and drops it once its last subscriber has sent the message, so the
+// atomic is touched once per shard rather than once per subscriber.
+class SharedMessage {
+ public:
+  static SharedMessage *Create(const unsigned char *data, const size_t size,
+                               const uint32_t references) {
+    void *memory{::operator new(sizeof(SharedMessage) + size)};
+    auto *message{new (memory) SharedMessage{size, references}};
+    std::memcpy(message->data(), data, size);
+    return message;
+  }
+
+  void Release() {
+    if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      this->~SharedMessage();
+      ::operator delete(this);
+    }
+  }
+
+  unsigned char *data() { return reinterpret_cast<unsigned char *>(this + 1); }
+  size_t size() const { return size_; }
+
+ private:
+  SharedMessage(const size_t size, const uint32_t references)
+      : references_{references}, size_{size} {}
+
+  std::atomic<uint32_t> references_{};
+  size_t size_{};
+};
+
+class BroadcastShardHandler {
+ public:
+  static constexpr const char *kName{"broadcast"};
+
+  // Shard-local share of a SharedMessage, counted without atomics.
+  struct Delivery {
+    SharedMessage *message{};
+    uint32_t pending{};
+  };
+
+  struct Session {
+    bool is_subscribed{false};
+    size_t subscriber_index{};
+    std::string partial_command{};
+    std::array<Delivery *, kSubscriberQueueDepth> queue{};
+    size_t head{}, count{}, head_offset{};
+  };
+
+  struct Message {
+    SharedMessage *message{};
+  };
+
+  template <class Shard>
+  void OnOpen(Shard &shard, typename Shard::Connection &connection) {
+    (void)shard;
+    (void)connection;
+  }
+
+  template <class Shard>
+  void OnData(Shard &shard, typename Shard::Connection &connection,
+              const unsigned char *data, const size_t size) {
+    auto &session{connection.session};
+    const unsigned char *end{data + size};
+    while (data < end) {
+      const unsigned char *newline{std::find(data, end, '\n')};
+      if (newline == end) {
+        session.partial_command.append(data, end);
+        if (session.partial_command.size() > kMaxCommandSize) {
+          shard.Close(connection);
+        }
+        return;
+      }
+      if (session.partial_command.empty()) {
+        Execute(shard, connection, data, newline + 1);
+      } else {
+        session.partial_command.append(data, newline + 1);
+        const auto *command{reinterpret_cast<const unsigned char *>(
+            session.partial_command.data())};
+        Execute(shard, connection, command,
+                command + session.partial_command.size());
+        session.partial_command.clear();
+      }
+      data = newline + 1;
+    }
+  }
+
+  template <class Shard>
+  void OnWritable(Shard &shard, typename Shard::Connection &connection) {
+    Pump(shard, connection);
+  }
+
+  template <class Shard>
+  void OnClose(Shard &shard, typename Shard::Connection &connection) {
+    (void)shard;
+    auto &session{connection.session};
+    while (session.count > 0) {
+      PopFront(session);
+    }
+    if (session.is_subscribed) {
+      auto *last{subscribers_.back()};
+      subscribers_[session.subscriber_index] = last;
+      last->session.subscriber_index = session.subscriber_index;
+      subscribers_.pop_back();
+      session.is_subscribed = false;
+    }
+  }
+
+  template <class Shard>
+  void OnMessage(Shard &shard, Message &message) {
+    Delivery *delivery{AcquireDelivery(message.message)};
+    for (auto *subscriber : subscribers_) {
+      Enqueue(shard, *subscriber, delivery);
+    }
+    ReleaseDelivery(delivery);
+  }
+
+ private:
+  template <class Shard>
+  void Execute(Shard &shard, typename Shard::Connection &connection,
+               const unsigned char *begin, const unsigned char *end) {
+    static constexpr char kPublish[]{"PUB "};
+    static constexpr char kSubscribe[]{"SUB"};
+    const size_t size{static_cast<size_t>(end - begin)};
+    if (size > sizeof(kPublish) - 1 and
+        std::memcmp(begin, kPublish, sizeof(kPublish) - 1) == 0) {
+      Publish(shard, begin + sizeof(kPublish) - 1,
+              size - (sizeof(kPublish) - 1));
+    } else if (size >= sizeof(kSubscribe) - 1 and
+               std::memcmp(begin, kSubscribe, sizeof(kSubscribe) - 1) == 0) {
+      auto &session{connection.session};
+      if (not session.is_subscribed) {
+        session.is_subscribed = true;
+        session.subscriber_index = subscribers_.size();
+        subscribers_.push_back(&connection);
+      }
+    }
+  }
+
+  template <class Shard>
+  void Publish(Shard &shard, const unsigned char *payload, const size_t size) {
+    auto &metrics{LocalMetrics()};
+    metrics.messages_published.Add();
+    SharedMessage *message{SharedMessage::Create(
+        payload, size, static_cast<uint32_t>(shard.size()))};
+    for (size_t to{}; to < shard.size(); ++to) {
+      if (not shard.Post(to, Message{message})) {
+        metrics.messages_dropped.Add();
+        message->Release();
+      }
+    }
+  }
+
+  template <class Shard>
+  void Enqueue(Shard &shard, typename Shard::Connection &connection,
+               Delivery *delivery) {
+    auto &session{connection.session};
+    if (connection.is_closing) {
+      return;
+    }
+    if (session.count == kSubscriberQueueDepth) {
+      switch (BroadcastSettings().policy) {
+        case SlowConsumerPolicy::kDrop:
+          LocalMetrics().messages_dropped.Add();
+          return;
+        case SlowConsumerPolicy::kDisconnect:
+          LocalMetrics().slow_consumers_disconnected.Add();
+          shard.Close(connection);
+          return;
+        case SlowConsumerPolicy::kCoalesce:
+          Coalesce(session);
+          break;
+      }
+    }
+    session.queue[(session.head + session.count) % kSubscriberQueueDepth] =
+        delivery;
+    ++session.count;
+    ++delivery->pending;
+    if (not connection.session_wants_write) {
+      Pump(shard, connection);
+    }
+  }
+
+  // Keeps a partially sent head so the stream stays well formed and drops
+  // everything behind it.
+  template <class Session>
+  void Coalesce(Session &session) {
+    const size_t keep{session.head_offset > 0 ? size_t{1} : size_t{0}};
+    while (session.count > keep) {
+      const size_t last{(session.head + session.count - 1) %
+                        kSubscriberQueueDepth};
+      ReleaseDelivery(session.queue[last]);
+      --session.count;
+      LocalMetrics().messages_dropped.Add();
+    }
+  }
+
+  // Writes as much of the queue as the socket takes in one sendmsg().
+  template <class Shard>
+  void Pump(Shard &shard, typename Shard::Connection &connection) {
+    auto &session{connection.session};
+    std::array<struct iovec, kShardMaxIovecs> iovecs{};
+    while (session.count > 0) {
+      size_t count{}, requested{};
+      for (; count < session.count and count < iovecs.size(); ++count) {
+        SharedMessage *message{
+            session.queue[(session.head + count) % kSubscriberQueueDepth]
+                ->message};
+        const size_t offset{count == 0 ? session.head_offset : 0};
+        iovecs[count].iov_base = message->data() + offset;
+        iovecs[count].iov_len = message->size() - offset;
+        requested += iovecs[count].iov_len;
+      }
+      struct msghdr header {};
+      header.msg_iov = iovecs.data();
+      header.msg_iovlen = count;
+      ssize_t sent{
+          sendmsg(connection.sock, &header, MSG_DONTWAIT | MSG_NOSIGNAL)};
+      if (sent < 0) {
+        if (errno == EAGAIN or errno == EWOULDBLOCK) {
+          shard.SetSessionWriteInterest(connection, true);
+        } else {
+          shard.Close(connection);
+        }
+        return;
+      }
+      LocalMetrics().bytes_out.Add(static_cast<uint64_t>(sent));
+      shard.Touch(connection);
+      size_t remaining{static_cast<size_t>(sent)};
+      while (remaining > 0) {
+        const size_t left{session.queue[session.head]->message->size() -
+                          session.head_offset};
+        if (remaining < left) {
+          session.head_offset += remaining;
+          break;
+        }
+        remaining -= left;
+        PopFront(session);
+      }
+      if (static_cast<size_t>(sent) < requested) {
+        shard.SetSessionWriteInterest(connection, true);
+        return;
+      }
+    }
+    if (connection.session_wants_write) {
+      shard.SetSessionWriteInterest(connection, false);
+    }
+  }
+
+  template <class Session>
+  void PopFront(Session &session) {
+    ReleaseDelivery(session.queue[session.head]);
+    session.head = (session.head + 1) % kSubscriberQueueDepth;
+    session.head_offset = 0;
+    --session.count;
+  }
+
+  // The caller keeps one pending reference while it fans the delivery out,
+  // so a subscriber that sends it right away cannot free it mid-loop.
+  Delivery *AcquireDelivery(SharedMessage *message) {
+    Delivery *delivery{};
+    if (free_deliveries_.empty()) {
+      deliveries_.emplace_back(new Delivery{});
+      delivery = deliveries_.back().get();
+    } else {
+      delivery = free_deliveries_.back();
+      free_deliveries_.pop_back();
+    }
+    delivery->message = message;
+    delivery->pending = 1;
+    return delivery;
+  }
+
+  void ReleaseDelivery(Delivery *delivery) {
+    if (--delivery->pending == 0) {
+      delivery->message->Release();
+      delivery->message = nullptr;
+      free_deliveries_.push_back(delivery);
+    }
+  }
+
+  std::vector<ShardConnection<Session> *> subscribers_{};
+  std::vector<std::unique_ptr<Delivery>> deliveries_{};
+  std::vector<Delivery *> free_deliveries_{};
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Free list of fixed-size buffers owned by a single thread. Buffers are
+// never returned to the allocator while the pool is alive, so a warmed-up
+// shard does not allocate on the request path.
+template <size_t BufferSize>
+class BufferPool {
+ public:
+  struct Buffer {
+    size_t free_space() const { return data.size() - end; }
+    size_t size() const { return end - begin; }
+    void clear() { begin = end = 0; }
+
+    std::array<unsigned char, BufferSize> data;
+    size_t begin{}, end{};
+  };
+
+  BufferPool() = default;
+  BufferPool(const size_t number_of_preallocated) {
+    for (size_t i{}; i < number_of_preallocated; ++i) {
+      Release(Allocate());
+    }
+  }
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  Buffer *Acquire() {
+    if (free_.empty()) {
+      return Allocate();
+    }
+    Buffer *buffer{free_.back()};
+    free_.pop_back();
+    buffer->clear();
+    return buffer;
+  }
+
+  void Release(Buffer *buffer) {
+    if (buffer) {
+      free_.push_back(buffer);
+    }
+  }
+
+  size_t allocated() const { return storage_.size(); }
+  size_t available() const { return free_.size(); }
+
+ private:
+  Buffer *Allocate() {
+    storage_.emplace_back(new Buffer{});
+    return storage_.back().get();
+  }
+
+  std::vector<std::unique_ptr<Buffer>> storage_{};
+  std::vector<Buffer *> free_{};
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// Endpoints tell Server which address family to listen on. Each one knows
+// its address type and how to open, bind and listen on a socket for it.
+// Listeners are non-blocking because after a hot upgrade handoff two
+// processes may poll the same socket and only one of them wins accept().
+
+// Waits until |listener| has a connection or |wakeup| becomes readable.
+// Returns the accepted socket, or -1 when woken up or the listener failed.
+inline int AcceptOrWake(const int listener, const int wakeup,
+                        struct sockaddr *address, socklen_t *address_size) {
+  struct pollfd descriptors[2]{{listener, POLLIN, 0}, {wakeup, POLLIN, 0}};
+  while (true) {
+    int ready{poll(descriptors, 2, -1)};
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (descriptors[1].revents != 0) {
+      return -1;
+    }
+    int sock{accept4(listener, address, address_size, SOCK_CLOEXEC)};
+    if (sock >= 0) {
+      return sock;
+    }
+    if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR and
+        errno != ECONNABORTED) {
+      return -1;
+    }
+  }
+}
+
+inline bool MakeNonBlocking(const int sock) {
+  const int flags{fcntl(sock, F_GETFL, 0)};
+  return flags >= 0 and fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+struct TcpEndpoint {
+  using Address = struct sockaddr_in;
+
+  TcpEndpoint(const int port_number) : port{port_number} {}
+
+  int Open(const int queue_size) const {
+    int sock{socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    if (sock < 0) {
+      throw std::runtime_error{"socket() failed"};
+    }
+    int optval{1};
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) or
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval))) {
+      close(sock);
+      throw std::runtime_error{"setsockopt() failed"};
+    }
+    Address address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(sock, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address)) < 0) {
+      close(sock);
+      throw std::runtime_error{"bind() failed"};
+    }
+
+    if (listen(sock, queue_size) < 0 or not MakeNonBlocking(sock)) {
+      close(sock);
+      throw std::runtime_error{"listen() failed"};
+    }
+    return sock;
+  }
+
+  void Release() const {}
+
+  int port{};
+};
+
+// A path starting with '@' is bound in the abstract namespace, so no file
+// is created and nothing has to be unlinked afterwards.
+struct UnixEndpoint {
+  using Address = struct sockaddr_un;
+
+  UnixEndpoint(const std::string &socket_path,
+               const int socket_type = SOCK_STREAM)
+      : path{socket_path}, type{socket_type} {}
+
+  bool IsAbstract() const { return not path.empty() and path.front() == '@'; }
+
+  socklen_t MakeAddress(Address &address) const {
+    if (path.empty() or path.size() >= sizeof(address.sun_path)) {
+      throw std::runtime_error{"bad unix socket path"};
+    }
+    address = Address{};
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.data(), path.size());
+    if (IsAbstract()) {
+      address.sun_path[0] = '\0';
+    }
+    return static_cast<socklen_t>(offsetof(Address, sun_path) + path.size() +
+                                  (IsAbstract() ? 0 : 1));
+  }
+
+  int Open(const int queue_size) const {
+    Address address{};
+    const socklen_t address_size{MakeAddress(address)};
+    int sock{socket(AF_UNIX, type | SOCK_CLOEXEC, 0)};
+    if (sock < 0) {
+      throw std::runtime_error{"socket() failed"};
+    }
+    if (not IsAbstract()) {
+      unlink(path.c_str());
+    }
+
+    if (bind(sock, reinterpret_cast<struct sockaddr *>(&address),
+             address_size) < 0) {
+      close(sock);
+      throw std::runtime_error{"bind() failed"};
+    }
+
+    if (listen(sock, queue_size) < 0 or not MakeNonBlocking(sock)) {
+      close(sock);
+      throw std::runtime_error{"listen() failed"};
+    }
+    return sock;
+  }
+
+  void Release() const {
+    if (not IsAbstract()) {
+      unlink(path.c_str());
+    }
+  }
+
+  std::string path{};
+  int type{SOCK_STREAM};
+};
+
+inline std::string DescribeAddress(const struct sockaddr_in &address) {
+  return "port = " + std::to_string(ntohs(address.sin_port));
+}
+
+inline std::string DescribeAddress(const struct sockaddr_un &address) {
+  (void)address;
+  return "unix";
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Listener handoff for hot upgrades. The running process spawns the new
+// binary with one end of a socketpair, passes its listening sockets over it
+// with SCM_RIGHTS and waits for the new process to acknowledge before it
+// stops accepting, so the kernel accept queues are never closed.
+
+constexpr size_t kMaxHandedOffSockets{16};
+constexpr char kHandoffAck{'!'};
+
+using NamedSockets = std::vector<std::pair<std::string, int>>;
+
+// Names travel as a comma separated payload in the same order as the fds.
+inline bool SendSockets(const int channel, const NamedSockets &sockets) {
+  if (sockets.empty() or sockets.size() > kMaxHandedOffSockets) {
+    return false;
+  }
+  std::string names{};
+  for (const auto &[name, sock] : sockets) {
+    names += name + ",";
+  }
+  struct iovec iov {
+    names.data(), names.size()
+  };
+  std::array<char, CMSG_SPACE(sizeof(int) * kMaxHandedOffSockets)> control{};
+  struct msghdr message {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data();
+  message.msg_controllen = CMSG_SPACE(sizeof(int) * sockets.size());
+  struct cmsghdr *cmsg{CMSG_FIRSTHDR(&message)};
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * sockets.size());
+  for (size_t i{}; i < sockets.size(); ++i) {
+    std::memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &sockets[i].second,
+                sizeof(int));
+  }
+  return sendmsg(channel, &message, MSG_NOSIGNAL) ==
+         static_cast<ssize_t>(names.size());
+}
+
+inline std::map<std::string, int> ReceiveSockets(const int channel) {
+  std::array<char, 1024> names{};
+  struct iovec iov {
+    names.data(), names.size()
+  };
+  std::array<char, CMSG_SPACE(sizeof(int) * kMaxHandedOffSockets)> control{};
+  struct msghdr message {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data();
+  message.msg_controllen = control.size();
+  ssize_t received{recvmsg(channel, &message, MSG_CMSG_CLOEXEC)};
+  std::map<std::string, int> sockets{};
+  struct cmsghdr *cmsg{CMSG_FIRSTHDR(&message)};
+  if (received <= 0 or cmsg == nullptr or cmsg->cmsg_level != SOL_SOCKET or
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    return sockets;
+  }
+  const size_t count{(cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)};
+  std::string payload{names.data(), static_cast<size_t>(received)};
+  for (size_t i{}; i < count; ++i) {
+    int sock{};
+    std::memcpy(&sock, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+    const size_t comma{payload.find(',')};
+    sockets[payload.substr(0, comma)] = sock;
+    payload.erase(0, comma == std::string::npos ? comma : comma + 1);
+  }
+  return sockets;
+}
+
+// Forks and execs |executable| with |arguments| plus --inherit-fd=N, where N
+// is the child's end of the handoff channel. Returns the parent's end or -1,
+// and the child's pid in |child|.
+inline int SpawnUpgrade(const std::string &executable,
+                        std::vector<std::string> arguments, pid_t &child) {
+  int channel[2]{-1, -1};
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) < 0) {
+    return -1;
+  }
+  arguments.push_back("--inherit-fd=" + std::to_string(channel[1]));
+  std::vector<char *> argv{};
+  argv.push_back(const_cast<char *>(executable.c_str()));
+  for (auto &argument : arguments) {
+    argv.push_back(argument.data());
+  }
+  argv.push_back(nullptr);
+
+  pid_t pid{fork()};
+  if (pid == 0) {
+    fcntl(channel[1], F_SETFD, 0);
+    execv(executable.c_str(), argv.data());
+    _exit(127);
+  }
+  close(channel[1]);
+  if (pid < 0) {
+    close(channel[0]);
+    return -1;
+  }
+  child = pid;
+  return channel[0];
+}
+
+// A child that never acknowledged still holds copies of every listener and
+// would compete for connections with this process and any later attempt.
+inline void AbandonUpgrade(const pid_t child) {
+  kill(child, SIGKILL);
+  waitpid(child, nullptr, 0);
+}
+
+inline bool WaitForAck(const int channel, const int timeout_ms) {
+  struct pollfd descriptor {
+    channel, POLLIN, 0
+  };
+  if (poll(&descriptor, 1, timeout_ms) != 1) {
+    return false;
+  }
+  char ack{};
+  return read(channel, &ack, 1) == 1 and ack == kHandoffAck;
+}
+
+inline void SendAck(const int channel) {
+  ssize_t written{write(channel, &kHandoffAck, 1)};
+  (void)written;
+}
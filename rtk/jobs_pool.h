@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <mutex>
@@ -8,6 +9,10 @@
 #include <thread>
 #include <vector>
 
+#include "lock_profiler.h"
+#include "metrics.h"
+#include "trace.h"
+
 template <class Job>
 class JobsPool {
  public:
@@ -21,24 +26,20 @@ class JobsPool {
     stop();
   }
 
-  void AddJob(const Job& new_job) {
-    if (not is_finishing_) {
-      {
-        std::scoped_lock lock{jobs_access_};
-        jobs_.push_front(new_job);
-      }
-      wake_up_signal_.notify_one();
-    }
-  }
+  bool AddJob(const Job& new_job) { return AddJob(Job{new_job}); }
 
-  void AddJob(Job&& new_job) {
+  bool AddJob(Job&& new_job) {
     if (not is_finishing_) {
+      TRACE_EVENT(kAddJob, TraceIdOf(new_job));
       {
         std::scoped_lock lock{jobs_access_};
-        jobs_.push_front(std::move(new_job));
+        jobs_.push_front(QueuedJob{std::move(new_job), Clock::now()});
       }
+      LocalMetrics().jobs_enqueued.Add();
       wake_up_signal_.notify_one();
+      return true;
     }
+    return false;
   }
 
   void start() {
@@ -77,7 +78,13 @@ class JobsPool {
   }
 
  private:
-  std::optional<Job> PickAJob() {
+  using Clock = std::chrono::steady_clock;
+  struct QueuedJob {
+    Job job;
+    Clock::time_point enqueued{};
+  };
+
+  std::optional<QueuedJob> PickAJob() {
     std::scoped_lock lock{jobs_access_};
     if (not jobs_.empty()) {
       auto job{std::move(jobs_.back())};
@@ -89,10 +96,21 @@ class JobsPool {
   }
 
   void WorkerMain(const int thread_number) {
+    static const size_t handler_index{Metrics().HandlerIndex(Job::kName)};
+    auto& metrics{LocalMetrics()};
     while (this->is_running_) {
       auto job{PickAJob()};
       if (job.has_value()) {
-        job.value().perform(thread_number);
+        const auto started{Clock::now()};
+        TRACE_EVENT(kPickAJob, TraceIdOf(job.value().job));
+        metrics.jobs_dequeued.Add();
+        metrics.job_queue_wait.Record(started - job.value().enqueued);
+        TRACE_LATENCY(started - job.value().enqueued);
+        job.value().job.perform(thread_number);
+        // perform() serves a whole connection, so this is its duration
+        // rather than the latency of any one request.
+        metrics.connection_duration[handler_index].Record(Clock::now() -
+                                                          started);
       } else if (not this->is_finishing_) {
         std::unique_lock lock{workers_mutex_};
         wake_up_signal_.wait(lock);
@@ -104,8 +122,9 @@ class JobsPool {
 
   std::vector<std::thread> workers_{};
   int number_of_workers_{};
-  std::deque<Job> jobs_{};
-  std::mutex workers_mutex_{}, jobs_access_{};
+  std::deque<QueuedJob> jobs_{};
+  std::mutex workers_mutex_{};
+  ProfiledLock<std::mutex> jobs_access_{"JobsPool::jobs_access_"};
   std::condition_variable wake_up_signal_{};
 
   bool is_running_{false}, is_finishing_{false};
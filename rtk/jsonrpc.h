@@ -0,0 +1,275 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#include "jzon.h"
+#pragma GCC diagnostic pop
+
+#include "endpoint.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "server.h"
+#include "trace.h"
+
+// JSON-RPC 2.0 over newline-delimited JSON. Every line is a request or a
+// batch; responses go back one line each, in the order the lines came in.
+
+constexpr size_t kJsonRpcReadSize{16 * 1024};
+constexpr size_t kJsonRpcMaxLineSize{1024 * 1024};
+
+constexpr int kJsonRpcParseError{-32700};
+constexpr int kJsonRpcInvalidRequest{-32600};
+constexpr int kJsonRpcMethodNotFound{-32601};
+constexpr int kJsonRpcInvalidParams{-32602};
+constexpr int kJsonRpcInternalError{-32603};
+
+// Methods throw std::invalid_argument for bad params; anything else thrown
+// is reported as an internal error.
+using JsonRpcMethod = std::function<jzon::Node(const jzon::Node &params)>;
+
+class JsonRpcRegistry {
+ public:
+  void Register(const std::string &name, JsonRpcMethod method) {
+    std::scoped_lock lock{access_};
+    methods_[name] = std::move(method);
+  }
+
+  // Registration is expected to finish before the server starts, so
+  // lookups do not lock.
+  const JsonRpcMethod *Find(const std::string &name) const {
+    const auto found{methods_.find(name)};
+    return found == methods_.end() ? nullptr : &found->second;
+  }
+
+ private:
+  std::mutex access_{};
+  std::map<std::string, JsonRpcMethod> methods_{};
+};
+
+inline JsonRpcRegistry &JsonRpcMethods() {
+  static JsonRpcRegistry registry{};
+  return registry;
+}
+
+// Appends to a caller-owned string whose capacity survives between
+// requests.
+class StringWriteBuffer : public std::streambuf {
+ public:
+  void Reset(std::string &target) { target_ = &target; }
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (not traits_type::eq_int_type(c, traits_type::eof())) {
+      target_->push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char *data, std::streamsize size) override {
+    target_->append(data, static_cast<size_t>(size));
+    return size;
+  }
+
+ private:
+  std::string *target_{};
+};
+
+template <class Address = struct sockaddr_in>
+struct JsonRpcHandler {
+  static constexpr const char *kName{"jsonrpc"};
+
+  int sock{};
+  Address client_address{};
+
+  JsonRpcHandler(const int sock_, const Address &client_addr)
+      : sock{sock_}, client_address{client_addr} {}
+
+  void perform(int thread_number) {
+    (void)thread_number;
+#ifdef DEBUG_
+    std::cerr << "JSONRPC [" << thread_number
+              << "]: " << DescribeAddress(client_address) << std::endl;
+#endif
+    auto &metrics{LocalMetrics()};
+    thread_local Codec codec{};
+    thread_local std::string input{}, output{};
+    input.clear();
+    bool first_recv_traced{false};
+    while (true) {
+      const size_t filled{input.size()};
+      input.resize(filled + kJsonRpcReadSize);
+      ssize_t received{recv(sock, input.data() + filled, kJsonRpcReadSize, 0)};
+      if (received <= 0) {
+        break;
+      }
+      input.resize(filled + static_cast<size_t>(received));
+      metrics.bytes_in.Add(static_cast<uint64_t>(received));
+      if (not first_recv_traced) {
+        TRACE_EVENT(kFirstRecv, sock);
+        first_recv_traced = true;
+      }
+
+      output.clear();
+      size_t consumed{};
+      bool is_limited{false};
+      for (size_t newline{input.find('\n', filled)};
+           newline != std::string::npos;
+           newline = input.find('\n', consumed)) {
+        if (not RateLimits().Allow(client_address)) {
+          metrics.requests_rate_limited.Add();
+          is_limited = true;
+          break;
+        }
+        codec.Answer(input.data() + consumed, input.data() + newline, output);
+        consumed = newline + 1;
+      }
+      input.erase(0, consumed);
+      if (not output.empty() and not SendAll(output)) {
+        break;
+      }
+      metrics.bytes_out.Add(output.size());
+      if (is_limited or input.size() > kJsonRpcMaxLineSize) {
+        break;
+      }
+    }
+    CloseClientSocket(sock);
+  }
+
+ private:
+  // Parser, writer and stream are reused for every line a worker handles.
+  // The parser reads the line straight out of the receive buffer.
+  class Codec {
+   public:
+    Codec() : out_{&write_buffer_} {}
+
+    void Answer(const char *begin, const char *end, std::string &output) {
+      if (std::all_of(begin, end, [](const char c) {
+            return c == ' ' or c == '\t' or c == '\r';
+          })) {
+        return;
+      }
+      const jzon::Node request{parser_.parseString(
+          std::string_view{begin, static_cast<size_t>(end - begin)})};
+      jzon::Node response{};
+      if (not request.isValid()) {
+        response = Error(jzon::null(), kJsonRpcParseError, "Parse error");
+      } else if (request.isArray()) {
+        if (request.getCount() == 0) {
+          response =
+              Error(jzon::null(), kJsonRpcInvalidRequest, "Invalid Request");
+        } else {
+          response = jzon::array();
+          for (const auto &entry : request) {
+            const jzon::Node answer{Call(entry.second)};
+            if (answer.isValid()) {
+              response.add(answer);
+            }
+          }
+          if (response.getCount() == 0) {
+            return;
+          }
+        }
+      } else {
+        response = Call(request);
+      }
+      if (response.isValid()) {
+        write_buffer_.Reset(output);
+        writer_.writeStream(response, out_);
+        output.push_back('\n');
+      }
+    }
+
+   private:
+    // Returns an invalid node for notifications, which get no response.
+    static jzon::Node Call(const jzon::Node &request) {
+      const jzon::Node id{request.get("id")};
+      const jzon::Node method{request.get("method")};
+      if (not request.isObject() or not method.isString() or
+          request.get("jsonrpc").toString() != "2.0") {
+        return Error(id.isValid() ? id : jzon::null(), kJsonRpcInvalidRequest,
+                     "Invalid Request");
+      }
+      const JsonRpcMethod *found{JsonRpcMethods().Find(method.toString())};
+      jzon::Node response{jzon::object()};
+      if (found == nullptr) {
+        response = Error(id, kJsonRpcMethodNotFound, "Method not found");
+      } else {
+        try {
+          response.add("jsonrpc", "2.0");
+          response.add("result", (*found)(request.get("params")));
+          response.add("id", id);
+        } catch (const std::invalid_argument &error) {
+          response = Error(id, kJsonRpcInvalidParams, error.what());
+        } catch (const std::exception &error) {
+          response = Error(id, kJsonRpcInternalError, error.what());
+        }
+      }
+      return id.isValid() ? response : jzon::invalid();
+    }
+
+    static jzon::Node Error(const jzon::Node &id, const int code,
+                            const std::string &message) {
+      jzon::Node error{jzon::object()};
+      error.add("code", code);
+      error.add("message", message);
+      jzon::Node response{jzon::object()};
+      response.add("jsonrpc", "2.0");
+      response.add("error", error);
+      response.add("id", id);
+      return response;
+    }
+
+    StringWriteBuffer write_buffer_{};
+    std::ostream out_;
+    jzon::Parser parser_{};
+    jzon::Writer writer_{};
+  };
+
+  bool SendAll(const std::string &output) {
+    size_t sent_total{};
+    while (sent_total < output.size()) {
+      ssize_t sent{send(sock, output.data() + sent_total,
+                        output.size() - sent_total, MSG_NOSIGNAL)};
+      if (sent <= 0) {
+        return false;
+      }
+      sent_total += static_cast<size_t>(sent);
+    }
+    return true;
+  }
+};
+
+// Methods served by 'echo_server jsonrpc'.
+inline void RegisterSampleJsonRpcMethods() {
+  JsonRpcMethods().Register(
+      "ping", [](const jzon::Node &) { return jzon::Node{"pong"}; });
+  JsonRpcMethods().Register("echo",
+                            [](const jzon::Node &params) { return params; });
+  JsonRpcMethods().Register("sum", [](const jzon::Node &params) {
+    if (not params.isArray()) {
+      throw std::invalid_argument{"params must be an array of numbers"};
+    }
+    double sum{};
+    for (const auto &entry : params) {
+      if (not entry.second.isNumber()) {
+        throw std::invalid_argument{"params must be an array of numbers"};
+      }
+      sum += entry.second.toDouble();
+    }
+    return jzon::Node{sum};
+  });
+}
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#include "jzon.h"
+#include "jzon_legacy.h"
+#pragma GCC diagnostic pop
+
+// Parses generated JSON documents with jzon::Parser and with the old
+// tokenizing parser it replaced, reports MB/s for both and checks that they
+// build the same tree. Also times the structural index stage on its own for
+// every kernel the CPU supports and checks they all agree with the scalar
+// one, full parses with and without that index, and how long Node::get
+// takes by name as objects get wider.
+
+struct Options {
+  size_t megabytes{8};
+  int repeats{3};
+};
+
+// An array of records with strings (some escaped), numbers and nesting,
+// roughly what a JSON-RPC batch or a saved VectorPicture looks like.
+std::string RecordsDocument(const size_t bytes) {
+  std::ostringstream out{};
+  out << "[";
+  for (size_t i{}; static_cast<size_t>(out.tellp()) < bytes; ++i) {
+    out << (i == 0 ? "" : ",") << "{\"id\":" << i << ",\"name\":\"user_" << i
+        << "\",\"email\":\"user" << i << "@example.com\",\"score\":"
+        << static_cast<double>(i) * 1.25 << ",\"ratio\":-" << i % 97
+        << ".5e-3,\"active\":" << (i % 2 ? "true" : "false")
+        << ",\"parent\":null,\"tags\":[\"alpha\",\"beta\",\"gamma\"],"
+           "\"note\":\"line one\\nline \\\"two\\\"\",\"point\":["
+        << i % 640 << "," << i % 480 << "]}";
+  }
+  out << "]";
+  return out.str();
+}
+
+// Mostly numbers, like the points and lines of a picture.
+std::string NumbersDocument(const size_t bytes) {
+  std::ostringstream out{};
+  out << "{\"points\":[";
+  for (size_t i{}; static_cast<size_t>(out.tellp()) < bytes; ++i) {
+    out << (i == 0 ? "" : ",") << "[" << i % 1920 << "," << i % 1080 << "]";
+  }
+  out << "]}";
+  return out.str();
+}
+
+template <class Parser, class Configure>
+double MegabytesPerSecond(const std::string &json, const int repeats,
+                          jzon::Node &result, Configure configure) {
+  double best_seconds{};
+  for (int i{}; i < repeats; ++i) {
+    Parser parser{};
+    configure(parser);
+    const auto start = std::chrono::steady_clock::now();
+    result = parser.parseString(json);
+    const std::chrono::duration<double> elapsed{
+        std::chrono::steady_clock::now() - start};
+    if (i == 0 or elapsed.count() < best_seconds) {
+      best_seconds = elapsed.count();
+    }
+  }
+  return static_cast<double>(json.size()) / 1e6 / best_seconds;
+}
+
+std::string Serialize(const jzon::Node &node) {
+  std::string json{};
+  jzon::Writer{}.writeString(node, json);
+  return json;
+}
+
+bool Compare(const std::string &name, const std::string &json,
+             const int repeats) {
+  jzon::Node legacy{}, current{};
+  const double legacy_speed{MegabytesPerSecond<jzon::legacy::Parser>(
+      json, repeats, legacy, [](jzon::legacy::Parser &) {})};
+  const double current_speed{MegabytesPerSecond<jzon::Parser>(
+      json, repeats, current, [](jzon::Parser &) {})};
+  const bool same{current.isValid() and
+                  Serialize(legacy) == Serialize(current)};
+  std::cout << std::left << std::setw(10) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(10)
+            << static_cast<double>(json.size()) / 1e6 << std::setw(12)
+            << legacy_speed << std::setw(12) << current_speed << std::setw(10)
+            << current_speed / legacy_speed << "x"
+            << (same ? "" : "  trees differ") << std::endl;
+  return same;
+}
+
+bool CompareKernels(const std::string &name, const std::string &json,
+                    const int repeats) {
+  std::vector<uint32_t> expected{};
+  bool same{jzon::buildStructuralIndex(json, expected, jzon::K_SCALAR)};
+  for (int kernel{jzon::K_SCALAR}; kernel <= jzon::bestIndexKernel();
+       ++kernel) {
+    std::vector<uint32_t> index{};
+    double best_seconds{};
+    for (int i{}; i < repeats; ++i) {
+      const auto start = std::chrono::steady_clock::now();
+      jzon::buildStructuralIndex(json, index,
+                                 static_cast<jzon::IndexKernel>(kernel));
+      const std::chrono::duration<double> elapsed{
+          std::chrono::steady_clock::now() - start};
+      if (i == 0 or elapsed.count() < best_seconds) {
+        best_seconds = elapsed.count();
+      }
+    }
+    const bool agrees{index == expected};
+    same = same and agrees;
+    std::cout << std::left << std::setw(10) << name << std::setw(10)
+              << jzon::indexKernelName(static_cast<jzon::IndexKernel>(kernel))
+              << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10)
+              << static_cast<double>(json.size()) / 1e9 / best_seconds
+              << std::setw(12) << index.size()
+              << (agrees ? "" : "  index differs") << std::endl;
+  }
+  return same;
+}
+
+// Full parses of the same document walking the bytes directly and with the
+// structural index built first.
+bool CompareIndexed(const std::string &name, const std::string &json,
+                    const int repeats) {
+  jzon::Node direct{}, indexed{};
+  const double direct_speed{MegabytesPerSecond<jzon::Parser>(
+      json, repeats, direct,
+      [](jzon::Parser &parser) { parser.setStructuralIndex(false); })};
+  const double indexed_speed{MegabytesPerSecond<jzon::Parser>(
+      json, repeats, indexed,
+      [](jzon::Parser &parser) { parser.setStructuralIndex(true); })};
+  const bool same{indexed.isValid() and
+                  Serialize(direct) == Serialize(indexed)};
+  std::cout << std::left << std::setw(10) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(14) << direct_speed
+            << std::setw(14) << indexed_speed << std::setprecision(2)
+            << std::setw(10) << indexed_speed / direct_speed << "x"
+            << (same ? "" : "  trees differ") << std::endl;
+  return same;
+}
+
+// Looks up every member of a parsed object with |width| members, like a
+// loader reading each field of a wide record.
+bool MeasureLookups(const size_t width, const int repeats) {
+  std::string json{"{"};
+  std::vector<std::string> names{};
+  for (size_t i{}; i < width; ++i) {
+    names.push_back("field_" + std::to_string(i * 7919 % 100003));
+    json += (i == 0 ? "\"" : ",\"") + names.back() + "\":" + std::to_string(i);
+  }
+  json += "}";
+  jzon::Parser parser{};
+  const jzon::Node object{parser.parseString(json)};
+  const size_t rounds{std::max<size_t>(1, 1000000 / width)};
+  double best_seconds{};
+  bool found{true};
+  for (int i{}; i < repeats; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t round{}; round < rounds; ++round) {
+      for (size_t field{}; field < width; ++field) {
+        found = found and object.get(names[field]).toInt(-1) ==
+                              static_cast<int>(field);
+      }
+    }
+    const std::chrono::duration<double> elapsed{
+        std::chrono::steady_clock::now() - start};
+    if (i == 0 or elapsed.count() < best_seconds) {
+      best_seconds = elapsed.count();
+    }
+  }
+  std::cout << std::setw(10) << width << std::fixed << std::setprecision(1)
+            << std::setw(14)
+            << best_seconds * 1e9 / static_cast<double>(rounds * width)
+            << (found ? "" : "  lookup failed") << std::endl;
+  return found;
+}
+
+int main(int argc, char *argv[]) {
+  Options options{};
+  for (int i{1}; i < argc; ++i) {
+    const std::string argument{argv[i]};
+    if (argument.rfind("--mb=", 0) == 0) {
+      options.megabytes = std::stoul(argument.substr(5));
+    } else if (argument.rfind("--repeats=", 0) == 0) {
+      options.repeats = std::max(1, std::stoi(argument.substr(10)));
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--mb=N] [--repeats=N]"
+                << std::endl;
+      return 1;
+    }
+  }
+  const size_t bytes{options.megabytes * 1000 * 1000};
+  const std::string records{RecordsDocument(bytes)};
+  const std::string numbers{NumbersDocument(bytes)};
+  std::cout << std::left << std::setw(10) << "document" << std::setw(10)
+            << "kernel" << std::right << std::setw(10) << "GB/s"
+            << std::setw(12) << "entries" << std::endl;
+  bool same{CompareKernels("records", records, options.repeats)};
+  same = CompareKernels("numbers", numbers, options.repeats) and same;
+  std::cout << std::endl;
+  std::cout << std::left << std::setw(10) << "document" << std::right
+            << std::setw(10) << "MB" << std::setw(12) << "old MB/s"
+            << std::setw(12) << "new MB/s" << std::setw(11) << "speedup"
+            << std::endl;
+  same = Compare("records", records, options.repeats) and same;
+  same = Compare("numbers", numbers, options.repeats) and same;
+  std::cout << std::endl;
+  std::cout << std::left << std::setw(10) << "document" << std::right
+            << std::setw(14) << "direct MB/s" << std::setw(14)
+            << "indexed MB/s" << std::setw(11) << "speedup" << std::endl;
+  same = CompareIndexed("records", records, options.repeats) and same;
+  same = CompareIndexed("numbers", numbers, options.repeats) and same;
+  std::cout << std::endl;
+  std::cout << std::setw(10) << "members" << std::setw(14) << "ns per get"
+            << std::endl;
+  for (const size_t width : {4, 8, 16, 64, 256, 1024, 4096}) {
+    same = MeasureLookups(width, options.repeats) and same;
+  }
+  return same ? 0 : 1;
+}
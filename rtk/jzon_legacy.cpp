@@ -0,0 +1,380 @@
+#include "jzon_legacy.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <stack>
+
+namespace jzon {
+  namespace legacy {
+    namespace {
+      inline bool isWhitespace(char c) {
+        return (c == '\n' || c == ' ' || c == '\t' || c == '\r' || c == '\f');
+      }
+    }  // namespace
+
+    Parser::Parser() {}
+    Parser::~Parser() {}
+
+    Node Parser::parseStream(std::istream &stream) {
+      TokenQueue tokens;
+      DataQueue data;
+
+      tokenize(stream, tokens, data);
+      Node node = assemble(tokens, data);
+
+      return node;
+    }
+    Node Parser::parseString(const std::string &json) {
+      std::istringstream stream(json);
+      return parseStream(stream);
+    }
+    Node Parser::parseFile(const std::string &filename) {
+      std::ifstream stream(filename.c_str(), std::ios::in);
+      return parseStream(stream);
+    }
+
+    const std::string &Parser::getError() const { return error; }
+
+    void Parser::tokenize(std::istream &stream, TokenQueue &tokens,
+      DataQueue &data) {
+      Token token = T_UNKNOWN;
+      std::string valueBuffer;
+      bool saveBuffer;
+
+      char c = '\0';
+      while (stream.peek() != std::char_traits<char>::eof()) {
+        stream.get(c);
+
+        if (isWhitespace(c)) continue;
+
+        saveBuffer = true;
+
+        switch (c) {
+        case '{': {
+          token = T_OBJ_BEGIN;
+          break;
+        }
+        case '}': {
+          token = T_OBJ_END;
+          break;
+        }
+        case '[': {
+          token = T_ARRAY_BEGIN;
+          break;
+        }
+        case ']': {
+          token = T_ARRAY_END;
+          break;
+        }
+        case ',': {
+          token = T_SEPARATOR_NODE;
+          break;
+        }
+        case ':': {
+          token = T_SEPARATOR_NAME;
+          break;
+        }
+        case '"': {
+          token = T_VALUE;
+          readString(stream, data);
+          break;
+        }
+        case '/': {
+          char p = static_cast<char>(stream.peek());
+          if (p == '*') {
+            jumpToCommentEnd(stream);
+            saveBuffer = false;
+            break;
+          }
+          else if (p == '/') {
+            jumpToNext('\n', stream);
+            saveBuffer = false;
+            break;
+          }
+          // Intentional fallthrough
+        }
+        default: {
+          valueBuffer += c;
+          saveBuffer = false;
+          break;
+        }
+        }
+
+        if ((saveBuffer || stream.peek() == std::char_traits<char>::eof()) &&
+          (!valueBuffer.empty()))  // Always save buffer on the last character
+        {
+          if (interpretValue(valueBuffer, data)) {
+            tokens.push(T_VALUE);
+          }
+          else {
+            // Store the unknown token, so we can show it to the user
+            data.push(std::make_pair(Node::T_STRING, valueBuffer));
+            tokens.push(T_UNKNOWN);
+          }
+
+          valueBuffer.clear();
+        }
+
+        // Push the token last so that any data
+        // will get pushed first from above.
+        // If saveBuffer is false, it means that
+        // we are in the middle of a value, so we
+        // don't want to push any tokens now.
+        if (saveBuffer) {
+          tokens.push(token);
+        }
+      }
+    }
+    Node Parser::assemble(TokenQueue &tokens, DataQueue &data) {
+      std::stack<NamedNode> nodeStack;
+      Node root(Node::T_INVALID);
+
+      std::string nextName = "";
+
+      Token token;
+      while (!tokens.empty()) {
+        token = tokens.front();
+        tokens.pop();
+
+        switch (token) {
+        case T_UNKNOWN: {
+          const std::string &unknownToken = data.front().second;
+          error = "Unknown token: " + unknownToken;
+          data.pop();
+          return Node(Node::T_INVALID);
+        }
+        case T_OBJ_BEGIN: {
+          nodeStack.push(std::make_pair(nextName, object()));
+          nextName.clear();
+          break;
+        }
+        case T_ARRAY_BEGIN: {
+          nodeStack.push(std::make_pair(nextName, array()));
+          nextName.clear();
+          break;
+        }
+        case T_OBJ_END:
+        case T_ARRAY_END: {
+          if (nodeStack.empty()) {
+            error = "Found end of object or array without beginning";
+            return Node(Node::T_INVALID);
+          }
+          if (token == T_OBJ_END && !nodeStack.top().second.isObject()) {
+            error = "Mismatched end and beginning of object";
+            return Node(Node::T_INVALID);
+          }
+          if (token == T_ARRAY_END && !nodeStack.top().second.isArray()) {
+            error = "Mismatched end and beginning of array";
+            return Node(Node::T_INVALID);
+          }
+
+          std::string nodeName = nodeStack.top().first;
+          Node node = nodeStack.top().second;
+          nodeStack.pop();
+
+          if (!nodeStack.empty()) {
+            Node &stackTop = nodeStack.top().second;
+            if (stackTop.isObject()) {
+              stackTop.add(nodeName, node);
+            }
+            else if (stackTop.isArray()) {
+              stackTop.add(node);
+            }
+            else {
+              error = "Can only add elements to objects and arrays";
+              return Node(Node::T_INVALID);
+            }
+          }
+          else {
+            root = node;
+          }
+          break;
+        }
+        case T_VALUE: {
+          if (data.empty()) {
+            error = "Missing data for value";
+            return Node(Node::T_INVALID);
+          }
+
+          const std::pair<Node::Type, std::string> &dataPair = data.front();
+          if (!tokens.empty() && tokens.front() == T_SEPARATOR_NAME) {
+            tokens.pop();
+            if (dataPair.first != Node::T_STRING) {
+              error = "A name has to be a string";
+              return Node(Node::T_INVALID);
+            }
+            else {
+              nextName = dataPair.second;
+              data.pop();
+            }
+          }
+          else {
+            Node node(dataPair.first, dataPair.second);
+            data.pop();
+
+            if (!nodeStack.empty()) {
+              Node &stackTop = nodeStack.top().second;
+              if (stackTop.isObject())
+                stackTop.add(nextName, node);
+              else if (stackTop.isArray())
+                stackTop.add(node);
+
+              nextName.clear();
+            }
+            else {
+              error = "Outermost node must be an object or array";
+              return Node(Node::T_INVALID);
+            }
+          }
+          break;
+        }
+        case T_SEPARATOR_NAME:
+          break;
+        case T_SEPARATOR_NODE: {
+          if (!tokens.empty() && tokens.front() == T_ARRAY_END) {
+            error = "Extra comma in array";
+            return Node(Node::T_INVALID);
+          }
+          break;
+        }
+        }
+      }
+
+      return root;
+    }
+
+    void Parser::jumpToNext(char c, std::istream &stream) {
+      while (!stream.eof() && static_cast<char>(stream.get()) != c)
+        ;
+      stream.unget();
+    }
+    void Parser::jumpToCommentEnd(std::istream &stream) {
+      stream.ignore(1);
+      char c1 = '\0', c2 = '\0';
+      while (stream.peek() != std::char_traits<char>::eof()) {
+        stream.get(c2);
+
+        if (c1 == '*' && c2 == '/') break;
+
+        c1 = c2;
+      }
+    }
+
+    void Parser::readString(std::istream &stream, DataQueue &data) {
+      std::string str;
+
+      bool backslash_occured = false;
+      char c1 = '\0', c2 = '\0';
+      while (stream.peek() != std::char_traits<char>::eof()) {
+        stream.get(c2);
+        if ((backslash_occured || c1 != '\\') && c2 == '"') {
+          break;
+        }
+
+        str += c2;
+
+        if (c1 == '\\' && c2 == '\\') {
+          if (backslash_occured) {
+            backslash_occured = false;
+          }
+          else {
+            backslash_occured = true;
+          }
+        }
+        else {
+          backslash_occured = false;
+        }
+        c1 = c2;
+      }
+
+      data.push(std::make_pair(Node::T_STRING, str));
+    }
+    bool Parser::interpretValue(const std::string &value, DataQueue &data) {
+      std::string upperValue(value.size(), '\0');
+
+      std::transform(value.begin(), value.end(), upperValue.begin(), toupper);
+
+      if (upperValue == "NULL") {
+        data.push(std::make_pair(Node::T_NULL, std::string()));
+      }
+      else if (upperValue == "TRUE") {
+        data.push(std::make_pair(Node::T_BOOL, std::string("true")));
+      }
+      else if (upperValue == "FALSE") {
+        data.push(std::make_pair(Node::T_BOOL, std::string("false")));
+      }
+      else {
+        bool number = true;
+        bool negative = false;
+        bool fraction = false;
+        bool scientific = false;
+        bool scientificSign = false;
+        bool scientificNumber = false;
+        for (std::string::const_iterator it = upperValue.begin();
+          number && it != upperValue.end(); ++it) {
+          char c = (*it);
+          switch (c) {
+          case '-': {
+            if (scientific) {
+              if (scientificSign)  // Only one - allowed after E
+                number = false;
+              else
+                scientificSign = true;
+            }
+            else {
+              if (negative)  // Only one - allowed before E
+                number = false;
+              else
+                negative = true;
+            }
+            break;
+          }
+          case '+': {
+            if (!scientific || scientificSign)
+              number = false;
+            else
+              scientificSign = true;
+            break;
+          }
+          case '.': {
+            if (fraction)  // Only one . allowed
+              number = false;
+            else
+              fraction = true;
+            break;
+          }
+          case 'E': {
+            if (scientific)
+              number = false;
+            else
+              scientific = true;
+            break;
+          }
+          default: {
+            if (c >= '0' && c <= '9') {
+              if (scientific) scientificNumber = true;
+            }
+            else {
+              number = false;
+            }
+            break;
+          }
+          }
+        }
+
+        if (scientific && !scientificNumber) number = false;
+
+        if (number) {
+          data.push(std::make_pair(Node::T_NUMBER, value));
+        }
+        else {
+          return false;
+        }
+      }
+
+      return true;
+    }
+  }  // namespace legacy
+}  // namespace jzon
@@ -0,0 +1,56 @@
+#ifndef Jzon_legacy_h_
+#define Jzon_legacy_h_
+
+#include <istream>
+#include <queue>
+#include <string>
+
+#include "jzon.h"
+
+namespace jzon {
+  namespace legacy {
+    // The tokenize-then-assemble parser jzon::Parser replaced. It lives
+    // next to jzon_bench.cpp, only so the two can be compared, and is not
+    // part of the jzon library. It reads the input a character at a time
+    // from a stream, queues every token and a copy of every value, then
+    // replays the queues to build the tree.
+    class Parser {
+    public:
+      Parser();
+      ~Parser();
+
+      Node parseStream(std::istream &stream);
+      Node parseString(const std::string &json);
+      Node parseFile(const std::string &filename);
+
+      const std::string &getError() const;
+
+    private:
+      enum Token {
+        T_UNKNOWN,
+        T_OBJ_BEGIN,
+        T_OBJ_END,
+        T_ARRAY_BEGIN,
+        T_ARRAY_END,
+        T_SEPARATOR_NODE,
+        T_SEPARATOR_NAME,
+        T_VALUE
+      };
+      typedef std::queue<Token> TokenQueue;
+      typedef std::queue<std::pair<Node::Type, std::string> > DataQueue;
+
+      void tokenize(std::istream &stream, TokenQueue &tokens, DataQueue &data);
+      Node assemble(TokenQueue &tokens, DataQueue &data);
+
+      void jumpToNext(char c, std::istream &stream);
+      void jumpToCommentEnd(std::istream &stream);
+
+      void readString(std::istream &stream, DataQueue &data);
+      bool interpretValue(const std::string &value, DataQueue &data);
+
+      std::string error;
+    };
+  }  // namespace legacy
+}  // namespace jzon
+
+#endif  // Jzon_legacy_h_
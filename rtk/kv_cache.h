@@ -0,0 +1,241 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "endpoint.h"
+#include "kv_store.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "server.h"
+#include "trace.h"
+
+// Binary cache protocol, all integers in network byte order.
+//
+// Request:  opcode (1) | key size (2) | value size (4) | key | value
+// Response: status (1) | value size (4) | value
+//
+// A multi-get carries the number of keys in the key size field and, as its
+// value, the keys each prefixed with a 2 byte size. It is answered with one
+// response per key, in request order, in a single write.
+
+constexpr uint8_t kKvGet{'G'};
+constexpr uint8_t kKvSet{'S'};
+constexpr uint8_t kKvDelete{'D'};
+constexpr uint8_t kKvMultiGet{'M'};
+
+constexpr uint8_t kKvOk{0};
+constexpr uint8_t kKvNotFound{1};
+constexpr uint8_t kKvError{2};
+
+constexpr size_t kKvRequestHeaderSize{7};
+constexpr size_t kKvResponseHeaderSize{5};
+constexpr size_t kKvMaxRequestSize{1024 * 1024};
+// Largest request Execute() accepts: the longest key plus the largest value.
+constexpr size_t kKvMaxFrameSize{kKvRequestHeaderSize + UINT16_MAX +
+                                 kKvMaxRequestSize};
+constexpr size_t kKvReadSize{16 * 1024};
+
+template <class Address = struct sockaddr_in>
+struct KvCacheHandler {
+  static constexpr const char *kName{"kv"};
+
+  int sock{};
+  Address client_address{};
+
+  KvCacheHandler(const int sock_, const Address &client_addr)
+      : sock{sock_}, client_address{client_addr} {}
+
+  // Pipelined requests that arrive together are answered with one send().
+  void perform(int thread_number) {
+    (void)thread_number;
+#ifdef DEBUG_
+    std::cerr << "KV [" << thread_number
+              << "]: " << DescribeAddress(client_address) << std::endl;
+#endif
+    auto &metrics{LocalMetrics()};
+    thread_local std::vector<unsigned char> input{}, output{};
+    input.clear();
+    bool first_recv_traced{false};
+    while (true) {
+      const size_t filled{input.size()};
+      input.resize(filled + kKvReadSize);
+      ssize_t received{recv(sock, input.data() + filled, kKvReadSize, 0)};
+      if (received <= 0) {
+        break;
+      }
+      input.resize(filled + static_cast<size_t>(received));
+      metrics.bytes_in.Add(static_cast<uint64_t>(received));
+      if (not first_recv_traced) {
+        TRACE_EVENT(kFirstRecv, sock);
+        first_recv_traced = true;
+      }
+
+      output.clear();
+      size_t consumed{};
+      bool is_valid{true}, is_limited{false};
+      while (is_valid) {
+        if (not RateLimits().Admits(client_address)) {
+          metrics.requests_rate_limited.Add();
+          is_limited = true;
+          break;
+        }
+        const size_t used{Execute(input.data() + consumed,
+                                  input.size() - consumed, output, is_valid)};
+        if (used == 0) {
+          break;
+        }
+        RateLimits().Allow(client_address);
+        consumed += used;
+      }
+      input.erase(input.begin(),
+                  input.begin() + static_cast<std::ptrdiff_t>(consumed));
+      if (not output.empty() and not SendAll(output)) {
+        break;
+      }
+      metrics.bytes_out.Add(output.size());
+      if (not is_valid or is_limited or input.size() > kKvMaxFrameSize) {
+        break;
+      }
+    }
+    CloseClientSocket(sock);
+  }
+
+ private:
+  // Returns the size of the request it answered, or 0 when |data| does not
+  // hold a complete request yet. Malformed input clears |is_valid|.
+  static size_t Execute(const unsigned char *data, const size_t size,
+                        std::vector<unsigned char> &output, bool &is_valid) {
+    if (size < kKvRequestHeaderSize) {
+      return 0;
+    }
+    const uint8_t opcode{data[0]};
+    uint16_t key_size{};
+    uint32_t value_size{};
+    std::memcpy(&key_size, data + 1, sizeof(key_size));
+    std::memcpy(&value_size, data + 3, sizeof(value_size));
+    key_size = ntohs(key_size);
+    value_size = ntohl(value_size);
+    if (value_size > kKvMaxRequestSize) {
+      is_valid = false;
+      return 0;
+    }
+    const std::string_view key{
+        reinterpret_cast<const char *>(data + kKvRequestHeaderSize),
+        opcode == kKvMultiGet ? size_t{0} : key_size};
+    const size_t total{kKvRequestHeaderSize + key.size() + value_size};
+    if (size < total) {
+      return 0;
+    }
+    const unsigned char *value{data + kKvRequestHeaderSize + key.size()};
+
+    switch (opcode) {
+      case kKvGet:
+        if (not Cache().Get(key, [&output](const unsigned char *found,
+                                           const size_t found_size) {
+              AppendResponse(output, kKvOk, found, found_size);
+            })) {
+          AppendResponse(output, kKvNotFound, nullptr, 0);
+        }
+        break;
+      case kKvSet:
+        AppendResponse(output,
+                       Cache().Set(key, value, value_size) ? kKvOk : kKvError,
+                       nullptr, 0);
+        break;
+      case kKvDelete:
+        AppendResponse(output, Cache().Delete(key) ? kKvOk : kKvNotFound,
+                       nullptr, 0);
+        break;
+      case kKvMultiGet:
+        if (not MultiGet(key_size, value, value_size, output)) {
+          is_valid = false;
+          return 0;
+        }
+        break;
+      default:
+        is_valid = false;
+        return 0;
+    }
+    return total;
+  }
+
+  // Values arrive in stripe order, so they are staged and then written in
+  // the order the keys were asked for.
+  static bool MultiGet(const size_t count, const unsigned char *keys,
+                       const size_t size, std::vector<unsigned char> &output) {
+    thread_local std::vector<std::string_view> batch{};
+    thread_local std::vector<std::pair<size_t, size_t>> found{};
+    thread_local std::vector<unsigned char> values{};
+    batch.clear();
+    for (size_t offset{}; batch.size() < count;) {
+      uint16_t key_size{};
+      if (offset + sizeof(key_size) > size) {
+        return false;
+      }
+      std::memcpy(&key_size, keys + offset, sizeof(key_size));
+      key_size = ntohs(key_size);
+      offset += sizeof(key_size);
+      if (offset + key_size > size) {
+        return false;
+      }
+      batch.emplace_back(reinterpret_cast<const char *>(keys + offset),
+                         key_size);
+      offset += key_size;
+    }
+    constexpr size_t kMissing{~size_t{0}};
+    found.assign(count, {kMissing, 0});
+    values.clear();
+    Cache().MultiGet(batch, [](const size_t index, const unsigned char *data,
+                               const size_t data_size) {
+      if (data != nullptr) {
+        found[index] = {values.size(), data_size};
+        values.insert(values.end(), data, data + data_size);
+      }
+    });
+    for (const auto &[offset, value_size] : found) {
+      if (offset == kMissing) {
+        AppendResponse(output, kKvNotFound, nullptr, 0);
+      } else {
+        AppendResponse(output, kKvOk, values.data() + offset, value_size);
+      }
+    }
+    return true;
+  }
+
+  static void AppendResponse(std::vector<unsigned char> &output,
+                             const uint8_t status, const unsigned char *value,
+                             const size_t value_size) {
+    const uint32_t size{htonl(static_cast<uint32_t>(value_size))};
+    const size_t at{output.size()};
+    output.resize(at + kKvResponseHeaderSize + value_size);
+    output[at] = status;
+    std::memcpy(output.data() + at + 1, &size, sizeof(size));
+    if (value_size > 0) {
+      std::memcpy(output.data() + at + kKvResponseHeaderSize, value,
+                  value_size);
+    }
+  }
+
+  bool SendAll(const std::vector<unsigned char> &output) {
+    size_t sent_total{};
+    while (sent_total < output.size()) {
+      ssize_t sent{send(sock, output.data() + sent_total,
+                        output.size() - sent_total, MSG_NOSIGNAL)};
+      if (sent <= 0) {
+        return false;
+      }
+      sent_total += static_cast<size_t>(sent);
+    }
+    return true;
+  }
+};
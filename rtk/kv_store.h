@@ -0,0 +1,400 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "cache_line.h"
+
+// Memory-capped key-value store for the cache mode. Keys are spread over
+// lock stripes; each stripe owns an open-addressing table and a slab
+// allocator, so one mutex covers both and stripes never share memory.
+
+constexpr size_t kKvStripes{64};
+constexpr size_t kKvPageSize{64 * 1024};
+constexpr size_t kKvMinChunkSize{64};
+constexpr size_t kKvInitialSlots{256};
+
+struct KvItem {
+  uint32_t key_size{};
+  uint32_t value_size{};
+  uint8_t slab_class{};
+  bool is_referenced{false};
+  bool is_used{false};
+
+  unsigned char *key() { return reinterpret_cast<unsigned char *>(this + 1); }
+  unsigned char *value() { return key() + key_size; }
+  std::string_view key_view() {
+    return {reinterpret_cast<const char *>(key()), key_size};
+  }
+};
+
+// Size classes grow by 1.25 up to a page. Pages are never returned to the
+// system. Once the cap is reached, a class with far fewer pages than the
+// biggest one takes a page from it, evicting what was stored there, so
+// value sizes that show up late still get room; otherwise a class reuses
+// its own chunks in CLOCK order.
+class KvSlabs {
+ public:
+  KvSlabs(const size_t memory_limit)
+      : memory_limit_{std::max(memory_limit, kKvPageSize)} {
+    for (size_t size{kKvMinChunkSize}; size < kKvPageSize;
+         size = (size * 5 / 4 + 7) & ~size_t{7}) {
+      classes_.push_back(SlabClass{size});
+    }
+    classes_.push_back(SlabClass{kKvPageSize});
+  }
+
+  // Returns nullptr when the item can never fit or the class owns nothing
+  // it could evict. |evict| must unlink the victim from the table.
+  template <class Evict>
+  KvItem *Allocate(const size_t key_size, const size_t value_size,
+                   Evict &&evict) {
+    const size_t bytes{sizeof(KvItem) + key_size + value_size};
+    const auto found{std::find_if(
+        classes_.begin(), classes_.end(),
+        [bytes](const SlabClass &c) { return c.chunk_size >= bytes; })};
+    if (found == classes_.end()) {
+      return nullptr;
+    }
+    auto &slab_class{*found};
+    KvItem *item{};
+    if (not slab_class.free.empty() or AddPage(slab_class) or
+        MovePage(slab_class, evict)) {
+      item = slab_class.free.back();
+      slab_class.free.pop_back();
+    } else {
+      item = ClockVictim(slab_class);
+      if (item == nullptr) {
+        return nullptr;
+      }
+      evict(item);
+    }
+    *item = KvItem{static_cast<uint32_t>(key_size),
+                   static_cast<uint32_t>(value_size),
+                   static_cast<uint8_t>(found - classes_.begin()), false,
+                   true};
+    return item;
+  }
+
+  void Free(KvItem *item) {
+    item->is_used = false;
+    classes_[item->slab_class].free.push_back(item);
+  }
+
+  size_t used_memory() const { return pages_.size() * kKvPageSize; }
+
+ private:
+  struct SlabClass {
+    size_t chunk_size{};
+    std::vector<unsigned char *> pages{};
+    std::vector<KvItem *> chunks{};
+    std::vector<KvItem *> free{};
+    size_t hand{};
+  };
+
+  bool AddPage(SlabClass &slab_class) {
+    if (used_memory() + kKvPageSize > memory_limit_) {
+      return false;
+    }
+    pages_.emplace_back(new unsigned char[kKvPageSize]);
+    CarvePage(slab_class, pages_.back().get());
+    return true;
+  }
+
+  void CarvePage(SlabClass &slab_class, unsigned char *page) {
+    slab_class.pages.push_back(page);
+    for (size_t offset{}; offset + slab_class.chunk_size <= kKvPageSize;
+         offset += slab_class.chunk_size) {
+      auto *item{new (page + offset) KvItem{}};
+      slab_class.chunks.push_back(item);
+      slab_class.free.push_back(item);
+    }
+  }
+
+  // Moves the newest page of the class with the most pages to |slab_class|
+  // when that class has none at all, or at least two more than it has.
+  template <class Evict>
+  bool MovePage(SlabClass &slab_class, Evict &evict) {
+    SlabClass *donor{};
+    for (auto &candidate : classes_) {
+      if (&candidate != &slab_class and
+          (donor == nullptr or candidate.pages.size() > donor->pages.size())) {
+        donor = &candidate;
+      }
+    }
+    const size_t needed{slab_class.pages.empty() ? size_t{1}
+                                                 : slab_class.pages.size() + 2};
+    if (donor == nullptr or donor->pages.size() < needed) {
+      return false;
+    }
+    unsigned char *page{donor->pages.back()};
+    donor->pages.pop_back();
+    const auto on_page = [page](const KvItem *item) {
+      const auto *bytes{reinterpret_cast<const unsigned char *>(item)};
+      return bytes >= page and bytes < page + kKvPageSize;
+    };
+    for (KvItem *item : donor->chunks) {
+      if (on_page(item) and item->is_used) {
+        evict(item);
+      }
+    }
+    donor->chunks.erase(
+        std::remove_if(donor->chunks.begin(), donor->chunks.end(), on_page),
+        donor->chunks.end());
+    donor->free.erase(
+        std::remove_if(donor->free.begin(), donor->free.end(), on_page),
+        donor->free.end());
+    donor->hand = 0;
+    CarvePage(slab_class, page);
+    return true;
+  }
+
+  // Second chance: a referenced item loses its bit and survives one sweep.
+  KvItem *ClockVictim(SlabClass &slab_class) {
+    const size_t count{slab_class.chunks.size()};
+    for (size_t step{}; step < 2 * count; ++step) {
+      KvItem *item{slab_class.chunks[slab_class.hand]};
+      slab_class.hand = (slab_class.hand + 1) % count;
+      if (not item->is_used) {
+        continue;
+      }
+      if (item->is_referenced) {
+        item->is_referenced = false;
+      } else {
+        return item;
+      }
+    }
+    return nullptr;
+  }
+
+  size_t memory_limit_{};
+  std::vector<SlabClass> classes_{};
+  std::vector<std::unique_ptr<unsigned char[]>> pages_{};
+};
+
+// Linear probing over a power-of-two table with tombstones. Only touched
+// with the owning stripe's mutex held.
+class alignas(kCacheLineSize) KvStripe {
+ public:
+  KvStripe(const size_t memory_limit)
+      : slabs_{memory_limit}, slots_(kKvInitialSlots) {}
+
+  static uint64_t Hash(const std::string_view key) {
+    uint64_t hash{14695981039346656037ull};
+    for (const char c : key) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  template <class Visitor>
+  bool Get(const uint64_t hash, const std::string_view key,
+           Visitor &&visitor) {
+    const size_t index{Find(hash, key)};
+    if (index == kNotFound) {
+      return false;
+    }
+    KvItem *item{slots_[index].item};
+    item->is_referenced = true;
+    visitor(item->value(), item->value_size);
+    return true;
+  }
+
+  // The old value is dropped only once the new one has a chunk, so a SET
+  // that cannot be stored leaves the key as it was.
+  bool Set(const uint64_t hash, const std::string_view key,
+           const unsigned char *value, const size_t value_size) {
+    KvItem *item{slabs_.Allocate(
+        key.size(), value_size,
+        [this](KvItem *victim) { Unlink(victim); })};
+    if (item == nullptr) {
+      return false;
+    }
+    Delete(hash, key);
+    std::memcpy(item->key(), key.data(), key.size());
+    std::memcpy(item->value(), value, value_size);
+    if ((used_ + tombstones_ + 1) * 4 > slots_.size() * 3) {
+      Rehash(used_ * 2 > slots_.size() / 2 ? slots_.size() * 2
+                                           : slots_.size());
+    }
+    Insert(hash, item);
+    return true;
+  }
+
+  bool Delete(const uint64_t hash, const std::string_view key) {
+    const size_t index{Find(hash, key)};
+    if (index == kNotFound) {
+      return false;
+    }
+    slabs_.Free(slots_[index].item);
+    Remove(index);
+    return true;
+  }
+
+  std::mutex &mutex() { return access_; }
+
+ private:
+  static constexpr size_t kNotFound{~size_t{0}};
+
+  struct Slot {
+    uint64_t hash{};
+    KvItem *item{};
+    bool is_tombstone{false};
+  };
+
+  size_t Find(const uint64_t hash, const std::string_view key) const {
+    const size_t mask{slots_.size() - 1};
+    for (size_t i{hash & mask};; i = (i + 1) & mask) {
+      const Slot &slot{slots_[i]};
+      if (slot.item == nullptr and not slot.is_tombstone) {
+        return kNotFound;
+      }
+      if (slot.item != nullptr and slot.hash == hash and
+          slot.item->key_view() == key) {
+        return i;
+      }
+    }
+  }
+
+  void Insert(const uint64_t hash, KvItem *item) {
+    const size_t mask{slots_.size() - 1};
+    size_t i{hash & mask};
+    while (slots_[i].item != nullptr) {
+      i = (i + 1) & mask;
+    }
+    if (slots_[i].is_tombstone) {
+      --tombstones_;
+    }
+    slots_[i] = Slot{hash, item, false};
+    ++used_;
+  }
+
+  void Remove(const size_t index) {
+    slots_[index] = Slot{0, nullptr, true};
+    --used_;
+    ++tombstones_;
+  }
+
+  // Called by the slab allocator for a CLOCK victim, which is reused by the
+  // caller, and for every item on a page moved to another class.
+  void Unlink(KvItem *victim) {
+    const uint64_t hash{Hash(victim->key_view())};
+    const size_t mask{slots_.size() - 1};
+    for (size_t i{hash & mask};; i = (i + 1) & mask) {
+      if (slots_[i].item == victim) {
+        Remove(i);
+        return;
+      }
+    }
+  }
+
+  void Rehash(const size_t capacity) {
+    std::vector<Slot> old(capacity);
+    old.swap(slots_);
+    used_ = tombstones_ = 0;
+    for (const auto &slot : old) {
+      if (slot.item != nullptr) {
+        Insert(slot.hash, slot.item);
+      }
+    }
+  }
+
+  std::mutex access_{};
+  KvSlabs slabs_;
+  std::vector<Slot> slots_{};
+  size_t used_{}, tombstones_{};
+};
+
+class KvStore {
+ public:
+  KvStore(const size_t memory_limit = 64 * 1024 * 1024) {
+    Configure(memory_limit);
+  }
+
+  // Drops everything; only safe before the server starts.
+  void Configure(const size_t memory_limit) {
+    stripes_.clear();
+    for (size_t i{}; i < kKvStripes; ++i) {
+      stripes_.emplace_back(new KvStripe{memory_limit / kKvStripes});
+    }
+  }
+
+  template <class Visitor>
+  bool Get(const std::string_view key, Visitor &&visitor) {
+    const uint64_t hash{KvStripe::Hash(key)};
+    auto &stripe{StripeOf(hash)};
+    std::scoped_lock lock{stripe.mutex()};
+    return stripe.Get(hash, key, visitor);
+  }
+
+  bool Set(const std::string_view key, const unsigned char *value,
+           const size_t value_size) {
+    const uint64_t hash{KvStripe::Hash(key)};
+    auto &stripe{StripeOf(hash)};
+    std::scoped_lock lock{stripe.mutex()};
+    return stripe.Set(hash, key, value, value_size);
+  }
+
+  bool Delete(const std::string_view key) {
+    const uint64_t hash{KvStripe::Hash(key)};
+    auto &stripe{StripeOf(hash)};
+    std::scoped_lock lock{stripe.mutex()};
+    return stripe.Delete(hash, key);
+  }
+
+  // Looks the keys up stripe by stripe, taking each mutex once per batch.
+  // |visitor| gets the key's position and the value, or nullptr on a miss.
+  template <class Visitor>
+  void MultiGet(const std::vector<std::string_view> &keys,
+                Visitor &&visitor) {
+    std::vector<std::pair<uint64_t, size_t>> order(keys.size());
+    for (size_t i{}; i < keys.size(); ++i) {
+      order[i] = {KvStripe::Hash(keys[i]), i};
+    }
+    std::sort(order.begin(), order.end(), [](const auto &a, const auto &b) {
+      return StripeIndex(a.first) < StripeIndex(b.first);
+    });
+    for (size_t begin{}; begin < order.size();) {
+      auto &stripe{StripeOf(order[begin].first)};
+      std::scoped_lock lock{stripe.mutex()};
+      size_t end{begin};
+      for (; end < order.size() and &StripeOf(order[end].first) == &stripe;
+           ++end) {
+        const auto [hash, index] = order[end];
+        if (not stripe.Get(hash, keys[index],
+                           [&visitor, index = index](const unsigned char *data,
+                                                     const size_t size) {
+                             visitor(index, data, size);
+                           })) {
+          visitor(index, nullptr, 0);
+        }
+      }
+      begin = end;
+    }
+  }
+
+ private:
+  static size_t StripeIndex(const uint64_t hash) {
+    return static_cast<size_t>(hash >> 58) % kKvStripes;
+  }
+
+  KvStripe &StripeOf(const uint64_t hash) {
+    return *stripes_[StripeIndex(hash)];
+  }
+
+  std::vector<std::unique_ptr<KvStripe>> stripes_{};
+};
+
+inline KvStore &Cache() {
+  static KvStore store{};
+  return store;
+}
@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "seqlock.h"
+#include "spinlock.h"
+
+// Contention benchmark for the locks in _general. Every thread takes the
+// lock, bumps a shared counter |critical| times, releases it and does
+// |outside| units of private work, for a fixed time per thread count.
+// Reports total throughput, how evenly the lock was shared out and the
+// longest any thread had to wait for it. The counter is checked afterwards,
+// and a lock that let two threads in at once fails the run.
+
+struct Options {
+  int seconds{1};
+  int max_threads{};
+  int critical{10};
+  int outside{50};
+};
+
+// What _general/spinlock.h used to be, kept as the baseline.
+class YieldSpinLock {
+ public:
+  void lock() {
+    while (flag_.test_and_set(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+  void unlock() { flag_.clear(std::memory_order_release); }
+
+ private:
+  std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+};
+
+struct Result {
+  double ops_per_second{};
+  double fairness{};
+  double max_wait_us{};
+  uint64_t operations{};
+  bool is_consistent{true};
+};
+
+// Thread 0 writes both halves with the same number, the other threads read
+// them, so a reader that sees two different halves caught a torn write.
+struct Pair {
+  uint64_t first{};
+  uint64_t second{};
+};
+
+class RwSpinLockedPair {
+ public:
+  void Write(const uint64_t number) {
+    std::lock_guard<RwSpinLock> guard{lock_};
+    pair_.first = number;
+    pair_.second = number;
+  }
+  Pair Read() {
+    std::shared_lock<RwSpinLock> guard{lock_};
+    return {pair_.first, pair_.second};
+  }
+
+ private:
+  RwSpinLock lock_{};
+  volatile Pair pair_{};
+};
+
+class SeqLockedPair {
+ public:
+  void Write(const uint64_t number) { pair_.Store(Pair{number, number}); }
+  Pair Read() { return pair_.Load(); }
+
+ private:
+  SeqLock<Pair> pair_{};
+};
+
+template <class Operation>
+Result Measure(const Options &options, const int threads,
+               Operation operation) {
+  std::atomic<bool> is_running{true};
+  std::atomic<int> ready{};
+  std::vector<uint64_t> operations(static_cast<size_t>(threads));
+  std::vector<std::chrono::steady_clock::duration> max_waits(
+      static_cast<size_t>(threads));
+  std::vector<std::thread> workers{};
+  for (int t{}; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      uint64_t done{};
+      std::chrono::steady_clock::duration max_wait{};
+      volatile uint64_t private_work{};
+      ready.fetch_add(1);
+      while (ready.load() < threads) {
+        std::this_thread::yield();
+      }
+      while (is_running.load(std::memory_order_relaxed)) {
+        const auto before = std::chrono::steady_clock::now();
+        operation(t);
+        max_wait =
+            std::max(max_wait, std::chrono::steady_clock::now() - before);
+        for (int i{}; i < options.outside; ++i) {
+          private_work = private_work + 1;
+        }
+        ++done;
+      }
+      operations[static_cast<size_t>(t)] = done;
+      max_waits[static_cast<size_t>(t)] = max_wait;
+    });
+  }
+  while (ready.load() < threads) {
+    std::this_thread::yield();
+  }
+  std::this_thread::sleep_for(std::chrono::seconds{options.seconds});
+  is_running = false;
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  uint64_t total{};
+  for (const auto count : operations) {
+    total += count;
+  }
+  const auto [least, most] =
+      std::minmax_element(operations.begin(), operations.end());
+  const auto longest = *std::max_element(max_waits.begin(), max_waits.end());
+  return {static_cast<double>(total) / options.seconds,
+          *most == 0 ? 0. : static_cast<double>(*least) / *most,
+          std::chrono::duration<double, std::micro>{longest}.count(), total};
+}
+
+template <class Lock>
+Result Run(const Options &options, const int threads) {
+  Lock lock{};
+  volatile uint64_t shared_counter{};
+  Result result{Measure(options, threads, [&](const int thread) {
+    (void)thread;
+    std::lock_guard<Lock> guard{lock};
+    for (int i{}; i < options.critical; ++i) {
+      shared_counter = shared_counter + 1;
+    }
+  })};
+  result.is_consistent =
+      shared_counter ==
+      result.operations * static_cast<uint64_t>(options.critical);
+  return result;
+}
+
+template <class GuardedPair>
+Result RunReadMostly(const Options &options, const int threads) {
+  GuardedPair pair{};
+  uint64_t written{};
+  std::atomic<uint64_t> torn{};
+  Result result{Measure(options, threads, [&](const int thread) {
+    if (thread == 0) {
+      pair.Write(++written);
+    } else {
+      const Pair seen{pair.Read()};
+      if (seen.first != seen.second) {
+        torn.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  })};
+  const Pair last{pair.Read()};
+  result.is_consistent =
+      torn.load() == 0 and last.first == written and last.second == written;
+  return result;
+}
+
+// Returns false when any run caught the lock letting threads overlap.
+bool Report(const Options &options, const std::string &name,
+            Result (*run)(const Options &, int)) {
+  bool passed{true};
+  for (int threads{1}; threads <= options.max_threads; threads *= 2) {
+    const Result result{run(options, threads)};
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::setw(8) << threads << std::fixed << std::setprecision(2)
+              << std::setw(12) << result.ops_per_second / 1e6
+              << std::setw(10) << result.fairness << std::setw(14)
+              << result.max_wait_us
+              << (result.is_consistent ? "" : "  NOT EXCLUSIVE") << std::endl;
+    passed = passed and result.is_consistent;
+  }
+  return passed;
+}
+
+int main(int argc, char *argv[]) {
+  Options options{};
+  options.max_threads = 64;
+  std::string only{};
+  for (int i{1}; i < argc; ++i) {
+    const std::string argument{argv[i]};
+    if (argument.rfind("--seconds=", 0) == 0) {
+      options.seconds = std::max(1, std::stoi(argument.substr(10)));
+    } else if (argument.rfind("--max-threads=", 0) == 0) {
+      options.max_threads = std::max(1, std::stoi(argument.substr(14)));
+    } else if (argument.rfind("--critical=", 0) == 0) {
+      options.critical = std::stoi(argument.substr(11));
+    } else if (argument.rfind("--outside=", 0) == 0) {
+      options.outside = std::stoi(argument.substr(10));
+    } else if (argument.rfind("--only=", 0) == 0) {
+      only = argument.substr(7);
+    } else {
+      std::cerr << "usage: " << argv[0]
+                << " [--seconds=N] [--max-threads=N] [--critical=N]"
+                   " [--outside=N] [--only=LOCK]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  std::cout << std::left << std::setw(12) << "lock" << std::right
+            << std::setw(8) << "threads" << std::setw(12) << "Mops/s"
+            << std::setw(10) << "fairness" << std::setw(14) << "max wait us"
+            << std::endl;
+  const auto wanted = [&only](const std::string &name) {
+    return only.empty() or only == name;
+  };
+  bool passed{true};
+  if (wanted("mutex")) {
+    passed = Report(options, "mutex", Run<std::mutex>) and passed;
+  }
+  if (wanted("yield")) {
+    passed = Report(options, "yield", Run<YieldSpinLock>) and passed;
+  }
+  if (wanted("ttas")) {
+    passed = Report(options, "ttas", Run<TtasSpinLock>) and passed;
+  }
+  if (wanted("adaptive")) {
+    passed = Report(options, "adaptive", Run<AdaptiveSpinLock>) and passed;
+  }
+  if (wanted("ticket")) {
+    passed = Report(options, "ticket", Run<TicketSpinLock>) and passed;
+  }
+  if (wanted("mcs")) {
+    passed = Report(options, "mcs", Run<McsLock>) and passed;
+  }
+  // Exclusive use first, then one writer against readers.
+  if (wanted("rw")) {
+    passed = Report(options, "rw", Run<RwSpinLock>) and passed;
+    passed = Report(options, "rw-read", RunReadMostly<RwSpinLockedPair>) and
+             passed;
+  }
+  if (wanted("seqlock")) {
+    passed = Report(options, "seqlock-read", RunReadMostly<SeqLockedPair>) and
+             passed;
+  }
+  return passed ? 0 : 1;
+}
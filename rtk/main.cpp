@@ -1,23 +1,128 @@
-
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
 
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "admin_server.h"
+#include "broadcast.h"
+#include "handoff.h"
+#include "jsonrpc.h"
+#include "kv_cache.h"
+#include "proxy.h"
 #include "server.h"
+#include "sharded_server.h"
+#include "trace.h"
+#include "udp_server.h"
+
+constexpr int kPort{7777};
+constexpr int kAdminPort{9100};
+constexpr int kBackendPort{7778};
+constexpr size_t kUpstreamSpares{16};
+constexpr int kQueueSize{1000};
+constexpr int kNumberOfHandlers{4};
+constexpr size_t kUdpBatchSize{64};
+constexpr int kUpgradeAckTimeoutMs{10000};
+const std::string kDefaultUnixPath{"@rtk_echo"};
+
+using UnixEchoServer =
+    Server<EchoHandler<1024, struct sockaddr_un>, UnixEndpoint>;
+
+std::unique_ptr<Server<EchoHandler<1024>>> g_EchoServer{};
+std::unique_ptr<UnixEchoServer> g_UnixEchoServer{};
+std::unique_ptr<UdpServer<UdpEchoHandler<kUdpBatchSize>>> g_UdpEchoServer{};
+std::unique_ptr<ShardedServer<EchoShardHandler>> g_ShardedEchoServer{};
+std::unique_ptr<ShardedServer<BroadcastShardHandler>> g_BroadcastServer{};
+std::unique_ptr<Server<ProxyHandler<>>> g_ProxyServer{};
+std::unique_ptr<Server<KvCacheHandler<>>> g_KvServer{};
+std::unique_ptr<Server<JsonRpcHandler<>>> g_JsonRpcServer{};
+std::unique_ptr<ShardedServer<EchoShardHandler>> g_BackendServer{};
+std::unique_ptr<AdminServer> g_AdminServer{};
 
-Server<EchoHandler<1024>> g_EchoServer{7777, 1000, 4};
+std::string g_Executable{};
+std::vector<std::string> g_Arguments{};
+std::atomic<bool> g_HandedOff{false};
+int g_UpgradePipe[2]{-1, -1};
+
+void StopPolitely() {
+  if (g_EchoServer) {
+    g_EchoServer->StopPolitely();
+  }
+  if (g_UnixEchoServer) {
+    g_UnixEchoServer->StopPolitely();
+  }
+  if (g_UdpEchoServer) {
+    g_UdpEchoServer->StopPolitely();
+  }
+  if (g_ShardedEchoServer) {
+    g_ShardedEchoServer->StopPolitely();
+  }
+  if (g_BroadcastServer) {
+    g_BroadcastServer->StopPolitely();
+  }
+  if (g_ProxyServer) {
+    g_ProxyServer->StopPolitely();
+  }
+  if (g_KvServer) {
+    g_KvServer->StopPolitely();
+  }
+  if (g_JsonRpcServer) {
+    g_JsonRpcServer->StopPolitely();
+  }
+  if (g_BackendServer) {
+    g_BackendServer->StopPolitely();
+  }
+}
+
+void StopImmediately() {
+  if (g_EchoServer) {
+    g_EchoServer->StopImmediately();
+  }
+  if (g_UnixEchoServer) {
+    g_UnixEchoServer->StopImmediately();
+  }
+  if (g_UdpEchoServer) {
+    g_UdpEchoServer->StopImmediately();
+  }
+  if (g_ShardedEchoServer) {
+    g_ShardedEchoServer->StopImmediately();
+  }
+  if (g_BroadcastServer) {
+    g_BroadcastServer->StopImmediately();
+  }
+  if (g_ProxyServer) {
+    g_ProxyServer->StopImmediately();
+  }
+  if (g_KvServer) {
+    g_KvServer->StopImmediately();
+  }
+  if (g_JsonRpcServer) {
+    g_JsonRpcServer->StopImmediately();
+  }
+  if (g_BackendServer) {
+    g_BackendServer->StopImmediately();
+  }
+}
 
 void terminate(int signal) {
   if (signal == SIGTERM) {
     static int polite_ask{};
     if (polite_ask < 3) {
       ++polite_ask;
-      g_EchoServer.StopPolitely();
+      StopPolitely();
 #ifdef DEBUG_
       std::cerr << "asked to stop politely" << std::endl;
 #endif
     } else {
-      g_EchoServer.StopImmediately();
+      StopImmediately();
 #ifdef DEBUG_
       std::cerr << "terminated server" << std::endl;
 #endif
@@ -26,11 +131,248 @@ void terminate(int signal) {
   }
 }
 
-int main() {
+void RequestUpgrade(int signal) {
+  (void)signal;
+  const char byte{'u'};
+  ssize_t written{write(g_UpgradePipe[1], &byte, 1)};
+  (void)written;
+}
+
+// Hands the listeners to a freshly exec'ed copy of the binary. Only after
+// the new process has adopted them does this one stop accepting; its
+// in-flight connections are still drained before it exits.
+void UpgradeWatcher() {
+  char byte{};
+  while (read(g_UpgradePipe[0], &byte, 1) == 1) {
+    NamedSockets sockets{};
+    if (g_EchoServer) {
+      sockets.emplace_back("tcp", g_EchoServer->listening_socket());
+    }
+    if (g_UnixEchoServer) {
+      sockets.emplace_back("unix", g_UnixEchoServer->listening_socket());
+    }
+    if (g_AdminServer) {
+      sockets.emplace_back("admin", g_AdminServer->listening_socket());
+    }
+    pid_t child{};
+    const int channel{SpawnUpgrade(g_Executable, g_Arguments, child)};
+    if (channel < 0) {
+      std::cerr << "upgrade: spawn failed" << std::endl;
+      continue;
+    }
+    const bool adopted{SendSockets(channel, sockets) and
+                       WaitForAck(channel, kUpgradeAckTimeoutMs)};
+    close(channel);
+    if (not adopted) {
+      AbandonUpgrade(child);
+      std::cerr << "upgrade: new process did not take over" << std::endl;
+      continue;
+    }
+    g_HandedOff = true;
+    if (g_EchoServer) {
+      g_EchoServer->StopAccepting();
+    }
+    if (g_UnixEchoServer) {
+      g_UnixEchoServer->StopAccepting();
+    }
+    return;
+  }
+}
+
+std::string ExecutablePath(const char *argv0) {
+  char path[PATH_MAX]{};
+  if (realpath(argv0, path) != nullptr) {
+    return path;
+  }
+  const ssize_t size{readlink("/proc/self/exe", path, sizeof(path) - 1)};
+  return size > 0 ? std::string{path, static_cast<size_t>(size)}
+                  : std::string{argv0};
+}
+
+int NumberOfCores() {
+  const unsigned int cores{std::thread::hardware_concurrency()};
+  return cores > 0 ? static_cast<int>(cores) : 1;
+}
+
+int main(int argc, char *argv[]) {
+  std::string mode{"tcp"};
+  std::string unix_path{};
+  std::string backend{};
+  size_t cache_memory_mb{64};
+  double rate_limit{}, rate_burst{};
+  int unix_type{SOCK_STREAM};
+  bool use_gro{false};
+  int admin_port{kAdminPort};
+  long trace_threshold_us{};
+  int inherit_fd{-1};
+  g_Executable = ExecutablePath(argv[0]);
+  for (int i{1}; i < argc; ++i) {
+    const std::string argument{argv[i]};
+    if (argument.rfind("--inherit-fd=", 0) == 0) {
+      inherit_fd = std::stoi(argument.substr(13));
+      continue;
+    }
+    g_Arguments.push_back(argument);
+    if (argument == "--gro") {
+      use_gro = true;
+    } else if (argument == "--unix") {
+      unix_path = kDefaultUnixPath;
+    } else if (argument.rfind("--unix=", 0) == 0) {
+      unix_path = argument.substr(7);
+    } else if (argument == "--seqpacket") {
+      unix_type = SOCK_SEQPACKET;
+    } else if (argument.rfind("--admin=", 0) == 0) {
+      admin_port = std::stoi(argument.substr(8));
+    } else if (argument == "--slow-consumer=disconnect") {
+      BroadcastSettings().policy = SlowConsumerPolicy::kDisconnect;
+    } else if (argument == "--slow-consumer=coalesce") {
+      BroadcastSettings().policy = SlowConsumerPolicy::kCoalesce;
+    } else if (argument == "--slow-consumer=drop") {
+      BroadcastSettings().policy = SlowConsumerPolicy::kDrop;
+    } else if (argument.rfind("--rate-limit=", 0) == 0) {
+      // --rate-limit=RATE[:BURST], requests per second per client address.
+      const std::string value{argument.substr(13)};
+      const size_t colon{value.find(':')};
+      rate_limit = std::stod(value.substr(0, colon));
+      rate_burst = colon == std::string::npos
+                       ? rate_limit
+                       : std::stod(value.substr(colon + 1));
+    } else if (argument.rfind("--memory-mb=", 0) == 0) {
+      cache_memory_mb = std::stoul(argument.substr(12));
+    } else if (argument.rfind("--backend=", 0) == 0) {
+      backend = argument.substr(10);
+    } else if (argument == "--no-admin") {
+      admin_port = 0;
+    } else if (argument.rfind("--trace-threshold-us=", 0) == 0) {
+      trace_threshold_us = std::stol(argument.substr(21));
+    } else {
+      mode = argument;
+    }
+  }
+
 #ifdef DEBUG_
-  std::cerr << "echo server start" << std::endl;
+  std::cerr << "echo server start, mode = " << mode << std::endl;
 #endif
   signal(SIGSEGV, terminate);
   signal(SIGTERM, terminate);
-  g_EchoServer.start();
+  // SIGUSR2 would terminate the process by default. Only tcp mode can hand
+  // its listeners over, and it installs RequestUpgrade once they exist.
+  signal(SIGUSR2, SIG_IGN);
+  if (mode != "tcp") {
+    std::cerr << "upgrade on SIGUSR2 is not supported in " << mode
+              << " mode, ignoring the signal" << std::endl;
+  }
+#ifdef RTK_TRACE
+  Tracing().StartDumper(std::chrono::microseconds{trace_threshold_us});
+  signal(SIGUSR1, TraceDumpOnSignal);
+#else
+  (void)trace_threshold_us;
+#endif
+  RateLimits().Configure(rate_limit, rate_burst);
+  std::map<std::string, int> inherited{};
+  if (inherit_fd >= 0) {
+    inherited = ReceiveSockets(inherit_fd);
+  }
+  auto inherited_socket = [&inherited](const std::string &name) {
+    const auto found{inherited.find(name)};
+    return found != inherited.end() ? found->second : -1;
+  };
+  if (admin_port > 0) {
+    g_AdminServer =
+        std::make_unique<AdminServer>(admin_port, inherited_socket("admin"));
+  }
+  if (mode == "tcp") {
+    std::thread unix_thread{};
+    if (not unix_path.empty()) {
+      g_UnixEchoServer = std::make_unique<UnixEchoServer>(
+          UnixEndpoint{unix_path, unix_type}, kQueueSize, kNumberOfHandlers,
+          inherited_socket("unix"));
+      unix_thread = std::thread{[] { g_UnixEchoServer->start(); }};
+    }
+    g_EchoServer = std::make_unique<Server<EchoHandler<1024>>>(
+        TcpEndpoint{kPort}, kQueueSize, kNumberOfHandlers,
+        inherited_socket("tcp"));
+    if (inherit_fd >= 0) {
+      SendAck(inherit_fd);
+      close(inherit_fd);
+    }
+    if (pipe2(g_UpgradePipe, O_CLOEXEC) == 0) {
+      signal(SIGUSR2, RequestUpgrade);
+      std::thread{UpgradeWatcher}.detach();
+    }
+    g_EchoServer->start();
+    if (unix_thread.joinable()) {
+      unix_thread.join();
+    }
+    if (g_HandedOff) {
+      if (g_AdminServer) {
+        g_AdminServer->ReleaseHandedOffSocket();
+      }
+      g_EchoServer->ReleaseHandedOffSocket();
+      if (g_UnixEchoServer) {
+        g_UnixEchoServer->ReleaseHandedOffSocket();
+      }
+      g_EchoServer.reset();
+      g_UnixEchoServer.reset();
+    }
+  } else if (mode == "broadcast") {
+    g_BroadcastServer =
+        std::make_unique<ShardedServer<BroadcastShardHandler>>(
+            kPort, kQueueSize, NumberOfCores(), std::chrono::hours{1});
+    g_BroadcastServer->start();
+  } else if (mode == "kv") {
+    Cache().Configure(cache_memory_mb * 1024 * 1024);
+    g_KvServer = std::make_unique<Server<KvCacheHandler<>>>(
+        kPort, kQueueSize, kNumberOfHandlers);
+    g_KvServer->start();
+  } else if (mode == "jsonrpc") {
+    RegisterSampleJsonRpcMethods();
+    g_JsonRpcServer = std::make_unique<Server<JsonRpcHandler<>>>(
+        kPort, kQueueSize, kNumberOfHandlers);
+    g_JsonRpcServer->start();
+  } else if (mode == "proxy") {
+    // Without --backend the proxy forwards to an in-process echo server, which
+    // is enough to measure what forwarding itself costs. It is the sharded
+    // one because idle pooled upstreams would pin the blocking workers.
+    std::thread backend_thread{};
+    if (backend.empty()) {
+      g_BackendServer = std::make_unique<ShardedServer<EchoShardHandler>>(
+          kBackendPort, kQueueSize, NumberOfCores());
+      backend_thread = std::thread{[] { g_BackendServer->start(); }};
+      backend = "127.0.0.1:" + std::to_string(kBackendPort);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    Upstreams().Configure(ParseBackend(backend), kUpstreamSpares);
+    Upstreams().Refill();
+    Upstreams().StartRefiller();
+    g_ProxyServer = std::make_unique<Server<ProxyHandler<>>>(
+        kPort, kQueueSize, kNumberOfHandlers);
+    g_ProxyServer->start();
+    if (g_BackendServer) {
+      g_BackendServer->StopPolitely();
+    }
+    if (backend_thread.joinable()) {
+      backend_thread.join();
+    }
+  } else if (mode == "udp") {
+    g_UdpEchoServer =
+        std::make_unique<UdpServer<UdpEchoHandler<kUdpBatchSize>>>(
+            kPort, NumberOfCores(), use_gro);
+    g_UdpEchoServer->start();
+  } else if (mode == "sharded") {
+    g_ShardedEchoServer = std::make_unique<ShardedServer<EchoShardHandler>>(
+        kPort, kQueueSize, NumberOfCores());
+    g_ShardedEchoServer->start();
+  } else {
+    std::cerr << "usage: " << argv[0]
+              << " [tcp [--unix[=PATH]] [--seqpacket] | udp [--gro] | sharded |"
+                 " proxy [--backend=HOST:PORT] |"
+                 " broadcast [--slow-consumer=drop|disconnect|coalesce] |"
+                 " kv [--memory-mb=N] | jsonrpc]"
+                 " [--admin=PORT | --no-admin] [--trace-threshold-us=N]"
+                 " [--rate-limit=RATE[:BURST]]"
+              << std::endl;
+    return 1;
+  }
+  g_AdminServer.reset();
 }
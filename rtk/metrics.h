@@ -0,0 +1,228 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cache_line.h"
+
+// Every thread increments its own cache-line aligned block of counters, so
+// the hot path pays a plain load and store without any lock prefix. A scrape
+// sums the blocks of all threads that have ever reported something.
+
+constexpr size_t kMaxMetricsHandlers{16};
+
+class MetricsCounter {
+ public:
+  void Add(const uint64_t value = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + value,
+                 std::memory_order_relaxed);
+  }
+  uint64_t Get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_{};
+};
+
+// Power-of-two buckets in microseconds: bucket i counts values <= 2^i us,
+// the last one is +Inf.
+class LatencyHistogram {
+ public:
+  static constexpr size_t kBuckets{24};
+
+  void Record(const std::chrono::nanoseconds latency) {
+    const uint64_t micros{static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(latency)
+            .count())};
+    size_t index{micros <= 1 ? 0
+                             : static_cast<size_t>(
+                                   64 - __builtin_clzll(micros - 1))};
+    if (index >= kBuckets) {
+      index = kBuckets - 1;
+    }
+    buckets_[index].Add();
+    sum_micros_.Add(micros);
+  }
+
+  void AddTo(std::array<uint64_t, kBuckets> &buckets,
+             uint64_t &sum_micros) const {
+    for (size_t i{}; i < kBuckets; ++i) {
+      buckets[i] += buckets_[i].Get();
+    }
+    sum_micros += sum_micros_.Get();
+  }
+
+ private:
+  std::array<MetricsCounter, kBuckets> buckets_{};
+  MetricsCounter sum_micros_{};
+};
+
+struct alignas(kCacheLineSize) ThreadMetrics {
+  MetricsCounter connections_accepted{}, connections_rejected{},
+      connections_closed{};
+  MetricsCounter bytes_in{}, bytes_out{};
+  MetricsCounter jobs_enqueued{}, jobs_dequeued{};
+  MetricsCounter requests_rate_limited{};
+  MetricsCounter messages_published{}, messages_dropped{},
+      slow_consumers_disconnected{};
+  LatencyHistogram job_queue_wait{};
+  // Time spent in the handler per request or event, for servers that call
+  // the handler that often (sharded, udp).
+  std::array<LatencyHistogram, kMaxMetricsHandlers> handler_latency{};
+  // Time a JobsPool worker spent in perform(), i.e. the whole connection.
+  std::array<LatencyHistogram, kMaxMetricsHandlers> connection_duration{};
+};
+
+class MetricsRegistry {
+ public:
+  ThreadMetrics *Register() {
+    std::scoped_lock lock{access_};
+    threads_.emplace_back(new ThreadMetrics{});
+    return threads_.back().get();
+  }
+
+  // Handlers are registered by name once; the returned index selects the
+  // per-thread histograms. Extra handlers share the last slot.
+  size_t HandlerIndex(const std::string &name) {
+    std::scoped_lock lock{access_};
+    for (size_t i{}; i < handler_names_.size(); ++i) {
+      if (handler_names_[i] == name) {
+        return i;
+      }
+    }
+    if (handler_names_.size() < kMaxMetricsHandlers) {
+      handler_names_.push_back(name);
+    }
+    return handler_names_.size() - 1;
+  }
+
+  std::string Render() {
+    std::scoped_lock lock{access_};
+    uint64_t accepted{}, rejected{}, closed{}, bytes_in{}, bytes_out{};
+    uint64_t enqueued{}, dequeued{};
+    uint64_t published{}, dropped{}, disconnected{}, rate_limited{};
+    Histogram queue_wait{};
+    std::vector<Histogram> handlers(handler_names_.size());
+    std::vector<Histogram> connections(handler_names_.size());
+    for (const auto &thread : threads_) {
+      accepted += thread->connections_accepted.Get();
+      rejected += thread->connections_rejected.Get();
+      closed += thread->connections_closed.Get();
+      bytes_in += thread->bytes_in.Get();
+      bytes_out += thread->bytes_out.Get();
+      enqueued += thread->jobs_enqueued.Get();
+      dequeued += thread->jobs_dequeued.Get();
+      rate_limited += thread->requests_rate_limited.Get();
+      published += thread->messages_published.Get();
+      dropped += thread->messages_dropped.Get();
+      disconnected += thread->slow_consumers_disconnected.Get();
+      thread->job_queue_wait.AddTo(queue_wait.buckets, queue_wait.sum_micros);
+      for (size_t i{}; i < handlers.size(); ++i) {
+        thread->handler_latency[i].AddTo(handlers[i].buckets,
+                                         handlers[i].sum_micros);
+        thread->connection_duration[i].AddTo(connections[i].buckets,
+                                             connections[i].sum_micros);
+      }
+    }
+
+    std::ostringstream out{};
+    WriteCounter(out, "rtk_connections_accepted_total", accepted);
+    WriteCounter(out, "rtk_connections_rejected_total", rejected);
+    WriteGauge(out, "rtk_connections_active",
+               accepted >= closed ? accepted - closed : 0);
+    WriteCounter(out, "rtk_bytes_received_total", bytes_in);
+    WriteCounter(out, "rtk_bytes_sent_total", bytes_out);
+    WriteCounter(out, "rtk_jobs_enqueued_total", enqueued);
+    WriteCounter(out, "rtk_jobs_dequeued_total", dequeued);
+    WriteGauge(out, "rtk_jobs_queued",
+               enqueued >= dequeued ? enqueued - dequeued : 0);
+    WriteCounter(out, "rtk_requests_rate_limited_total", rate_limited);
+    WriteCounter(out, "rtk_messages_published_total", published);
+    WriteCounter(out, "rtk_messages_dropped_total", dropped);
+    WriteCounter(out, "rtk_slow_consumers_disconnected_total", disconnected);
+    out << "# TYPE rtk_job_queue_wait_seconds histogram\n";
+    WriteHistogram(out, "rtk_job_queue_wait_seconds", "", queue_wait);
+    out << "# TYPE rtk_handler_latency_seconds histogram\n";
+    for (size_t i{}; i < handlers.size(); ++i) {
+      if (not handlers[i].IsEmpty()) {
+        WriteHistogram(out, "rtk_handler_latency_seconds",
+                       "handler=\"" + handler_names_[i] + "\"", handlers[i]);
+      }
+    }
+    out << "# TYPE rtk_connection_duration_seconds histogram\n";
+    for (size_t i{}; i < connections.size(); ++i) {
+      if (not connections[i].IsEmpty()) {
+        WriteHistogram(out, "rtk_connection_duration_seconds",
+                       "handler=\"" + handler_names_[i] + "\"",
+                       connections[i]);
+      }
+    }
+    return out.str();
+  }
+
+ private:
+  struct Histogram {
+    std::array<uint64_t, LatencyHistogram::kBuckets> buckets{};
+    uint64_t sum_micros{};
+
+    bool IsEmpty() const {
+      for (const uint64_t count : buckets) {
+        if (count > 0) {
+          return false;
+        }
+      }
+      return true;
+    }
+  };
+
+  static void WriteCounter(std::ostream &out, const char *name,
+                           const uint64_t value) {
+    out << "# TYPE " << name << " counter\n" << name << " " << value << "\n";
+  }
+
+  static void WriteGauge(std::ostream &out, const char *name,
+                         const uint64_t value) {
+    out << "# TYPE " << name << " gauge\n" << name << " " << value << "\n";
+  }
+
+  static void WriteHistogram(std::ostream &out, const std::string &name,
+                             const std::string &labels,
+                             const Histogram &histogram) {
+    const std::string separator{labels.empty() ? "" : ","};
+    uint64_t cumulative{};
+    for (size_t i{}; i < histogram.buckets.size(); ++i) {
+      cumulative += histogram.buckets[i];
+      out << name << "_bucket{" << labels << separator << "le=\"";
+      if (i + 1 == histogram.buckets.size()) {
+        out << "+Inf";
+      } else {
+        out << static_cast<double>(uint64_t{1} << i) / 1e6;
+      }
+      out << "\"} " << cumulative << "\n";
+    }
+    const std::string braces{labels.empty() ? "" : "{" + labels + "}"};
+    out << name << "_sum" << braces << " "
+        << static_cast<double>(histogram.sum_micros) / 1e6 << "\n";
+    out << name << "_count" << braces << " " << cumulative << "\n";
+  }
+
+  std::mutex access_{};
+  std::vector<std::unique_ptr<ThreadMetrics>> threads_{};
+  std::vector<std::string> handler_names_{};
+};
+
+inline MetricsRegistry &Metrics() {
+  static MetricsRegistry registry{};
+  return registry;
+}
+
+inline ThreadMetrics &LocalMetrics() {
+  thread_local ThreadMetrics *local{Metrics().Register()};
+  return *local;
+}
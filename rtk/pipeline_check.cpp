@@ -0,0 +1,212 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "mailbox.h"
+#include "pipeline.h"
+
+// Runs the _general pipeline and mailbox code on Linux, which nothing else
+// in the tree does: a source -> stage -> sink pipeline run to completion and
+// stopped in mid-stream with its feeder blocked, and PostOffice traffic
+// between pool threads, also stopped while letters are still coming. Checks
+// the item counts of every run and exits with 1 when one is off.
+
+constexpr uint64_t kItems{200000};
+constexpr uint64_t kLetters{20000};
+constexpr size_t kMailboxThreads{4};
+constexpr auto kDeadline{std::chrono::seconds{10}};
+
+bool Check(const std::string &what, const bool passed) {
+  std::cout << (passed ? "ok      " : "FAILED  ") << what << std::endl;
+  return passed;
+}
+
+// Every item is doubled by the stage and summed by the sink.
+bool RunToCompletion() {
+  mytp::Pipeline pipeline{};
+  auto &source{pipeline.AddSource<uint64_t>(256)};
+  auto &doubled{pipeline.AddStage<uint64_t, uint64_t>(
+      "double", source, 2,
+      [](uint64_t &value, mytp::Emitter<uint64_t> &emit) { emit(value * 2); },
+      256)};
+  std::atomic<uint64_t> count{}, sum{};
+  pipeline.AddSink<uint64_t>("sum", doubled, 2, [&](uint64_t &value) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+  });
+  pipeline.Start();
+  bool pushed_all{true};
+  for (uint64_t i{1}; i <= kItems; ++i) {
+    pushed_all = source.Push(i) and pushed_all;
+  }
+  source.Close();
+  pipeline.Wait();
+  pipeline.Report(std::cout);
+  return Check("pipeline: every pushed item reached the sink",
+               pushed_all and count == kItems) and
+         Check("pipeline: the sink saw every item doubled",
+               sum == kItems * (kItems + 1));
+}
+
+// The sink is slow enough that the source channel fills up and the feeder
+// sleeps in Push(). Stop() has to let it out, and nothing may arrive at the
+// sink that was not pushed.
+bool StopInMidStream() {
+  mytp::Pipeline pipeline{};
+  auto &source{pipeline.AddSource<uint64_t>(64)};
+  auto &passed{pipeline.AddStage<uint64_t, uint64_t>(
+      "pass", source, 1,
+      [](uint64_t &value, mytp::Emitter<uint64_t> &emit) { emit(value); },
+      64)};
+  std::atomic<uint64_t> count{};
+  pipeline.AddSink<uint64_t>("slow", passed, 1, [&count](uint64_t &value) {
+    (void)value;
+    std::this_thread::sleep_for(std::chrono::microseconds{100});
+    count.fetch_add(1, std::memory_order_relaxed);
+  });
+  pipeline.Start();
+  std::atomic<uint64_t> pushed{};
+  std::atomic<bool> feeder_done{false};
+  std::thread feeder{[&] {
+    for (uint64_t i{}; i < kItems and source.Push(i); ++i) {
+      pushed.fetch_add(1, std::memory_order_relaxed);
+    }
+    feeder_done = true;
+  }};
+  std::this_thread::sleep_for(std::chrono::milliseconds{50});
+  pipeline.Stop();
+  const auto deadline{std::chrono::steady_clock::now() + kDeadline};
+  while (not feeder_done and std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+  const bool released{feeder_done};
+  if (released) {
+    feeder.join();
+  } else {
+    feeder.detach();
+  }
+  pipeline.Wait();
+  const bool refused{not source.Push(uint64_t{0})};
+  return Check("pipeline stop: the blocked feeder was released", released) and
+         Check("pipeline stop: pushes are refused afterwards", refused) and
+         Check("pipeline stop: stopped before the feeder finished",
+               pushed < kItems) and
+         Check("pipeline stop: the sink saw no more than was pushed",
+               count <= pushed);
+}
+
+struct MailboxCounters {
+  std::atomic<uint64_t> received{};
+  std::atomic<uint64_t> relayed{};
+  // Bumped after |relayed|, so once it reaches the number posted the relay
+  // count is final.
+  std::atomic<uint64_t> from_outside{};
+};
+
+// Letters from outside arrive at thread 0, which broadcasts each to the
+// other pool threads over their SPSC lanes.
+class Relay : public mytp::MailboxThreadData<uint64_t> {
+ public:
+  Relay(mytp::ThreadCallback *pool_callback,
+        mytp::PostOffice<uint64_t> *post_office, MailboxCounters *counters)
+      : MailboxThreadData{pool_callback, post_office}, counters_{counters} {}
+
+ protected:
+  void OnMessage(uint64_t &message, const Envelope &envelope) override {
+    counters_->received.fetch_add(1, std::memory_order_relaxed);
+    if (envelope.from == mytp::PostOffice<uint64_t>::kOutside) {
+      counters_->relayed.fetch_add(Broadcast(message),
+                                   std::memory_order_relaxed);
+      counters_->from_outside.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+ private:
+  MailboxCounters *counters_{};
+};
+
+struct RelayPool {
+  RelayPool() {
+    for (size_t i{}; i < kMailboxThreads; ++i) {
+      pool.AddNewThread(&post_office, &counters);
+    }
+    pool.Start();
+  }
+
+  // Retries while thread 0's shared lane is full; false once |keep_going|
+  // turns false first.
+  bool Post(const uint64_t letter, const std::atomic<bool> &keep_going) {
+    while (not post_office.Post(0, letter)) {
+      if (not keep_going) {
+        return false;
+      }
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+  MailboxCounters counters{};
+  mytp::PostOffice<uint64_t> post_office{kMailboxThreads, 256};
+  mytp::ThreadPool<Relay> pool{};
+};
+
+bool DeliverAll() {
+  RelayPool relays{};
+  const std::atomic<bool> keep_going{true};
+  for (uint64_t i{}; i < kLetters; ++i) {
+    relays.Post(i, keep_going);
+  }
+  const auto deadline{std::chrono::steady_clock::now() + kDeadline};
+  auto &counters{relays.counters};
+  while ((counters.from_outside.load(std::memory_order_acquire) < kLetters or
+          counters.received < kLetters + counters.relayed) and
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+  relays.pool.Stop();
+  relays.pool.WaitForThreads();
+  relays.pool.JoinAllThreads();
+  uint64_t per_mailbox{};
+  for (size_t i{}; i < kMailboxThreads; ++i) {
+    per_mailbox += relays.post_office.Stats(i).received;
+  }
+  return Check("mailbox: every posted and relayed letter was received",
+               counters.received == kLetters + counters.relayed) and
+         Check("mailbox: relays reached some of the other threads",
+               counters.relayed > 0) and
+         Check("mailbox: the mailbox stats agree",
+               per_mailbox == counters.received);
+}
+
+bool StopMailboxesInMidStream() {
+  RelayPool relays{};
+  std::atomic<bool> keep_going{true};
+  std::atomic<uint64_t> posted{};
+  std::thread poster{[&] {
+    for (uint64_t i{}; keep_going and relays.Post(i, keep_going); ++i) {
+      posted.fetch_add(1, std::memory_order_relaxed);
+    }
+  }};
+  std::this_thread::sleep_for(std::chrono::milliseconds{50});
+  relays.pool.Stop();
+  relays.pool.WaitForThreads();
+  relays.pool.JoinAllThreads();
+  keep_going = false;
+  poster.join();
+  const auto &counters{relays.counters};
+  return Check("mailbox stop: every thread left its loop",
+               not relays.pool.ThreadsAreRunning()) and
+         Check("mailbox stop: nothing was received that was not sent",
+               counters.received <= posted + counters.relayed);
+}
+
+int main() {
+  bool passed{RunToCompletion()};
+  passed = StopInMidStream() and passed;
+  passed = DeliverAll() and passed;
+  passed = StopMailboxesInMidStream() and passed;
+  return passed ? 0 : 1;
+}
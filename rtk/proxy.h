@@ -0,0 +1,333 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "endpoint.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "server.h"
+#include "trace.h"
+
+constexpr size_t kSpliceChunk{64 * 1024};
+constexpr int kProxyIdleTimeoutMs{60000};
+
+inline struct sockaddr_in ParseBackend(const std::string &host_port) {
+  const size_t colon{host_port.rfind(':')};
+  struct sockaddr_in address {};
+  address.sin_family = AF_INET;
+  if (colon == std::string::npos or
+      inet_pton(AF_INET, host_port.substr(0, colon).c_str(),
+                &address.sin_addr) != 1) {
+    throw std::runtime_error{"bad backend address"};
+  }
+  address.sin_port = htons(static_cast<uint16_t>(
+      std::stoi(host_port.substr(colon + 1))));
+  return address;
+}
+
+// Connected, idle upstream sockets to the backend. Spares are opened ahead
+// of time so a new client does not wait for a connect() round trip. An
+// upstream comes back only if it never carried a byte in either direction,
+// e.g. the client went away or timed out before sending anything. Once
+// traffic has flowed, the backend may hold half a request or owe part of a
+// response, so the socket is closed.
+class UpstreamPool {
+ public:
+  void Configure(const struct sockaddr_in &backend,
+                 const size_t spare_connections) {
+    std::scoped_lock lock{access_};
+    backend_ = backend;
+    spare_connections_ = spare_connections;
+  }
+
+  // Returns a connected non-blocking socket or -1.
+  int Acquire() {
+    {
+      std::scoped_lock lock{access_};
+      while (not idle_.empty()) {
+        const int sock{idle_.back()};
+        idle_.pop_back();
+        if (IsAlive(sock)) {
+          return sock;
+        }
+        close(sock);
+      }
+    }
+    return Connect();
+  }
+
+  void Release(const int sock, const bool reusable) {
+    if (reusable) {
+      std::scoped_lock lock{access_};
+      if (idle_.size() < spare_connections_) {
+        idle_.push_back(sock);
+        return;
+      }
+    }
+    close(sock);
+  }
+
+  // Tops the idle list up to the configured number of spares. Blocks on
+  // connect(), so after startup it runs only on the refiller thread.
+  void Refill() {
+    while (true) {
+      {
+        std::scoped_lock lock{access_};
+        if (idle_.size() >= spare_connections_) {
+          return;
+        }
+      }
+      const int sock{Connect()};
+      if (sock < 0) {
+        return;
+      }
+      Release(sock, true);
+    }
+  }
+
+  // Starts the thread that refills the idle list whenever RequestRefill()
+  // finds it short, so a slow or dead backend never stalls a worker.
+  void StartRefiller() {
+    std::thread{[this] {
+      std::unique_lock lock{access_};
+      while (true) {
+        refill_requested_.wait(lock, [this] { return refill_pending_; });
+        refill_pending_ = false;
+        lock.unlock();
+        Refill();
+        lock.lock();
+      }
+    }}.detach();
+  }
+
+  void RequestRefill() {
+    {
+      std::scoped_lock lock{access_};
+      if (idle_.size() >= spare_connections_) {
+        return;
+      }
+      refill_pending_ = true;
+    }
+    refill_requested_.notify_one();
+  }
+
+ private:
+  int Connect() const {
+    int sock{socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    if (sock < 0) {
+      return -1;
+    }
+    int optval{1};
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+    if (connect(sock, reinterpret_cast<const struct sockaddr *>(&backend_),
+                sizeof(backend_)) < 0 or
+        not MakeNonBlocking(sock)) {
+      close(sock);
+      return -1;
+    }
+    return sock;
+  }
+
+  // An idle upstream must have nothing to read: data or EOF both mean the
+  // backend has moved on.
+  static bool IsAlive(const int sock) {
+    char byte{};
+    return recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 and
+           (errno == EAGAIN or errno == EWOULDBLOCK);
+  }
+
+  std::mutex access_{};
+  std::condition_variable refill_requested_{};
+  bool refill_pending_{false};
+  std::vector<int> idle_{};
+  struct sockaddr_in backend_ {};
+  size_t spare_connections_{};
+};
+
+inline UpstreamPool &Upstreams() {
+  static UpstreamPool pool{};
+  return pool;
+}
+
+// One direction of a proxied connection. Bytes move socket -> pipe -> socket
+// with splice(), so the payload never enters userspace.
+struct SpliceDirection {
+  int from{-1}, to{-1};
+  int pipe_read{-1}, pipe_write{-1};
+  size_t in_pipe{};
+  size_t received{};
+  bool eof{false}, shut{false}, failed{false};
+
+  bool WantsRead() const {
+    return not eof and not failed and in_pipe < kSpliceChunk;
+  }
+  bool WantsWrite() const { return in_pipe > 0 and not failed; }
+  bool Done() const { return shut or failed; }
+
+  // Returns the number of bytes delivered to |to|.
+  size_t Pump() {
+    if (WantsRead()) {
+      ssize_t moved{splice(from, nullptr, pipe_write, nullptr,
+                           kSpliceChunk - in_pipe,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK)};
+      if (moved > 0) {
+        in_pipe += static_cast<size_t>(moved);
+        received += static_cast<size_t>(moved);
+      } else if (moved == 0) {
+        eof = true;
+      } else if (errno != EAGAIN and errno != EINTR) {
+        failed = true;
+      }
+    }
+    size_t delivered{};
+    while (WantsWrite()) {
+      ssize_t moved{splice(pipe_read, nullptr, to, nullptr, in_pipe,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK)};
+      if (moved > 0) {
+        in_pipe -= static_cast<size_t>(moved);
+        delivered += static_cast<size_t>(moved);
+      } else {
+        if (moved == 0 or (errno != EAGAIN and errno != EINTR)) {
+          failed = true;
+        }
+        break;
+      }
+    }
+    if (eof and in_pipe == 0 and not shut and not failed) {
+      shutdown(to, SHUT_WR);
+      shut = true;
+    }
+    return delivered;
+  }
+};
+
+// Pipes are kept per worker thread and reused by the next connection when
+// they were left empty.
+struct SplicePipes {
+  std::array<int, 4> fds{-1, -1, -1, -1};
+
+  SplicePipes() { Open(); }
+  ~SplicePipes() { Close(); }
+
+  void Open() {
+    if (pipe2(fds.data(), O_NONBLOCK | O_CLOEXEC) < 0 or
+        pipe2(fds.data() + 2, O_NONBLOCK | O_CLOEXEC) < 0) {
+      Close();
+      throw std::runtime_error{"pipe2() failed"};
+    }
+  }
+
+  void Close() {
+    for (auto &fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+
+  void Reset() {
+    Close();
+    Open();
+  }
+};
+
+// L4 forwarder: every accepted client is paired with an upstream from
+// Upstreams() and bytes are spliced both ways until both sides have closed.
+// A FIN from either side is passed on as a half-close once its pipe drains.
+template <class Address = struct sockaddr_in>
+struct ProxyHandler {
+  static constexpr const char *kName{"proxy"};
+
+  int sock{};
+  Address client_address{};
+
+  ProxyHandler(const int sock_, const Address &client_addr)
+      : sock{sock_}, client_address{client_addr} {}
+
+  void perform(int thread_number) {
+    (void)thread_number;
+#ifdef DEBUG_
+    std::cerr << "PROXY [" << thread_number
+              << "]: " << DescribeAddress(client_address) << std::endl;
+#endif
+    const int upstream{Upstreams().Acquire()};
+    if (upstream < 0 or not MakeNonBlocking(sock)) {
+      if (upstream >= 0) {
+        Upstreams().Release(upstream, true);
+      }
+      CloseClientSocket(sock);
+      return;
+    }
+    thread_local SplicePipes pipes{};
+    SpliceDirection to_upstream{sock, upstream, pipes.fds[0], pipes.fds[1]};
+    SpliceDirection to_client{upstream, sock, pipes.fds[2], pipes.fds[3]};
+    Forward(to_upstream, to_client);
+
+    if (to_upstream.in_pipe > 0 or to_client.in_pipe > 0) {
+      pipes.Reset();
+    }
+    Upstreams().Release(upstream, to_upstream.received == 0 and
+                                      to_client.received == 0 and
+                                      not to_upstream.Done() and
+                                      not to_client.eof and
+                                      not to_client.failed);
+    CloseClientSocket(sock);
+    Upstreams().RequestRefill();
+  }
+
+ private:
+  void Forward(SpliceDirection &to_upstream, SpliceDirection &to_client) {
+    auto &metrics{LocalMetrics()};
+    bool first_recv_traced{false};
+    while (not(to_upstream.Done() and to_client.Done()) and
+           not to_upstream.failed and not to_client.failed) {
+      struct pollfd descriptors[2]{{sock, 0, 0}, {to_upstream.to, 0, 0}};
+      descriptors[0].events =
+          static_cast<short>((to_upstream.WantsRead() ? POLLIN : 0) |
+                             (to_client.WantsWrite() ? POLLOUT : 0));
+      descriptors[1].events =
+          static_cast<short>((to_client.WantsRead() ? POLLIN : 0) |
+                             (to_upstream.WantsWrite() ? POLLOUT : 0));
+      int ready{poll(descriptors, 2, kProxyIdleTimeoutMs)};
+      if (ready < 0 and errno == EINTR) {
+        continue;
+      } else if (ready <= 0) {
+        break;
+      }
+      // The proxy does not see requests, so every read from the client is
+      // charged as one.
+      const size_t received_before{to_upstream.received};
+      to_upstream.Pump();
+      const size_t received{to_upstream.received - received_before};
+      metrics.bytes_in.Add(received);
+      if (received > 0 and not RateLimits().Allow(client_address)) {
+        metrics.requests_rate_limited.Add();
+        break;
+      }
+      if (received > 0 and not first_recv_traced) {
+        TRACE_EVENT(kFirstRecv, sock);
+        first_recv_traced = true;
+      }
+      metrics.bytes_out.Add(to_client.Pump());
+    }
+  }
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "cache_line.h"
+
+// Per-source token buckets. Clients are spread over lock stripes by
+// address, buckets refill lazily when they are looked at, and a background
+// thread drops the ones that have been idle long enough to be full again.
+
+constexpr size_t kRateLimitStripes{64};
+constexpr uint64_t kNoRateLimitKey{~uint64_t{0}};
+
+inline uint64_t RateLimitKey(const struct sockaddr_in &address) {
+  return address.sin_addr.s_addr;
+}
+
+// Local peers on a unix socket share no meaningful source address.
+inline uint64_t RateLimitKey(const struct sockaddr_un &address) {
+  (void)address;
+  return kNoRateLimitKey;
+}
+
+class RateLimiter {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  ~RateLimiter() { StopExpiry(); }
+
+  // |rate| tokens per second up to |burst|; a zero rate disables limiting.
+  void Configure(const double rate, const double burst,
+                 const std::chrono::seconds expiry_period =
+                     std::chrono::seconds{10}) {
+    StopExpiry();
+    rate_ = rate;
+    burst_ = std::max(burst, 1.);
+    is_enabled_ = rate > 0.;
+    if (is_enabled_) {
+      is_expiring_ = true;
+      expiry_ = std::thread{&RateLimiter::ExpiryMain, this, expiry_period};
+    }
+  }
+
+  bool Allow(const uint64_t key, const double cost = 1.) {
+    if (not is_enabled_.load(std::memory_order_relaxed) or
+        key == kNoRateLimitKey) {
+      return true;
+    }
+    auto &stripe{*stripes_[Mix(key) % kRateLimitStripes]};
+    const auto now{Clock::now()};
+    std::scoped_lock lock{stripe.access};
+    auto [found, inserted] =
+        stripe.buckets.try_emplace(key, Bucket{burst_, now});
+    Bucket &bucket{found->second};
+    if (not inserted) {
+      const std::chrono::duration<double> elapsed{now - bucket.updated};
+      bucket.tokens = std::min(burst_, bucket.tokens + elapsed.count() * rate_);
+      bucket.updated = now;
+    }
+    // A zero-cost check still needs a whole token left.
+    if (bucket.tokens < std::max(cost, 1.)) {
+      return false;
+    }
+    bucket.tokens -= cost;
+    return true;
+  }
+
+  template <class Address>
+  bool Allow(const Address &address, const double cost = 1.) {
+    return Allow(RateLimitKey(address), cost);
+  }
+
+  // Whether |address| has a token left, without spending it. Used to turn
+  // away connections from exhausted clients, so that only requests are
+  // charged and a connect-per-request client does not pay twice.
+  template <class Address>
+  bool Admits(const Address &address) {
+    return Allow(RateLimitKey(address), 0.);
+  }
+
+  bool is_enabled() const { return is_enabled_; }
+
+ private:
+  struct Bucket {
+    double tokens{};
+    Clock::time_point updated{};
+  };
+
+  struct alignas(kCacheLineSize) Stripe {
+    std::mutex access{};
+    std::unordered_map<uint64_t, Bucket> buckets{};
+  };
+
+  // Neighbouring addresses differ in the low bits only.
+  static uint64_t Mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+  }
+
+  // A bucket that would have refilled completely is indistinguishable from
+  // a new one, so it can go.
+  void ExpiryMain(const std::chrono::seconds period) {
+    const std::chrono::duration<double> refill_time{burst_ / rate_};
+    std::unique_lock<std::mutex> wait_lock{expiry_access_};
+    while (is_expiring_) {
+      expiry_wakeup_.wait_for(wait_lock, period);
+      const auto now{Clock::now()};
+      for (auto &stripe : stripes_) {
+        std::scoped_lock lock{stripe->access};
+        for (auto it{stripe->buckets.begin()}; it != stripe->buckets.end();) {
+          if (now - it->second.updated >= refill_time) {
+            it = stripe->buckets.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+    }
+  }
+
+  void StopExpiry() {
+    {
+      std::scoped_lock lock{expiry_access_};
+      is_expiring_ = false;
+    }
+    expiry_wakeup_.notify_all();
+    if (expiry_.joinable()) {
+      expiry_.join();
+    }
+  }
+
+  using Stripes = std::array<std::unique_ptr<Stripe>, kRateLimitStripes>;
+
+  static Stripes MakeStripes() {
+    Stripes stripes{};
+    for (auto &stripe : stripes) {
+      stripe.reset(new Stripe{});
+    }
+    return stripes;
+  }
+
+  std::atomic<bool> is_enabled_{false};
+  double rate_{}, burst_{1.};
+  Stripes stripes_{MakeStripes()};
+  std::mutex expiry_access_{};
+  std::condition_variable expiry_wakeup_{};
+  bool is_expiring_{false};
+  std::thread expiry_{};
+};
+
+inline RateLimiter &RateLimits() {
+  static RateLimiter limiter{};
+  return limiter;
+}
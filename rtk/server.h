@@ -2,30 +2,48 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <iostream>
-#include <stdexcept>
+#include <memory>
 #include <thread>
 
+#include "endpoint.h"
 #include "jobs_pool.h"
-
-template <size_t BufferSize>
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "trace.h"
+
+inline void CloseClientSocket(const int sock) {
+  TRACE_EVENT(kClose, sock);
+  shutdown(sock, SHUT_RDWR);
+  close(sock);
+  LocalMetrics().connections_closed.Add();
+}
+
+template <size_t BufferSize, class Address = struct sockaddr_in>
 struct EchoHandler {
+  static constexpr const char *kName{"echo"};
+
   int sock{};
-  struct sockaddr_in client_address {};
+  Address client_address{};
   std::array<unsigned char, BufferSize> buffer{};
 
-  EchoHandler(const int sock_, const struct sockaddr_in &client_addr)
+  EchoHandler(const int sock_, const Address &client_addr)
       : sock{sock_}, client_address{client_addr} {}
 
   void perform(int thread_number) {
     (void)thread_number;
+    auto &metrics{LocalMetrics()};
+    bool first_recv_traced{false};
 #ifdef DEBUG_
     std::cerr << "INCOMING [" << thread_number
-              << "]: port = " << client_address.sin_port;
+              << "]: " << DescribeAddress(client_address);
 #endif
     while (true) {
       ssize_t received{recv(sock, buffer.data(), buffer.size(), MSG_DONTWAIT)};
@@ -38,6 +56,15 @@ struct EchoHandler {
       } else if (received == 0) {
         break;
       }
+      metrics.bytes_in.Add(static_cast<uint64_t>(received));
+      if (not RateLimits().Allow(client_address)) {
+        metrics.requests_rate_limited.Add();
+        break;
+      }
+      if (not first_recv_traced) {
+        TRACE_EVENT(kFirstRecv, sock);
+        first_recv_traced = true;
+      }
 #ifdef DEBUG_
       std::cerr << "\t received = " << received;
 #endif
@@ -46,6 +73,7 @@ struct EchoHandler {
       if (sent <= 0) {
         break;
       }
+      metrics.bytes_out.Add(static_cast<uint64_t>(sent));
 #ifdef DEBUG_
       std::cerr << ", sent = " << sent;
 #endif
@@ -55,28 +83,45 @@ struct EchoHandler {
 #endif
     using namespace std::chrono_literals;
     std::this_thread::sleep_for(1ms);
-    shutdown(sock, SHUT_RDWR);
-    close(sock);
+    CloseClientSocket(sock);
   }
 };
 
-template <class ConnectionHandler>
+template <class ConnectionHandler, class Endpoint = TcpEndpoint>
 class Server {
  public:
+  using Address = typename Endpoint::Address;
+
   Server() = delete;
-  Server(const int port_number, const int queue_size,
-         const int number_of_handlers)
-      : port_{port_number},
+  // A non-negative |inherited_socket| is a listener handed over by the
+  // previous process during a hot upgrade and is used instead of opening
+  // a new one.
+  Server(const Endpoint &endpoint, const int queue_size,
+         const int number_of_handlers, const int inherited_socket = -1)
+      : endpoint_{endpoint},
         queue_size_{queue_size},
         pool_{new JobsPool<ConnectionHandler>{number_of_handlers}} {
-    PrepareSocket();
+    wakeup_ = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_ < 0) {
+      throw std::runtime_error{"eventfd() failed"};
+    }
+    if (inherited_socket >= 0 and MakeNonBlocking(inherited_socket)) {
+      socket_ = inherited_socket;
+      socket_is_opened_ = true;
+    } else {
+      PrepareSocket();
+    }
   }
+  Server(const int port_number, const int queue_size,
+         const int number_of_handlers)
+      : Server{Endpoint{port_number}, queue_size, number_of_handlers} {}
   ~Server() {
     if (pool_) {
       pool_->FinishAvailableJobs();
     }
     StopPolitely();
     CloseSocket();
+    close(wakeup_);
   }
 
   void StopImmediately() {
@@ -87,22 +132,59 @@ class Server {
     CloseSocket();
   }
 
-  void StopPolitely() { shutdown(socket_, SHUT_RDWR); }
+  void StopPolitely() {
+    if (socket_is_opened_) {
+      shutdown(socket_, SHUT_RDWR);
+    }
+    StopAccepting();
+  }
+
+  // Leaves the listener open, so its queue survives for whoever else holds
+  // it, and makes start() return.
+  void StopAccepting() {
+    is_accepting_ = false;
+    const uint64_t one{1};
+    ssize_t written{write(wakeup_, &one, sizeof(one))};
+    (void)written;
+  }
+
+  // Forgets a listener that now belongs to the upgraded process: it is
+  // neither shut down nor unlinked. Queued jobs still drain on destruction.
+  void ReleaseHandedOffSocket() {
+    if (socket_is_opened_) {
+      close(socket_);
+      socket_ = 0;
+      socket_is_opened_ = false;
+    }
+  }
+
+  int listening_socket() const { return socket_is_opened_ ? socket_ : -1; }
 
   void start() { AcceptLoop(); }
 
  private:
   void AcceptLoop() {
     if (socket_is_opened_) {
-      struct sockaddr_in client_address {};
-      socklen_t address_size = sizeof(client_address);
-      while (true) {
-        int new_socket{accept(
-            socket_, reinterpret_cast<struct sockaddr *>(&client_address),
+      Address client_address{};
+      while (is_accepting_) {
+        socklen_t address_size = sizeof(client_address);
+        int new_socket{AcceptOrWake(
+            socket_, wakeup_,
+            reinterpret_cast<struct sockaddr *>(&client_address),
             &address_size)};
         if (new_socket > 0) {
-          if (pool_) {
-            pool_->AddJob(ConnectionHandler{new_socket, client_address});
+          TRACE_EVENT(kAccept, new_socket);
+          if (not RateLimits().Admits(client_address)) {
+            LocalMetrics().requests_rate_limited.Add();
+            close(new_socket);
+            continue;
+          }
+          if (pool_ and
+              pool_->AddJob(ConnectionHandler{new_socket, client_address})) {
+            LocalMetrics().connections_accepted.Add();
+          } else {
+            LocalMetrics().connections_rejected.Add();
+            close(new_socket);
           }
         } else {
           break;
@@ -116,42 +198,23 @@ class Server {
       close(socket_);
       socket_ = 0;
     }
-    socket_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_ == 0) {
-      throw std::runtime_error{"socket() failed"};
-    }
-    int optval{1};
-
-    if (setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optval,
-                   sizeof(optval))) {
-      throw std::runtime_error{"setsockopt() failed"};
-    }
-    address_.sin_family = AF_INET;
-    address_.sin_addr.s_addr = INADDR_ANY;
-    address_.sin_port = htons(port_);
-
-    if (bind(socket_, reinterpret_cast<struct sockaddr *>(&address_),
-             sizeof(address_)) < 0) {
-      throw std::runtime_error{"bind() failed"};
-    }
-
-    if (listen(socket_, queue_size_) < 0) {
-      throw std::runtime_error{"listen() failed"};
-    }
+    socket_ = endpoint_.Open(queue_size_);
     socket_is_opened_ = true;
   }
 
   void CloseSocket() {
     if (socket_is_opened_) {
       close(socket_);
+      endpoint_.Release();
       socket_ = 0;
       socket_is_opened_ = false;
     }
   }
 
   bool socket_is_opened_{false};
-  int socket_{};
-  struct sockaddr_in address_ {};
-  int port_{}, queue_size_{};
+  std::atomic<bool> is_accepting_{true};
+  int socket_{}, wakeup_{-1};
+  Endpoint endpoint_;
+  int queue_size_{};
   std::unique_ptr<JobsPool<ConnectionHandler>> pool_{};
 };
@@ -0,0 +1,581 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "spsc_queue.h"
+#include "timer_wheel.h"
+#include "trace.h"
+
+// Shared-nothing runtime: every shard is pinned to one core and owns its
+// listener (SO_REUSEPORT), epoll loop, timer wheel, buffer pool, handler and
+// connections. Shards talk to each other only through SPSC inboxes.
+
+constexpr size_t kShardBufferSize{16 * 1024};
+constexpr size_t kShardInboxCapacity{1024};
+constexpr int kShardMaxEvents{256};
+constexpr int kShardReadsPerEvent{16};
+constexpr size_t kShardMaxIovecs{64};
+
+using ShardBufferPool = BufferPool<kShardBufferSize>;
+
+template <class Session>
+struct ShardConnection {
+  int sock{-1};
+  uint64_t generation{};
+  struct sockaddr_in client_address {};
+  std::deque<ShardBufferPool::Buffer *> output{};
+  bool wants_write{false};
+  bool session_wants_write{false};
+  bool is_closing{false};
+  bool peer_closed{false};
+  uint64_t last_active_tick{};
+  Session session{};
+};
+
+template <class ShardHandler>
+class Shard {
+ public:
+  using Session = typename ShardHandler::Session;
+  using Message = typename ShardHandler::Message;
+  using Connection = ShardConnection<Session>;
+
+  Shard() = delete;
+  Shard(const size_t index, const int port, const int queue_size,
+        const std::chrono::milliseconds idle_timeout,
+        const std::vector<std::unique_ptr<Shard>> &peers)
+      : index_{index},
+        idle_timeout_{idle_timeout},
+        peers_{peers},
+        timers_{512, std::chrono::milliseconds{100}},
+        pool_{64} {
+    PrepareSockets(port, queue_size);
+  }
+  Shard(const Shard &) = delete;
+  Shard &operator=(const Shard &) = delete;
+  ~Shard() {
+    CloseAllConnections();
+    for (const int fd : {listener_, wakeup_, epoll_}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  void CreateInboxes(const size_t number_of_shards) {
+    for (size_t i{}; i < number_of_shards; ++i) {
+      inboxes_.emplace_back(new Inbox{kShardInboxCapacity});
+    }
+  }
+
+  void Run() {
+    PinToCore();
+    metrics_ = &LocalMetrics();
+    std::array<struct epoll_event, kShardMaxEvents> events{};
+    const int timeout{static_cast<int>(timers_.tick().count())};
+    while (is_running_) {
+      int ready{epoll_wait(epoll_, events.data(), kShardMaxEvents, timeout)};
+      if (ready < 0 and errno != EINTR) {
+        break;
+      }
+      for (int i{}; i < ready; ++i) {
+        const int fd{events[i].data.fd};
+        if (fd == listener_) {
+          AcceptAll();
+        } else if (fd == wakeup_) {
+          DrainInboxes();
+        } else {
+          HandleConnectionEvent(fd, events[i].events);
+        }
+      }
+      timers_.Advance([this](const TimerKey &key) { OnIdleTimer(key); });
+    }
+    CloseAllConnections();
+  }
+
+  void Stop() {
+    is_running_ = false;
+    WakeUp();
+  }
+
+  // Queues |message| to shard |to| and wakes it up. Returns false if that
+  // shard's inbox for this sender is full.
+  bool Post(const size_t to, Message &&message) {
+    auto &peer{*peers_.at(to)};
+    if (not peer.inboxes_.at(index_)->TryPush(std::move(message))) {
+      return false;
+    }
+    if (not peer.wakeup_pending_.exchange(true, std::memory_order_acq_rel)) {
+      peer.WakeUp();
+    }
+    return true;
+  }
+
+  bool Send(Connection &connection, const unsigned char *data, size_t size) {
+    if (connection.is_closing) {
+      return false;
+    }
+    if (connection.output.empty()) {
+      ssize_t sent{
+          send(connection.sock, data, size, MSG_DONTWAIT | MSG_NOSIGNAL)};
+      if (sent < 0) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+          connection.is_closing = true;
+          return false;
+        }
+        sent = 0;
+      }
+      data += sent;
+      size -= static_cast<size_t>(sent);
+      metrics_->bytes_out.Add(static_cast<uint64_t>(sent));
+    }
+    while (size > 0) {
+      if (connection.output.empty() or
+          connection.output.back()->free_space() == 0) {
+        connection.output.push_back(pool_.Acquire());
+      }
+      auto *buffer{connection.output.back()};
+      const size_t chunk{std::min(size, buffer->free_space())};
+      std::copy(data, data + chunk, buffer->data.begin() + buffer->end);
+      buffer->end += chunk;
+      data += chunk;
+      size -= chunk;
+    }
+    if (not connection.output.empty() and not connection.wants_write) {
+      SetWriteInterest(connection, true);
+    }
+    return true;
+  }
+
+  void Close(Connection &connection) { connection.is_closing = true; }
+
+  // For handlers that write to the socket themselves: counts a successful
+  // send as activity, so a connection that only receives is not idle.
+  void Touch(Connection &connection) {
+    connection.last_active_tick = timers_.CurrentTick();
+  }
+
+  // For handlers that write to the socket themselves: while enabled, every
+  // EPOLLOUT on |connection| ends up in the handler's OnWritable().
+  void SetSessionWriteInterest(Connection &connection, const bool enabled) {
+    connection.session_wants_write = enabled;
+    if (enabled != connection.wants_write and
+        (enabled or connection.output.empty())) {
+      SetWriteInterest(connection, enabled);
+    }
+  }
+
+  size_t index() const { return index_; }
+  size_t size() const { return peers_.size(); }
+  ShardHandler &handler() { return handler_; }
+  ShardBufferPool &pool() { return pool_; }
+
+ private:
+  using Inbox = SpscQueue<Message>;
+  struct TimerKey {
+    int sock{};
+    uint64_t generation{};
+  };
+
+  void PrepareSockets(const int port, const int queue_size) {
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    listener_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (epoll_ < 0 or wakeup_ < 0 or listener_ < 0) {
+      throw std::runtime_error{"shard socket() failed"};
+    }
+    int optval{1};
+    if (setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &optval,
+                   sizeof(optval)) or
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEPORT, &optval,
+                   sizeof(optval))) {
+      throw std::runtime_error{"setsockopt() failed"};
+    }
+    struct sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(listener_, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address)) < 0) {
+      throw std::runtime_error{"bind() failed"};
+    }
+    if (listen(listener_, queue_size) < 0) {
+      throw std::runtime_error{"listen() failed"};
+    }
+    for (const int fd : {listener_, wakeup_}) {
+      struct epoll_event event {};
+      event.events = EPOLLIN;
+      event.data.fd = fd;
+      if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) < 0) {
+        throw std::runtime_error{"epoll_ctl() failed"};
+      }
+    }
+  }
+
+  void PinToCore() {
+    const unsigned int cores{std::thread::hardware_concurrency()};
+    if (cores > 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(index_ % cores, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+  }
+
+  void WakeUp() {
+    const uint64_t one{1};
+    ssize_t written{write(wakeup_, &one, sizeof(one))};
+    (void)written;
+  }
+
+  void DrainInboxes() {
+    uint64_t counter{};
+    ssize_t received{read(wakeup_, &counter, sizeof(counter))};
+    (void)received;
+    // An RMW rather than a store: a plain store could be reordered after the
+    // loads in ConsumeBatch, letting a racing Post see |true|, skip WakeUp()
+    // and leave its message unread. If Post's exchange comes first, this one
+    // reads its value and so sees the message it pushed.
+    wakeup_pending_.exchange(false, std::memory_order_acq_rel);
+    for (auto &inbox : inboxes_) {
+      inbox->ConsumeBatch(
+          [this](Message &message) { handler_.OnMessage(*this, message); },
+          kShardInboxCapacity);
+    }
+    FlushClosingConnections();
+  }
+
+  void AcceptAll() {
+    while (true) {
+      struct sockaddr_in client_address {};
+      socklen_t address_size{sizeof(client_address)};
+      int sock{accept4(listener_,
+                       reinterpret_cast<struct sockaddr *>(&client_address),
+                       &address_size, SOCK_NONBLOCK | SOCK_CLOEXEC)};
+      if (sock < 0) {
+        break;
+      }
+      TRACE_EVENT(kAccept, sock);
+      if (not RateLimits().Admits(client_address)) {
+        metrics_->requests_rate_limited.Add();
+        close(sock);
+        continue;
+      }
+      int optval{1};
+      setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+      if (static_cast<size_t>(sock) >= connections_.size()) {
+        connections_.resize(static_cast<size_t>(sock) + 1);
+      }
+      auto &connection{connections_[static_cast<size_t>(sock)]};
+      connection.reset(new Connection{});
+      connection->sock = sock;
+      connection->generation = ++generation_;
+      connection->client_address = client_address;
+      connection->last_active_tick = timers_.CurrentTick();
+
+      struct epoll_event event {};
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.fd = sock;
+      if (epoll_ctl(epoll_, EPOLL_CTL_ADD, sock, &event) < 0) {
+        close(sock);
+        connection.reset();
+        continue;
+      }
+      timers_.Schedule(TimerKey{sock, connection->generation}, idle_timeout_);
+      metrics_->connections_accepted.Add();
+      handler_.OnOpen(*this, *connection);
+      if (connection->is_closing) {
+        CloseConnection(*connection);
+      }
+    }
+  }
+
+  void HandleConnectionEvent(const int sock, const uint32_t events) {
+    if (static_cast<size_t>(sock) >= connections_.size() or
+        not connections_[static_cast<size_t>(sock)]) {
+      return;
+    }
+    auto &connection{*connections_[static_cast<size_t>(sock)]};
+    connection.last_active_tick = timers_.CurrentTick();
+    if (events & EPOLLOUT) {
+      Flush(connection);
+      if (connection.session_wants_write and not connection.is_closing) {
+        handler_.OnWritable(*this, connection);
+      }
+    }
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) and
+        not connection.peer_closed) {
+      Receive(connection);
+    }
+    if (connection.is_closing) {
+      CloseConnection(connection);
+    }
+  }
+
+  void Receive(Connection &connection) {
+    for (int i{}; i < kShardReadsPerEvent and not connection.is_closing; ++i) {
+      ssize_t received{recv(connection.sock, receive_buffer_.data(),
+                            receive_buffer_.size(), MSG_DONTWAIT)};
+      if (received < 0) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+          connection.is_closing = true;
+        }
+        break;
+      } else if (received == 0) {
+        // The client may half-close after pipelining its last requests:
+        // stop reading, but only close once their answers are sent.
+        connection.peer_closed = true;
+        if (connection.output.empty()) {
+          connection.is_closing = true;
+        } else {
+          SetWriteInterest(connection, true);
+        }
+        break;
+      }
+      metrics_->bytes_in.Add(static_cast<uint64_t>(received));
+      if (not RateLimits().Allow(connection.client_address)) {
+        metrics_->requests_rate_limited.Add();
+        connection.is_closing = true;
+        break;
+      }
+      const auto started{std::chrono::steady_clock::now()};
+      handler_.OnData(*this, connection, receive_buffer_.data(),
+                      static_cast<size_t>(received));
+      metrics_->handler_latency[handler_index_].Record(
+          std::chrono::steady_clock::now() - started);
+      if (static_cast<size_t>(received) < receive_buffer_.size()) {
+        break;
+      }
+    }
+  }
+
+  void Flush(Connection &connection) {
+    std::array<struct iovec, kShardMaxIovecs> iovecs{};
+    while (not connection.output.empty()) {
+      size_t count{};
+      for (auto *buffer : connection.output) {
+        if (count == iovecs.size()) {
+          break;
+        }
+        iovecs[count].iov_base = buffer->data.data() + buffer->begin;
+        iovecs[count].iov_len = buffer->size();
+        ++count;
+      }
+      struct msghdr message {};
+      message.msg_iov = iovecs.data();
+      message.msg_iovlen = count;
+      ssize_t sent{sendmsg(connection.sock, &message,
+                           MSG_DONTWAIT | MSG_NOSIGNAL)};
+      if (sent < 0) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+          connection.is_closing = true;
+        }
+        break;
+      }
+      metrics_->bytes_out.Add(static_cast<uint64_t>(sent));
+      size_t remaining{static_cast<size_t>(sent)};
+      while (remaining > 0) {
+        auto *buffer{connection.output.front()};
+        const size_t chunk{std::min(remaining, buffer->size())};
+        buffer->begin += chunk;
+        remaining -= chunk;
+        if (buffer->size() == 0) {
+          connection.output.pop_front();
+          pool_.Release(buffer);
+        }
+      }
+    }
+    if (connection.output.empty() and connection.peer_closed) {
+      connection.is_closing = true;
+    } else if (connection.output.empty() and connection.wants_write and
+               not connection.session_wants_write) {
+      SetWriteInterest(connection, false);
+    }
+  }
+
+  void SetWriteInterest(Connection &connection, const bool enabled) {
+    struct epoll_event event {};
+    // Once the peer has closed its side, EPOLLIN and EPOLLRDHUP would fire on
+    // every wait, so only the pending output is watched.
+    event.events = (connection.peer_closed
+                        ? 0u
+                        : static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP)) |
+                   (enabled ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    event.data.fd = connection.sock;
+    if (epoll_ctl(epoll_, EPOLL_CTL_MOD, connection.sock, &event) == 0) {
+      connection.wants_write = enabled;
+    }
+  }
+
+  void OnIdleTimer(const TimerKey &key) {
+    if (static_cast<size_t>(key.sock) >= connections_.size()) {
+      return;
+    }
+    auto &connection{connections_[static_cast<size_t>(key.sock)]};
+    if (not connection or connection->generation != key.generation) {
+      return;
+    }
+    const auto idle{std::chrono::milliseconds{
+        (timers_.CurrentTick() - connection->last_active_tick) *
+        static_cast<uint64_t>(timers_.tick().count())}};
+    if (idle >= idle_timeout_) {
+      CloseConnection(*connection);
+    } else {
+      timers_.Schedule(key, idle_timeout_ - idle);
+    }
+  }
+
+  void FlushClosingConnections() {
+    for (auto &connection : connections_) {
+      if (connection and connection->is_closing) {
+        CloseConnection(*connection);
+      }
+    }
+  }
+
+  void CloseConnection(Connection &connection) {
+    const int sock{connection.sock};
+    TRACE_EVENT(kClose, sock);
+    handler_.OnClose(*this, connection);
+    for (auto *buffer : connection.output) {
+      pool_.Release(buffer);
+    }
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, sock, nullptr);
+    close(sock);
+    connections_[static_cast<size_t>(sock)].reset();
+    metrics_->connections_closed.Add();
+  }
+
+  void CloseAllConnections() {
+    for (auto &connection : connections_) {
+      if (connection) {
+        CloseConnection(*connection);
+      }
+    }
+  }
+
+  size_t index_{};
+  std::chrono::milliseconds idle_timeout_{};
+  const std::vector<std::unique_ptr<Shard>> &peers_;
+  int epoll_{-1}, listener_{-1}, wakeup_{-1};
+  std::atomic<bool> is_running_{true};
+  alignas(kCacheLineSize) std::atomic<bool> wakeup_pending_{false};
+  alignas(kCacheLineSize) std::vector<std::unique_ptr<Inbox>> inboxes_{};
+  std::vector<std::unique_ptr<Connection>> connections_{};
+  uint64_t generation_{};
+  TimerWheel<TimerKey> timers_;
+  ShardBufferPool pool_;
+  std::array<unsigned char, kShardBufferSize> receive_buffer_{};
+  ShardHandler handler_{};
+  size_t handler_index_{Metrics().HandlerIndex(ShardHandler::kName)};
+  ThreadMetrics *metrics_{&LocalMetrics()};
+};
+
+template <class ShardHandler>
+class ShardedServer {
+ public:
+  ShardedServer() = delete;
+  ShardedServer(const int port_number, const int queue_size,
+                const int number_of_shards,
+                const std::chrono::milliseconds idle_timeout =
+                    std::chrono::seconds{30}) {
+    for (int i{}; i < number_of_shards; ++i) {
+      shards_.emplace_back(new Shard<ShardHandler>{
+          static_cast<size_t>(i), port_number, queue_size, idle_timeout,
+          shards_});
+    }
+    for (auto &shard : shards_) {
+      shard->CreateInboxes(shards_.size());
+    }
+  }
+  ~ShardedServer() {
+    StopPolitely();
+    JoinShards();
+  }
+
+  void StopImmediately() { StopPolitely(); }
+
+  void StopPolitely() {
+    for (auto &shard : shards_) {
+      shard->Stop();
+    }
+  }
+
+  void start() {
+    for (auto &shard : shards_) {
+      threads_.emplace_back(&Shard<ShardHandler>::Run, shard.get());
+    }
+    JoinShards();
+  }
+
+ private:
+  void JoinShards() {
+    for (auto &t : threads_) {
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Shard<ShardHandler>>> shards_{};
+  std::vector<std::thread> threads_{};
+};
+
+struct EchoShardHandler {
+  static constexpr const char *kName{"sharded_echo"};
+
+  struct Session {};
+  struct Message {};
+
+  template <class Shard>
+  void OnOpen(Shard &shard, typename Shard::Connection &connection) {
+    (void)shard;
+    (void)connection;
+  }
+
+  template <class Shard>
+  void OnData(Shard &shard, typename Shard::Connection &connection,
+              const unsigned char *data, const size_t size) {
+    shard.Send(connection, data, size);
+  }
+
+  template <class Shard>
+  void OnWritable(Shard &shard, typename Shard::Connection &connection) {
+    (void)shard;
+    (void)connection;
+  }
+
+  template <class Shard>
+  void OnClose(Shard &shard, typename Shard::Connection &connection) {
+    (void)shard;
+    (void)connection;
+  }
+
+  template <class Shard>
+  void OnMessage(Shard &shard, Message &message) {
+    (void)shard;
+    (void)message;
+  }
+};
@@ -1,78 +1,580 @@
-
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
 #include <thread>
 #include <vector>
 
 constexpr int kPort{7777};
 constexpr size_t kBufferSize{1024};
+constexpr size_t kUdpBatchSize{32};
+constexpr size_t kUdpDatagramSize{64};
+// A server that stops answering fails the run instead of hanging it.
+constexpr time_t kReceiveTimeoutSeconds{5};
+const std::string kDefaultUnixPath{"@rtk_echo"};
 volatile bool g_IsRunning{false};
+std::atomic<unsigned long long> g_Sent{}, g_Received{};
 
-void SendToServer() {
-  int sock{};
-  sockaddr_in serv_addr{AF_INET, htons(kPort)};
-  const char request[] = "test request to server";
-  char buffer[kBufferSize]{};
-  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    throw std::runtime_error{"socket() failed"};
-  }
+struct Target {
+  int family{AF_INET};
+  int type{SOCK_STREAM};
+  sockaddr_storage address{};
+  socklen_t address_size{};
+};
+
+Target g_Target{};
+bool g_KeepAlive{false};
+std::mutex g_LatenciesAccess{};
+std::vector<double> g_Latencies{};
 
+sockaddr_in ServerAddress() {
+  sockaddr_in serv_addr{AF_INET, htons(kPort)};
   if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
     throw std::runtime_error{"inet_pton() failed"};
   }
+  return serv_addr;
+}
 
-  if (connect(sock, reinterpret_cast<struct sockaddr *>(&serv_addr),
-              sizeof(serv_addr)) < 0) {
+Target TcpTarget() {
+  Target target{};
+  sockaddr_in serv_addr{ServerAddress()};
+  std::memcpy(&target.address, &serv_addr, sizeof(serv_addr));
+  target.address_size = sizeof(serv_addr);
+  return target;
+}
+
+// A path starting with '@' names a socket in the abstract namespace.
+Target UnixTarget(const std::string &path, const int type) {
+  Target target{AF_UNIX, type};
+  sockaddr_un serv_addr{};
+  if (path.empty() or path.size() >= sizeof(serv_addr.sun_path)) {
+    throw std::runtime_error{"bad unix socket path"};
+  }
+  serv_addr.sun_family = AF_UNIX;
+  std::memcpy(serv_addr.sun_path, path.data(), path.size());
+  const bool is_abstract{path.front() == '@'};
+  if (is_abstract) {
+    serv_addr.sun_path[0] = '\0';
+  }
+  std::memcpy(&target.address, &serv_addr, sizeof(serv_addr));
+  target.address_size = static_cast<socklen_t>(
+      offsetof(sockaddr_un, sun_path) + path.size() + (is_abstract ? 0 : 1));
+  return target;
+}
+
+int ConnectToServer() {
+  int sock{};
+  if ((sock = socket(g_Target.family, g_Target.type, 0)) < 0) {
+    throw std::runtime_error{"socket() failed"};
+  }
+
+  if (connect(sock, reinterpret_cast<struct sockaddr *>(&g_Target.address),
+              g_Target.address_size) < 0) {
     throw std::runtime_error{"connect() failed"};
   }
-  ssize_t sent{send(sock, request, strlen(request), 0)};
+  struct timeval timeout {kReceiveTimeoutSeconds, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return sock;
+}
+
+// Echo workload: every round trip writes |pipeline| messages of
+// |message_size| bytes at once and waits for all of them to come back.
+// |idle| extra connections are opened up front and never used.
+struct EchoWorkload {
+  size_t message_size{22};
+  size_t pipeline{1};
+  size_t idle{};
+};
+
+EchoWorkload g_Echo{};
+
+void ReadExactly(const int sock, char *buffer, size_t size) {
+  while (size > 0) {
+    ssize_t received{read(sock, buffer, size)};
+    if (received <= 0) {
+      throw std::runtime_error{"read() failed"};
+    }
+    buffer += received;
+    size -= static_cast<size_t>(received);
+  }
+}
+
+std::string EchoRequest() {
+  const char pattern[] = "test request to server";
+  std::string message{};
+  while (message.size() < g_Echo.message_size) {
+    message.append(pattern, std::min(sizeof(pattern) - 1,
+                                     g_Echo.message_size - message.size()));
+  }
+  std::string request{};
+  for (size_t i{}; i < g_Echo.pipeline; ++i) {
+    request += message;
+  }
+  return request;
+}
 
-  if (sent <= 0) {
-    throw std::runtime_error{"sent <= 0"};
+double RoundTrip(const int sock) {
+  thread_local const std::string request{EchoRequest()};
+  thread_local std::vector<char> buffer(request.size());
+  const auto started{std::chrono::steady_clock::now()};
+  size_t sent_total{};
+  while (sent_total < request.size()) {
+    ssize_t sent{send(sock, request.data() + sent_total,
+                      request.size() - sent_total, MSG_NOSIGNAL)};
+    if (sent <= 0) {
+      throw std::runtime_error{"sent <= 0"};
+    }
+    sent_total += static_cast<size_t>(sent);
   }
 
-  ssize_t read_size = read(sock, buffer, kBufferSize);
-  bool success{read_size + 1 == sizeof request and
-               0 == strncmp(request, buffer, sizeof request)};
+  ReadExactly(sock, buffer.data(), buffer.size());
+  const std::chrono::duration<double, std::micro> latency{
+      std::chrono::steady_clock::now() - started};
+  bool success{0 == std::memcmp(request.data(), buffer.data(), buffer.size())};
 
 #ifdef DEBUG_
-  std::cerr << "sent = " << sent << ", received = " << read_size << ", "
-            << success << std::endl;
+  std::cerr << "sent = " << sent_total << ", received = " << buffer.size()
+            << ", " << success << std::endl;
 #endif
 
   if (not success) {
     throw std::runtime_error{"answer from server is different"};
   }
+  g_Sent += g_Echo.pipeline;
+  g_Received += g_Echo.pipeline;
+  return latency.count();
+}
+
+void ThreadMain() {
+  std::vector<double> latencies{};
+  if (g_KeepAlive) {
+    int sock{ConnectToServer()};
+    while (g_IsRunning) {
+      latencies.push_back(RoundTrip(sock));
+    }
+    shutdown(sock, SHUT_RDWR);
+    close(sock);
+  } else {
+    while (g_IsRunning) {
+      int sock{ConnectToServer()};
+      latencies.push_back(RoundTrip(sock));
+      shutdown(sock, SHUT_RDWR);
+      close(sock);
+    }
+  }
+  std::scoped_lock lock{g_LatenciesAccess};
+  g_Latencies.insert(g_Latencies.end(), latencies.begin(), latencies.end());
+}
+
+long long SteadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Publishes its send time as fast as the socket allows; subscribers get a
+// moment to subscribe first.
+void PublisherMain() {
+  int sock{ConnectToServer()};
+  std::this_thread::sleep_for(std::chrono::milliseconds{200});
+  char command[64]{};
+  while (g_IsRunning) {
+    const int size{snprintf(command, sizeof(command), "PUB %lld\n",
+                            SteadyNanoseconds())};
+    if (send(sock, command, static_cast<size_t>(size), MSG_NOSIGNAL) <= 0) {
+      break;
+    }
+    ++g_Sent;
+  }
+  close(sock);
+}
 
-  shutdown(sock, SHUT_RDWR);
+// Counts delivered messages and samples the publish-to-receive latency from
+// the last complete line of every read.
+void SubscriberMain() {
+  int sock{ConnectToServer()};
+  struct timeval timeout {0, 100000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  const char subscribe[]{"SUB\n"};
+  if (send(sock, subscribe, sizeof(subscribe) - 1, MSG_NOSIGNAL) <= 0) {
+    throw std::runtime_error{"send() failed"};
+  }
+  std::vector<double> latencies{};
+  std::string pending{};
+  char buffer[16 * kBufferSize]{};
+  while (g_IsRunning) {
+    ssize_t received{recv(sock, buffer, sizeof(buffer), 0)};
+    if (received == 0) {
+      break;
+    } else if (received < 0) {
+      continue;
+    }
+    pending.append(buffer, static_cast<size_t>(received));
+    const size_t last_newline{pending.rfind('\n')};
+    if (last_newline == std::string::npos) {
+      continue;
+    }
+    g_Received += static_cast<unsigned long long>(
+        std::count(pending.begin(), pending.begin() + last_newline + 1, '\n'));
+    const size_t line_start{pending.rfind('\n', last_newline - 1)};
+    const long long published{std::atoll(
+        pending.c_str() + (line_start == std::string::npos ? 0
+                                                           : line_start + 1))};
+    latencies.push_back(
+        static_cast<double>(SteadyNanoseconds() - published) / 1e3);
+    pending.erase(0, last_newline + 1);
+  }
   close(sock);
+  std::scoped_lock lock{g_LatenciesAccess};
+  g_Latencies.insert(g_Latencies.end(), latencies.begin(), latencies.end());
 }
 
-void ThreadMain() {
+// Cache workload: key popularity follows a Zipf distribution; a GET miss
+// is followed by a SET of that key, as a cache-aside client would do.
+struct KvWorkload {
+  size_t keys{100000};
+  double zipf{0.99};
+  double set_ratio{0.1};
+  size_t value_size{100};
+  size_t multi_get{};
+};
+
+KvWorkload g_Kv{};
+std::vector<double> g_ZipfCdf{};
+std::atomic<unsigned long long> g_Hits{}, g_Lookups{};
+
+void BuildZipf() {
+  g_ZipfCdf.resize(g_Kv.keys);
+  double sum{};
+  for (size_t i{}; i < g_Kv.keys; ++i) {
+    sum += 1. / std::pow(static_cast<double>(i + 1), g_Kv.zipf);
+    g_ZipfCdf[i] = sum;
+  }
+  for (auto &value : g_ZipfCdf) {
+    value /= sum;
+  }
+}
+
+std::string KvKey(std::mt19937_64 &random) {
+  std::uniform_real_distribution<double> uniform{0., 1.};
+  const auto found{
+      std::lower_bound(g_ZipfCdf.begin(), g_ZipfCdf.end(), uniform(random))};
+  return "key:" + std::to_string(std::min<size_t>(
+                      static_cast<size_t>(found - g_ZipfCdf.begin()),
+                      g_Kv.keys - 1));
+}
+
+void AppendKvRequest(std::string &request, const char opcode,
+                     const uint16_t key_size, const std::string &payload) {
+  // A multi-get has no key of its own: |key_size| is the number of keys.
+  const size_t value_size{payload.size() - (opcode == 'M' ? 0 : key_size)};
+  const uint16_t key_field{htons(key_size)};
+  const uint32_t value_field{htonl(static_cast<uint32_t>(value_size))};
+  request += opcode;
+  request.append(reinterpret_cast<const char *>(&key_field), 2);
+  request.append(reinterpret_cast<const char *>(&value_field), 4);
+  request += payload;
+}
+
+// Returns true on a hit.
+bool ReadKvResponse(const int sock) {
+  char header[5]{};
+  ReadExactly(sock, header, sizeof(header));
+  uint32_t size{};
+  std::memcpy(&size, header + 1, sizeof(size));
+  thread_local std::vector<char> value{};
+  value.resize(ntohl(size));
+  ReadExactly(sock, value.data(), value.size());
+  ++g_Received;
+  return header[0] == 0;
+}
+
+void KvThreadMain() {
+  std::mt19937_64 random{std::hash<std::thread::id>{}(
+      std::this_thread::get_id())};
+  std::uniform_real_distribution<double> uniform{0., 1.};
+  const std::string value(g_Kv.value_size, 'v');
+  std::vector<double> latencies{};
+  std::string request{};
+  int sock{ConnectToServer()};
+  while (g_IsRunning) {
+    request.clear();
+    const auto started{std::chrono::steady_clock::now()};
+    if (g_Kv.multi_get > 0) {
+      std::string keys{};
+      for (size_t i{}; i < g_Kv.multi_get; ++i) {
+        const std::string key{KvKey(random)};
+        const uint16_t key_size{htons(static_cast<uint16_t>(key.size()))};
+        keys.append(reinterpret_cast<const char *>(&key_size), 2);
+        keys += key;
+      }
+      AppendKvRequest(request, 'M', static_cast<uint16_t>(g_Kv.multi_get),
+                      keys);
+      send(sock, request.data(), request.size(), 0);
+      g_Sent += g_Kv.multi_get;
+      for (size_t i{}; i < g_Kv.multi_get; ++i) {
+        g_Hits += ReadKvResponse(sock) ? 1 : 0;
+      }
+      g_Lookups += g_Kv.multi_get;
+    } else {
+      const std::string key{KvKey(random)};
+      const bool is_set{uniform(random) < g_Kv.set_ratio};
+      AppendKvRequest(request, is_set ? 'S' : 'G',
+                      static_cast<uint16_t>(key.size()),
+                      is_set ? key + value : key);
+      send(sock, request.data(), request.size(), 0);
+      ++g_Sent;
+      const bool hit{ReadKvResponse(sock)};
+      if (not is_set) {
+        ++g_Lookups;
+        if (hit) {
+          ++g_Hits;
+        } else {
+          request.clear();
+          AppendKvRequest(request, 'S', static_cast<uint16_t>(key.size()),
+                          key + value);
+          send(sock, request.data(), request.size(), 0);
+          ++g_Sent;
+          ReadKvResponse(sock);
+        }
+      }
+    }
+    const std::chrono::duration<double, std::micro> latency{
+        std::chrono::steady_clock::now() - started};
+    latencies.push_back(latency.count());
+  }
+  close(sock);
+  std::scoped_lock lock{g_LatenciesAccess};
+  g_Latencies.insert(g_Latencies.end(), latencies.begin(), latencies.end());
+}
+
+size_t g_JsonRpcBatch{1};
+
+// One line per round trip: a single call, or a batch of |g_JsonRpcBatch|
+// calls that is answered with one array.
+void JsonRpcThreadMain() {
+  std::string request{};
+  if (g_JsonRpcBatch > 1) {
+    request += '[';
+  }
+  for (size_t i{}; i < g_JsonRpcBatch; ++i) {
+    request += std::string{i > 0 ? "," : ""} +
+               "{\"jsonrpc\":\"2.0\",\"method\":\"sum\","
+               "\"params\":[1,2,3],\"id\":" +
+               std::to_string(i) + "}";
+  }
+  request += g_JsonRpcBatch > 1 ? "]\n" : "\n";
+  std::vector<double> latencies{};
+  char buffer[16 * kBufferSize]{};
+  int sock{ConnectToServer()};
+  while (g_IsRunning) {
+    const auto started{std::chrono::steady_clock::now()};
+    if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) <= 0) {
+      break;
+    }
+    g_Sent += g_JsonRpcBatch;
+    ssize_t received{};
+    do {
+      received = read(sock, buffer, sizeof(buffer));
+    } while (received > 0 and buffer[received - 1] != '\n');
+    if (received <= 0) {
+      break;
+    }
+    g_Received += g_JsonRpcBatch;
+    const std::chrono::duration<double, std::micro> latency{
+        std::chrono::steady_clock::now() - started};
+    latencies.push_back(latency.count());
+  }
+  close(sock);
+  std::scoped_lock lock{g_LatenciesAccess};
+  g_Latencies.insert(g_Latencies.end(), latencies.begin(), latencies.end());
+}
+
+double Percentile(std::vector<double> &values, const double fraction) {
+  if (values.empty()) {
+    return 0.;
+  }
+  const size_t index{static_cast<size_t>(fraction * (values.size() - 1))};
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+// Fires batches of datagrams with sendmmsg() and drains whatever echoes have
+// already arrived with a non-blocking recvmmsg(), so the send rate is never
+// throttled by the round trip.
+void UdpBlasterMain() {
+  int sock{socket(AF_INET, SOCK_DGRAM, 0)};
+  if (sock < 0) {
+    throw std::runtime_error{"socket() failed"};
+  }
+  sockaddr_in serv_addr{ServerAddress()};
+  if (connect(sock, reinterpret_cast<struct sockaddr *>(&serv_addr),
+              sizeof(serv_addr)) < 0) {
+    throw std::runtime_error{"connect() failed"};
+  }
+
+  std::array<std::array<char, kUdpDatagramSize>, kUdpBatchSize> buffers{};
+  std::array<struct iovec, kUdpBatchSize> iovecs{};
+  std::array<struct mmsghdr, kUdpBatchSize> messages{};
+  for (size_t i{}; i < kUdpBatchSize; ++i) {
+    snprintf(buffers[i].data(), buffers[i].size(), "datagram #%zu", i);
+    iovecs[i].iov_base = buffers[i].data();
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+
   while (g_IsRunning) {
-    SendToServer();
+    for (auto &iov : iovecs) {
+      iov.iov_len = kUdpDatagramSize;
+    }
+    int sent{sendmmsg(sock, messages.data(), kUdpBatchSize, 0)};
+    if (sent > 0) {
+      g_Sent += static_cast<unsigned long long>(sent);
+    }
+    int received{recvmmsg(sock, messages.data(), kUdpBatchSize, MSG_DONTWAIT,
+                          nullptr)};
+    if (received > 0) {
+      g_Received += static_cast<unsigned long long>(received);
+    }
   }
+  close(sock);
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+  std::vector<std::string> positional{};
+  std::string unix_path{kDefaultUnixPath};
+  int unix_type{SOCK_STREAM};
+  bool json_output{false};
+  for (int i{1}; i < argc; ++i) {
+    const std::string argument{argv[i]};
+    if (argument == "--keep-alive") {
+      g_KeepAlive = true;
+    } else if (argument.rfind("--unix=", 0) == 0) {
+      unix_path = argument.substr(7);
+    } else if (argument.rfind("--keys=", 0) == 0) {
+      g_Kv.keys = std::max<size_t>(1, std::stoul(argument.substr(7)));
+    } else if (argument.rfind("--zipf=", 0) == 0) {
+      g_Kv.zipf = std::stod(argument.substr(7));
+    } else if (argument.rfind("--set-ratio=", 0) == 0) {
+      g_Kv.set_ratio = std::stod(argument.substr(12));
+    } else if (argument.rfind("--value-size=", 0) == 0) {
+      g_Kv.value_size = std::stoul(argument.substr(13));
+    } else if (argument.rfind("--mget=", 0) == 0) {
+      g_Kv.multi_get = std::stoul(argument.substr(7));
+    } else if (argument.rfind("--batch=", 0) == 0) {
+      g_JsonRpcBatch = std::max<size_t>(1, std::stoul(argument.substr(8)));
+    } else if (argument.rfind("--message-size=", 0) == 0) {
+      g_Echo.message_size =
+          std::max<size_t>(1, std::stoul(argument.substr(15)));
+    } else if (argument.rfind("--pipeline=", 0) == 0) {
+      g_Echo.pipeline = std::max<size_t>(1, std::stoul(argument.substr(11)));
+    } else if (argument.rfind("--idle=", 0) == 0) {
+      g_Echo.idle = std::stoul(argument.substr(7));
+    } else if (argument == "--json") {
+      json_output = true;
+    } else if (argument == "--seqpacket") {
+      unix_type = SOCK_SEQPACKET;
+    } else {
+      positional.push_back(argument);
+    }
+  }
+  const std::string mode{positional.size() > 0 ? positional[0] : "tcp"};
+  const int number_of_threads{positional.size() > 1 ? std::stoi(positional[1])
+                                                    : 4};
+  const int seconds{positional.size() > 2 ? std::stoi(positional[2]) : 5};
+
+  auto thread_main{ThreadMain};
+  if (mode == "tcp") {
+    g_Target = TcpTarget();
+  } else if (mode == "pubsub") {
+    thread_main = SubscriberMain;
+    g_Target = TcpTarget();
+  } else if (mode == "kv") {
+    thread_main = KvThreadMain;
+    g_Target = TcpTarget();
+    BuildZipf();
+  } else if (mode == "jsonrpc") {
+    thread_main = JsonRpcThreadMain;
+    g_Target = TcpTarget();
+  } else if (mode == "unix") {
+    g_Target = UnixTarget(unix_path, unix_type);
+  } else if (mode == "udp") {
+    thread_main = UdpBlasterMain;
+  } else {
+    std::cerr << "usage: " << argv[0]
+              << " [tcp | unix | udp | pubsub | kv | jsonrpc] [threads]"
+                 " [seconds]"
+                 " [--keep-alive] [--unix=PATH] [--seqpacket] [--keys=N]"
+                 " [--zipf=S] [--set-ratio=P] [--value-size=N] [--mget=N]"
+                 " [--batch=N] [--message-size=N] [--pipeline=N] [--idle=N]"
+                 " [--json]"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<int> idle_sockets{};
+  for (size_t i{}; i < g_Echo.idle; ++i) {
+    idle_sockets.push_back(ConnectToServer());
+  }
+
   g_IsRunning = true;
   std::vector<std::thread> threads;
 
-  for (int i{}; i < 4; ++i) {
-    threads.emplace_back(ThreadMain);
+  for (int i{}; i < number_of_threads; ++i) {
+    // In pubsub mode the first thread publishes to all the others.
+    threads.emplace_back(i == 0 and mode == "pubsub" ? PublisherMain
+                                                     : thread_main);
   }
 
-  using namespace std::chrono_literals;
-  std::this_thread::sleep_for(5s);
+  std::this_thread::sleep_for(std::chrono::seconds{seconds});
 
   g_IsRunning = false;
 
   for (auto &t : threads) {
     t.join();
   }
+
+  for (const int sock : idle_sockets) {
+    close(sock);
+  }
+
+  const double p50{Percentile(g_Latencies, 0.5)};
+  const double p99{Percentile(g_Latencies, 0.99)};
+  if (json_output) {
+    std::cout << "{\"mode\":\"" << mode << "\",\"seconds\":" << seconds
+              << ",\"sent\":" << g_Sent << ",\"received\":" << g_Received
+              << ",\"throughput\":" << g_Received / seconds
+              << ",\"p50_us\":" << p50 << ",\"p99_us\":" << p99 << "}"
+              << std::endl;
+    return 0;
+  }
+  std::cout << mode << ": sent = " << g_Sent << " (" << g_Sent / seconds
+            << "/s), received = " << g_Received << " ("
+            << g_Received / seconds << "/s)";
+  if (not g_Latencies.empty()) {
+    std::cout << ", latency p50 = " << p50 << " us, p99 = " << p99 << " us";
+  }
+  if (g_Lookups > 0) {
+    std::cout << ", hit ratio = "
+              << static_cast<double>(g_Hits) / static_cast<double>(g_Lookups);
+  }
+  std::cout << std::endl;
 }
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Hashed timer wheel with a fixed tick. Timers cannot be cancelled; owners
+// tag the key (e.g. with a generation) and ignore stale expirations, which
+// keeps scheduling O(1) and free of any lookup structure.
+template <class Key>
+class TimerWheel {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  TimerWheel() = delete;
+  TimerWheel(const size_t number_of_slots, const std::chrono::milliseconds tick)
+      : tick_{tick}, slots_(number_of_slots), last_advance_{Clock::now()} {}
+
+  void Schedule(const Key &key, const std::chrono::milliseconds delay) {
+    uint64_t ticks{static_cast<uint64_t>(delay / tick_)};
+    if (ticks == 0) {
+      ticks = 1;
+    }
+    const uint64_t expires{current_tick_ + ticks};
+    slots_[expires % slots_.size()].push_back(
+        Entry{key, (ticks - 1) / slots_.size()});
+  }
+
+  template <class Callback>
+  void Advance(Callback &&on_expired) {
+    const auto now{Clock::now()};
+    while (now - last_advance_ >= tick_) {
+      last_advance_ += tick_;
+      ++current_tick_;
+      auto &slot{slots_[current_tick_ % slots_.size()]};
+      expired_.clear();
+      size_t kept{};
+      for (auto &entry : slot) {
+        if (entry.rounds == 0) {
+          expired_.push_back(entry.key);
+        } else {
+          --entry.rounds;
+          slot[kept++] = entry;
+        }
+      }
+      slot.resize(kept);
+      for (const auto &key : expired_) {
+        on_expired(key);
+      }
+    }
+  }
+
+  uint64_t CurrentTick() const { return current_tick_; }
+  std::chrono::milliseconds tick() const { return tick_; }
+
+ private:
+  struct Entry {
+    Key key;
+    uint64_t rounds{};
+  };
+
+  std::chrono::milliseconds tick_{};
+  std::vector<std::vector<Entry>> slots_{};
+  std::vector<Key> expired_{};
+  uint64_t current_tick_{};
+  Clock::time_point last_advance_{};
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+// Connection lifecycle tracing. Build with -DRTK_TRACE=ON to record events
+// into per-thread rings; without it TRACE_EVENT expands to nothing.
+
+#ifdef RTK_TRACE
+
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cache_line.h"
+
+enum class TraceKind : uint32_t {
+  kAccept,
+  kAddJob,
+  kPickAJob,
+  kFirstRecv,
+  kClose,
+};
+
+inline const char *TraceKindName(const TraceKind kind) {
+  switch (kind) {
+    case TraceKind::kAccept:
+      return "accept";
+    case TraceKind::kAddJob:
+      return "add_job";
+    case TraceKind::kPickAJob:
+      return "pick_a_job";
+    case TraceKind::kFirstRecv:
+      return "first_recv";
+    case TraceKind::kClose:
+      return "close";
+  }
+  return "unknown";
+}
+
+struct TraceEvent {
+  uint64_t ticks{};
+  uint64_t id{};
+  TraceKind kind{};
+};
+
+// Ticks come from rdtsc where available and are converted to nanoseconds
+// only when the trace is written out.
+class TraceClock {
+ public:
+  TraceClock() {
+    const uint64_t start_ticks{Now()}, start_ns{MonotonicRawNs()};
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    const uint64_t ticks{Now() - start_ticks}, ns{MonotonicRawNs() - start_ns};
+    ns_per_tick_ = ticks > 0 ? static_cast<double>(ns) / ticks : 1.;
+    base_ticks_ = start_ticks;
+  }
+
+  static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return MonotonicRawNs();
+#endif
+  }
+
+  double ToMicroseconds(const uint64_t ticks) const {
+    return static_cast<double>(ticks - base_ticks_) * ns_per_tick_ / 1e3;
+  }
+
+ private:
+  static uint64_t MonotonicRawNs() {
+    struct timespec now {};
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull +
+           static_cast<uint64_t>(now.tv_nsec);
+  }
+
+  double ns_per_tick_{1.};
+  uint64_t base_ticks_{};
+};
+
+// Written only by its owner thread; the dumper copies a snapshot and drops
+// whatever was overwritten while it was copying. Slots are copied field by
+// field through relaxed atomics, so a torn copy is possible but never a data
+// race, and the second load of next_ tells which copies may be torn.
+class alignas(kCacheLineSize) TraceRing {
+ public:
+  static constexpr size_t kCapacity{4096};
+
+  TraceRing(const uint32_t thread_id) : thread_id_{thread_id} {}
+
+  void Record(const TraceKind kind, const uint64_t id) {
+    const uint64_t index{next_.load(std::memory_order_relaxed)};
+    auto &slot{slots_[index & (kCapacity - 1)]};
+    // Pairs with the acquire fence in Snapshot(): a reader that sees any of
+    // these stores also sees next_ == index.
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.ticks.store(TraceClock::Now(), std::memory_order_relaxed);
+    slot.id.store(id, std::memory_order_relaxed);
+    slot.kind.store(kind, std::memory_order_relaxed);
+    next_.store(index + 1, std::memory_order_release);
+  }
+
+  std::vector<TraceEvent> Snapshot() const {
+    const uint64_t end{next_.load(std::memory_order_acquire)};
+    const uint64_t begin{end > kCapacity ? end - kCapacity : 0};
+    std::vector<TraceEvent> events{};
+    events.reserve(end - begin);
+    for (uint64_t i{begin}; i < end; ++i) {
+      const auto &slot{slots_[i & (kCapacity - 1)]};
+      events.push_back(TraceEvent{slot.ticks.load(std::memory_order_relaxed),
+                                  slot.id.load(std::memory_order_relaxed),
+                                  slot.kind.load(std::memory_order_relaxed)});
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // While next_ == after the owner may be writing index |after|, whose slot
+    // is shared with index after - kCapacity, so that one is dropped too.
+    const uint64_t after{next_.load(std::memory_order_relaxed)};
+    const uint64_t first_intact{after >= kCapacity ? after - kCapacity + 1 : 0};
+    if (first_intact > begin) {
+      const uint64_t overwritten{
+          std::min<uint64_t>(first_intact - begin, events.size())};
+      events.erase(events.begin(),
+                   events.begin() + static_cast<std::ptrdiff_t>(overwritten));
+    }
+    return events;
+  }
+
+  uint32_t thread_id() const { return thread_id_; }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> ticks{};
+    std::atomic<uint64_t> id{};
+    std::atomic<TraceKind> kind{};
+  };
+
+  uint32_t thread_id_{};
+  std::atomic<uint64_t> next_{};
+  std::array<Slot, kCapacity> slots_{};
+};
+
+class Tracer {
+ public:
+  TraceRing *Register() {
+    std::scoped_lock lock{access_};
+    rings_.emplace_back(new TraceRing{static_cast<uint32_t>(rings_.size())});
+    return rings_.back().get();
+  }
+
+  // Writes every ring as Chrome trace JSON, loadable in chrome://tracing or
+  // Perfetto.
+  bool Dump(const std::string &file_name) {
+    std::scoped_lock lock{access_};
+    std::ofstream out{file_name, std::ios::out | std::ios::trunc};
+    if (not out) {
+      return false;
+    }
+    out << std::fixed << std::setprecision(3)
+        << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first{true};
+    const int pid{static_cast<int>(getpid())};
+    for (const auto &ring : rings_) {
+      for (const auto &event : ring->Snapshot()) {
+        out << (first ? "\n" : ",\n") << "{\"name\":\""
+            << TraceKindName(event.kind)
+            << "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":" << pid
+            << ",\"tid\":" << ring->thread_id()
+            << ",\"ts\":" << clock_.ToMicroseconds(event.ticks)
+            << ",\"args\":{\"id\":" << event.id << "}}";
+        first = false;
+      }
+    }
+    out << "\n]}\n";
+    return true;
+  }
+
+  // Async-signal-safe: only writes one byte to the dumper's pipe.
+  void RequestDump() {
+    if (pipe_[1] >= 0) {
+      const char byte{'d'};
+      ssize_t written{write(pipe_[1], &byte, 1)};
+      (void)written;
+    }
+  }
+
+  // Requests a dump when |latency| crosses the threshold, at most once per
+  // second so a burst of slow requests produces one file.
+  void CheckLatency(const std::chrono::nanoseconds latency) {
+    if (threshold_.count() == 0 or latency < threshold_) {
+      return;
+    }
+    const int64_t now{std::chrono::duration_cast<std::chrono::seconds>(
+                          std::chrono::steady_clock::now().time_since_epoch())
+                          .count()};
+    int64_t last{last_threshold_dump_.load(std::memory_order_relaxed)};
+    if (now > last and
+        last_threshold_dump_.compare_exchange_strong(last, now)) {
+      RequestDump();
+    }
+  }
+
+  // Starts the thread that writes rtk_trace_<pid>_<n>.json whenever a dump
+  // is requested by SIGUSR1 or by CheckLatency().
+  void StartDumper(const std::chrono::nanoseconds latency_threshold) {
+    threshold_ = latency_threshold;
+    if (pipe2(pipe_, O_CLOEXEC) < 0) {
+      return;
+    }
+    std::thread{[this] {
+      char byte{};
+      int number{};
+      while (read(pipe_[0], &byte, 1) == 1) {
+        Dump("rtk_trace_" + std::to_string(getpid()) + "_" +
+             std::to_string(number++) + ".json");
+      }
+    }}.detach();
+  }
+
+ private:
+  std::mutex access_{};
+  std::vector<std::unique_ptr<TraceRing>> rings_{};
+  TraceClock clock_{};
+  int pipe_[2]{-1, -1};
+  std::chrono::nanoseconds threshold_{};
+  std::atomic<int64_t> last_threshold_dump_{};
+};
+
+inline Tracer &Tracing() {
+  static Tracer tracer{};
+  return tracer;
+}
+
+inline TraceRing &LocalTraceRing() {
+  thread_local TraceRing *ring{Tracing().Register()};
+  return *ring;
+}
+
+template <class Job, class = void>
+struct HasSocket : std::false_type {};
+template <class Job>
+struct HasSocket<Job, std::void_t<decltype(std::declval<Job>().sock)>>
+    : std::true_type {};
+
+template <class Job>
+uint64_t TraceIdOf(const Job &job) {
+  if constexpr (HasSocket<Job>::value) {
+    return static_cast<uint64_t>(job.sock);
+  } else {
+    (void)job;
+    return 0;
+  }
+}
+
+inline void TraceDumpOnSignal(int signal) {
+  (void)signal;
+  Tracing().RequestDump();
+}
+
+#define TRACE_EVENT(kind, id) \
+  LocalTraceRing().Record(TraceKind::kind, static_cast<uint64_t>(id))
+#define TRACE_LATENCY(latency) Tracing().CheckLatency(latency)
+
+#else
+
+#define TRACE_EVENT(kind, id)
+#define TRACE_LATENCY(latency)
+
+#endif
@@ -0,0 +1,309 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+#include "rate_limiter.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+constexpr size_t kMaxDatagramSize{1500};
+constexpr size_t kMaxCoalescedDatagramSize{65535};
+
+// Buffers, iovecs and headers for one recvmmsg()/sendmmsg() round. The same
+// storage is used for the reply, so an echo does not copy the payload.
+template <size_t BatchSize>
+class UdpBatch {
+ public:
+  UdpBatch() = delete;
+  UdpBatch(const size_t datagram_size)
+      : datagram_size_{datagram_size}, buffers_(BatchSize * datagram_size) {
+    for (size_t i{}; i < BatchSize; ++i) {
+      iovecs_[i].iov_base = buffers_.data() + i * datagram_size_;
+      messages_[i].msg_hdr.msg_name = &addresses_[i];
+      messages_[i].msg_hdr.msg_iov = &iovecs_[i];
+      messages_[i].msg_hdr.msg_iovlen = 1;
+      messages_[i].msg_hdr.msg_control = controls_[i].data();
+    }
+  }
+
+  void PrepareForReceive() {
+    for (size_t i{}; i < BatchSize; ++i) {
+      iovecs_[i].iov_len = datagram_size_;
+      messages_[i].msg_len = 0;
+      messages_[i].msg_hdr.msg_namelen = sizeof(addresses_[i]);
+      messages_[i].msg_hdr.msg_controllen = controls_[i].size();
+      messages_[i].msg_hdr.msg_flags = 0;
+    }
+  }
+
+  // Turns received message |index| into a reply carrying the same payload
+  // back to its sender. A GRO-coalesced burst is sent back as one GSO write.
+  void EchoBack(const size_t index) {
+    auto &header{messages_[index].msg_hdr};
+    const uint16_t segment_size{SegmentSize(index)};
+    iovecs_[index].iov_len = messages_[index].msg_len;
+    if (segment_size > 0 and messages_[index].msg_len > segment_size) {
+      struct cmsghdr *cmsg{reinterpret_cast<struct cmsghdr *>(
+          controls_[index].data())};
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      std::memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+      header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+    } else {
+      header.msg_controllen = 0;
+    }
+  }
+
+  // Moves received message |from| down to slot |to|, leaving the ones in
+  // between out of the reply. Buffers are swapped, not copied.
+  void MoveDown(const size_t from, const size_t to) {
+    std::swap(iovecs_[from].iov_base, iovecs_[to].iov_base);
+    addresses_[to] = addresses_[from];
+    controls_[to] = controls_[from];
+    auto &header{messages_[to].msg_hdr};
+    const auto &source{messages_[from].msg_hdr};
+    messages_[to].msg_len = messages_[from].msg_len;
+    header.msg_namelen = source.msg_namelen;
+    header.msg_controllen = source.msg_controllen;
+    header.msg_flags = source.msg_flags;
+  }
+
+  uint16_t SegmentSize(const size_t index) {
+    auto &header{messages_[index].msg_hdr};
+    if (header.msg_controllen == 0) {
+      return 0;
+    }
+    for (struct cmsghdr *cmsg{CMSG_FIRSTHDR(&header)}; cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&header, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP and cmsg->cmsg_type == UDP_GRO) {
+        int segment_size{};
+        std::memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+        return static_cast<uint16_t>(segment_size);
+      }
+    }
+    return 0;
+  }
+
+  unsigned char *data(const size_t index) {
+    return static_cast<unsigned char *>(iovecs_[index].iov_base);
+  }
+  size_t size(const size_t index) const { return messages_[index].msg_len; }
+  const struct sockaddr_in &address(const size_t index) const {
+    return addresses_[index];
+  }
+  struct mmsghdr *messages() {
+    return messages_.data();
+  }
+
+ private:
+  using Control = std::array<unsigned char, CMSG_SPACE(sizeof(int))>;
+
+  size_t datagram_size_{};
+  std::vector<unsigned char> buffers_{};
+  std::array<struct iovec, BatchSize> iovecs_{};
+  std::array<struct mmsghdr, BatchSize> messages_{};
+  std::array<struct sockaddr_in, BatchSize> addresses_{};
+  std::array<Control, BatchSize> controls_{};
+};
+
+template <size_t BatchSize>
+struct UdpEchoHandler {
+  static constexpr const char *kName{"udp_echo"};
+  static constexpr size_t kBatchSize{BatchSize};
+
+  size_t perform(UdpBatch<BatchSize> &batch, const size_t received,
+                 int thread_number) {
+    (void)thread_number;
+#ifdef DEBUG_
+    std::cerr << "DATAGRAMS [" << thread_number << "]: " << received
+              << std::endl;
+#endif
+    size_t replies{};
+    for (size_t i{}; i < received; ++i) {
+      if (not RateLimits().Allow(batch.address(i))) {
+        LocalMetrics().requests_rate_limited.Add();
+        continue;
+      }
+      if (replies != i) {
+        batch.MoveDown(i, replies);
+      }
+      batch.EchoBack(replies++);
+    }
+    return replies;
+  }
+};
+
+// Every worker owns one SO_REUSEPORT socket bound to the same port, so the
+// kernel shards incoming flows between workers and they never share a queue.
+template <class DatagramHandler>
+class UdpServer {
+ public:
+  static constexpr size_t kBatchSize{DatagramHandler::kBatchSize};
+
+  UdpServer() = delete;
+  UdpServer(const int port_number, const int number_of_workers,
+            const bool use_gro = false)
+      : port_{port_number},
+        use_gro_{use_gro},
+        datagram_size_{use_gro ? kMaxCoalescedDatagramSize
+                               : kMaxDatagramSize} {
+    for (int i{}; i < number_of_workers; ++i) {
+      sockets_.push_back(PrepareSocket());
+    }
+  }
+  ~UdpServer() {
+    StopPolitely();
+    JoinWorkers();
+    CloseSockets();
+  }
+
+  void StopImmediately() {
+    StopPolitely();
+    CloseSockets();
+  }
+
+  void StopPolitely() {
+    is_running_ = false;
+    for (const auto sock : sockets_) {
+      shutdown(sock, SHUT_RDWR);
+    }
+  }
+
+  void start() {
+    is_running_ = true;
+    for (size_t i{}; i < sockets_.size(); ++i) {
+      workers_.emplace_back(&UdpServer::WorkerMain, this, static_cast<int>(i));
+    }
+    JoinWorkers();
+  }
+
+ private:
+  void WorkerMain(const int thread_number) {
+    const int sock{sockets_.at(thread_number)};
+    UdpBatch<kBatchSize> batch{datagram_size_};
+    DatagramHandler handler{};
+    auto &metrics{LocalMetrics()};
+    const size_t handler_index{
+        Metrics().HandlerIndex(DatagramHandler::kName)};
+    while (is_running_) {
+      batch.PrepareForReceive();
+      int received{recvmmsg(sock, batch.messages(), kBatchSize,
+                            MSG_WAITFORONE, nullptr)};
+      if (received < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else {
+          break;
+        }
+      } else if (received == 0) {
+        break;
+      }
+      const auto started{std::chrono::steady_clock::now()};
+      for (int i{}; i < received; ++i) {
+        metrics.bytes_in.Add(batch.size(static_cast<size_t>(i)));
+      }
+      const size_t replies{
+          handler.perform(batch, static_cast<size_t>(received), thread_number)};
+      metrics.bytes_out.Add(SendAll(sock, batch, replies));
+      metrics.handler_latency[handler_index].Record(
+          std::chrono::steady_clock::now() - started);
+    }
+  }
+
+  // Returns the number of payload bytes handed to the kernel.
+  uint64_t SendAll(const int sock, UdpBatch<kBatchSize> &batch,
+                   const size_t count) {
+    uint64_t bytes{};
+    size_t sent_total{};
+    while (sent_total < count) {
+      int sent{sendmmsg(sock, batch.messages() + sent_total,
+                        static_cast<unsigned int>(count - sent_total), 0)};
+      if (sent <= 0) {
+        if (sent < 0 and errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      for (int i{}; i < sent; ++i) {
+        bytes += batch.messages()[sent_total + static_cast<size_t>(i)].msg_len;
+      }
+      sent_total += static_cast<size_t>(sent);
+    }
+    return bytes;
+  }
+
+  int PrepareSocket() {
+    int sock{socket(AF_INET, SOCK_DGRAM, 0)};
+    if (sock < 0) {
+      throw std::runtime_error{"socket() failed"};
+    }
+    int optval{1};
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) or
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval))) {
+      close(sock);
+      throw std::runtime_error{"setsockopt() failed"};
+    }
+    if (use_gro_ and
+        setsockopt(sock, SOL_UDP, UDP_GRO, &optval, sizeof(optval))) {
+      close(sock);
+      throw std::runtime_error{"setsockopt(UDP_GRO) failed"};
+    }
+    struct sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port_);
+
+    if (bind(sock, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address)) < 0) {
+      close(sock);
+      throw std::runtime_error{"bind() failed"};
+    }
+    return sock;
+  }
+
+  void JoinWorkers() {
+    for (auto &w : workers_) {
+      if (w.joinable()) {
+        w.join();
+      }
+    }
+  }
+
+  void CloseSockets() {
+    for (auto &sock : sockets_) {
+      if (sock >= 0) {
+        close(sock);
+        sock = -1;
+      }
+    }
+  }
+
+  int port_{};
+  bool use_gro_{false};
+  size_t datagram_size_{};
+  std::vector<int> sockets_{};
+  std::vector<std::thread> workers_{};
+  std::atomic<bool> is_running_{false};
+};